@@ -0,0 +1,405 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Microbenchmarks for the shell's own overhead: parsing, the data structures
+// and launching/reaping jobs. Every benchmark is run for a number of samples,
+// each timing a batch of operations, and the median and 99th percentile time
+// per operation are reported so runs can be compared against each other.
+//
+// Usage: marcel-bench [name...]
+// With no names every benchmark is run, otherwise only those whose name starts
+// with one of the arguments
+
+#include <stdbool.h>
+#include <stdio.h> // printf, snprintf
+#include <stdlib.h> // qsort
+#include <string.h> // strncmp, strlen
+
+#include <spawn.h> // posix_spawn
+#include <sys/wait.h> // waitpid
+#include <time.h> // clock_gettime
+#include <unistd.h> // fork, execve, _exit
+
+#include "ds/arena.h" // arena_new, arena_free
+#include "ds/hash_table.h" // new_table, table_add, table_find...
+#include "ds/proc.h" // job, new_job, free_single_job
+#include "ds/vec.h" // vec_alloc, vec_append, vec_alloc_arena
+#include "execute.h" // initialize_builtins, launch_job
+#include "jobs.h" // initialize_job_control, register_job...
+#include "launcher.h" // start_launcher
+#include "parse_cache.h" // initialize_parse_cache, parse_job
+#include "parser.h" // yyparse, scan_line
+#include "lexer.h" // yy_delete_buffer
+#include "options.h" // Num_opt, OPT_GLOBCACHE
+#include "wildcard.h" // glob_word
+#include "macros.h" // Arr_len, Stopif, Assert_alloc
+
+#define SAMPLES 101
+#define MAX_SAMPLES 1024
+#define TRUE_PATH "/bin/true"
+// Jobs in the job table at once in bench_job_table
+#define JOB_BATCH 1024
+
+// Defined by marcel.c in the shell itself
+int exit_code;
+extern char **environ;
+
+typedef struct bench {
+    char const *name;
+    // Number of operations each sample times
+    size_t batch;
+    // Number of samples taken, SAMPLES if 0
+    size_t samples;
+    // Runs one batch, returning false if the benchmark can't be run
+    bool (*run)(size_t batch, void *arg);
+    void *arg;
+} bench;
+
+static char const *corpus[] = {
+    "ls",
+    "ls -la /usr/bin",
+    "echo hello world",
+    "cat < /etc/passwd > /tmp/out 2> /dev/null",
+    "grep -v '^#' config | sort | uniq -c | sort -rn | head",
+    "FOO=bar BAZ=qux env \"quoted value\"",
+    "make -j8 release &",
+    "find . -name '*.c' | xargs wc -l >> counts",
+};
+
+static inline double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(void const *a, void const *b)
+{
+    double x = *(double const *) a, y = *(double const *) b;
+    return (x > y) - (x < y);
+}
+
+// Print time in the most readable unit
+static void print_time(double ns)
+{
+    if (ns < 1e3) {
+        printf("%10.1f ns", ns);
+    } else if (ns < 1e6) {
+        printf("%10.2f us", ns / 1e3);
+    } else {
+        printf("%10.2f ms", ns / 1e6);
+    }
+}
+
+static void run_bench(bench const *b)
+{
+    static double times[MAX_SAMPLES];
+    size_t samples = b->samples ? b->samples : SAMPLES;
+    // Warm up caches, the command hash and the allocator
+    if (!b->run(b->batch, b->arg)) {
+        printf("%-24s (skipped)\n", b->name);
+        return;
+    }
+    for (size_t i = 0; i < samples; i++) {
+        double start = now_ns();
+        b->run(b->batch, b->arg);
+        times[i] = (now_ns() - start) / b->batch;
+    }
+    qsort(times, samples, sizeof *times, cmp_double);
+    printf("%-24s", b->name);
+    print_time(times[samples / 2]);
+    print_time(times[(samples * 99) / 100]);
+    print_time(times[0]);
+    printf("\n");
+}
+
+// Parse line the way marcel.c does. Returns the job, or NULL if it didn't
+// parse
+static job *parse(char const *line)
+{
+    job *j = new_job();
+    j->name = arena_strdup(j->arena, line);
+    YY_BUFFER_STATE b = scan_line(j->arena, line, strlen(line));
+    bool ok = !yyparse(j) && j->valid;
+    yy_delete_buffer(b);
+    if (!ok) {
+        free_single_job(j);
+        return NULL;
+    }
+    return j;
+}
+
+static bool bench_parse(size_t batch, void *arg)
+{
+    (void) arg;
+    for (size_t i = 0; i < batch; i++) {
+        job *j = parse(corpus[i % Arr_len(corpus)]);
+        Stopif(!j, return false, "Could not parse %s",
+               corpus[i % Arr_len(corpus)]);
+        free_single_job(j);
+    }
+    return true;
+}
+
+// The same corpus through the parse cache, so after the warmup every line is a
+// hit
+static bool bench_parse_cached(size_t batch, void *arg)
+{
+    (void) arg;
+    for (size_t i = 0; i < batch; i++) {
+        char const *line = corpus[i % Arr_len(corpus)];
+        job *j = new_job();
+        j->name = arena_strdup(j->arena, line);
+        bool ok = parse_job(j, strlen(line));
+        free_single_job(j);
+        Stopif(!ok, return false, "Could not parse %s", line);
+    }
+    return true;
+}
+
+// Appends batch ints to a vec starting at its smallest size, so vec_grow is
+// included in the cost
+static bool bench_vec_append(size_t batch, void *arg)
+{
+    (void) arg;
+    int *v = vec_alloc(sizeof *v);
+    Assert_alloc(v);
+    for (size_t i = 0; i < batch; i++) {
+        int x = i;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wincompatible-pointer-types"
+        vec_append(&x, sizeof x, &v);
+#pragma GCC diagnostic pop
+    }
+    vec_free(v);
+    return true;
+}
+
+#define N_KEYS 4096
+static char keys[N_KEYS][16];
+
+// Add, find and remove N_KEYS keys. One operation is one of each
+static bool bench_hash_table(size_t batch, void *arg)
+{
+    (void) arg;
+    (void) batch;
+    hash_table *t = new_table(TABLE_INIT_SIZE);
+    Assert_alloc(t);
+    for (size_t i = 0; i < N_KEYS; i++) {
+        table_add(keys[i], 0, keys[i], t);
+    }
+    for (size_t i = 0; i < N_KEYS; i++) {
+        Stopif(table_find(keys[i], 0, t) != keys[i], return false,
+               "Lost key %s", keys[i]);
+    }
+    for (size_t i = 0; i < N_KEYS; i++) {
+        table_remove(keys[i], 0, t);
+    }
+    free_table(t, NULL);
+    return true;
+}
+
+static bool wait_child(pid_t pid)
+{
+    int status;
+    return pid > 0 && waitpid(pid, &status, 0) == pid;
+}
+
+static char *true_argv[] = {TRUE_PATH, NULL};
+
+static bool bench_posix_spawn(size_t batch, void *arg)
+{
+    (void) arg;
+    for (size_t i = 0; i < batch; i++) {
+        pid_t pid;
+        int err = posix_spawn(&pid, TRUE_PATH, NULL, NULL, true_argv, environ);
+        Stopif(err || !wait_child(pid), return false,
+               "posix_spawn: %s", strerror(err));
+    }
+    return true;
+}
+
+static bool bench_fork(size_t batch, void *arg)
+{
+    (void) arg;
+    for (size_t i = 0; i < batch; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            execve(TRUE_PATH, true_argv, environ);
+            _exit(127);
+        }
+        Stopif(!wait_child(pid), return false, "fork: %s", strerror(errno));
+    }
+    return true;
+}
+
+// Parse, launch and wait for the command line in arg, the whole path a line
+// typed into the shell takes
+static bool bench_launch(size_t batch, void *arg)
+{
+    for (size_t i = 0; i < batch; i++) {
+        job *j = parse(arg);
+        Stopif(!j, return false, "Could not parse %s", (char *) arg);
+        register_job(j);
+        launch_job(j);
+        report_job_status();
+    }
+    return true;
+}
+
+// bench_launch with every line a round trip to a cat coprocess, what running
+// a tool costs once it is kept running. The coprocess is left running once
+// started, so this comes after the benchmarks that wait for every job
+static bool bench_cosend(size_t batch, void *arg)
+{
+    static bool started;
+    if (!started) {
+        Stopif(!bench_launch(1, "coproc bench cat"), return false,
+               "Could not start coprocess");
+        started = true;
+    }
+    return bench_launch(batch, arg);
+}
+
+// bench_launch with the commands started by the launcher. It is left running
+// once started, so this comes after everything else
+static bool bench_launcher(size_t batch, void *arg)
+{
+    Stopif(!start_launcher(), return false, "Could not start launcher");
+    return bench_launch(batch, arg);
+}
+
+// Launch batch background jobs, then time how long it takes until they have
+// all been reaped and reported
+static bool bench_reap(size_t batch, void *arg)
+{
+    (void) arg;
+    for (size_t i = 0; i < batch; i++) {
+        job *j = parse("true &");
+        Stopif(!j, return false, "Could not parse true &");
+        register_job(j);
+        launch_job(j);
+    }
+    while (live_job_count()) {
+        report_job_status();
+    }
+    return true;
+}
+
+// Glob the pattern arg batch times, reading the directory each time unless
+// listings are cached
+static bool bench_glob(size_t batch, void *arg, long cache)
+{
+    Num_opt(OPT_GLOBCACHE) = cache;
+    arena *a = arena_new();
+    Stopif(!a, return false, "Out of memory");
+    for (size_t i = 0; i < batch; i++) {
+        char **argv = vec_alloc_arena(sizeof *argv, a);
+        Stopif(!glob_word(arg, a, &argv), arena_free(a); return false,
+               "%s matches nothing", (char *) arg);
+    }
+    arena_free(a);
+    Num_opt(OPT_GLOBCACHE) = 0;
+    return true;
+}
+
+static bool bench_glob_cold(size_t batch, void *arg)
+{
+    return bench_glob(batch, arg, 0);
+}
+
+static bool bench_glob_cached(size_t batch, void *arg)
+{
+    return bench_glob(batch, arg, 60);
+}
+
+// Register batch jobs, unregister every other one and register them again,
+// then unregister them all, the way jobs come and go in the job table
+static bool bench_job_table(size_t batch, void *arg)
+{
+    (void) arg;
+    static job *jobs[JOB_BATCH];
+    for (size_t i = 0; i < batch; i++) {
+        jobs[i] = new_job();
+        Stopif(!register_job(jobs[i]), return false, "Job table is full");
+    }
+    for (size_t i = 0; i < batch; i += 2) {
+        unregister_job(jobs[i]);
+        jobs[i] = new_job();
+        register_job(jobs[i]);
+    }
+    for (size_t i = 0; i < batch; i++) {
+        unregister_job(jobs[i]);
+    }
+    return true;
+}
+
+static bench benches[] = {
+    {"parse", 1000, 0, bench_parse, NULL},
+    {"parse/cached", 1000, 0, bench_parse_cached, NULL},
+    {"vec_append", 100000, 0, bench_vec_append, NULL},
+    {"hash_table", N_KEYS, 0, bench_hash_table, NULL},
+    {"spawn/posix_spawn", 20, 0, bench_posix_spawn, NULL},
+    {"spawn/fork", 20, 0, bench_fork, NULL},
+    {"launch/1", 20, 0, bench_launch, "true"},
+    {"pipeline/2", 10, 0, bench_launch, "true | true"},
+    {"pipeline/4", 10, 0, bench_launch, "true | true | true | true"},
+    {"pipeline/8", 5, 0, bench_launch,
+        "true | true | true | true | true | true | true | true"},
+    {"reap/64", 64, 21, bench_reap, NULL},
+    {"jobs/table", JOB_BATCH, 0, bench_job_table, NULL},
+    {"glob", 100, 0, bench_glob_cold, "/usr/include/*.h"},
+    {"glob/cached", 100, 0, bench_glob_cached, "/usr/include/*.h"},
+    {"cosend", 1000, 0, bench_cosend, "cosend bench line > /dev/null"},
+    {"launch/launcher", 20, 0, bench_launcher, "true"},
+};
+
+static bool selected(char const *name, int argc, char *argv[])
+{
+    if (argc < 2) {
+        return true;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(name, argv[i], strlen(argv[i])) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    Stopif(!initialize_builtins(), return M_FAILED_INIT,
+           "Could not initialize builtin commands");
+    Stopif(!initialize_parse_cache(), return M_FAILED_INIT,
+           "Could not initialize parse cache");
+    // Jobs are run the way they are in a script
+    Stopif(!initialize_job_control(false), return M_FAILED_INIT,
+           "Could not initialize job control");
+    for (size_t i = 0; i < N_KEYS; i++) {
+        snprintf(keys[i], sizeof keys[i], "key%zu", i);
+    }
+
+    printf("%-24s%13s%13s%13s\n", "benchmark", "median", "p99", "min");
+    for (size_t i = 0; i < Arr_len(benches); i++) {
+        if (selected(benches[i].name, argc, argv)) {
+            run_bench(&benches[i]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,286 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE // strchrnul
+
+#include <stdio.h> // readline
+#include <stdlib.h> // malloc, free, qsort, atexit
+#include <string.h> // strcmp, strncmp, strdup, strchrnul
+
+#include <dirent.h> // opendir, readdir, dirfd
+#include <fcntl.h> // fstatat, faccessat
+#include <sys/stat.h> // stat, S_ISREG
+#include <unistd.h> // X_OK
+#include <linux/limits.h> // PATH_MAX
+
+#include <readline/readline.h> // rl_*
+
+#include "ds/arena.h" // arena, arena_strdup, arena_strndup
+#include "ds/hash_table.h" // table_next
+#include "ds/vec.h" // vec_alloc, Vec_push, vec_len
+#include "complete.h" // prototypes
+#include "execute.h" // lookup_table, CMD, DEFAULT_PATH
+#include "macros.h" // Assert_alloc, Free, Cleanup
+
+#define INDEX_INIT_SIZE 1024
+
+// An executable found on PATH
+typedef struct path_cmd {
+    char const *name;
+    size_t dir; // Index of the directory in PATH it was found in
+} path_cmd;
+
+// Every executable in the directories of one value of PATH, sorted by name.
+// A name found in several directories is only listed for the first. The
+// index is rebuilt whenever PATH or the mtime of one of its directories
+// changes
+static struct {
+    char *path; // PATH the index was built from, NULL if there is no index
+    arena *arena; // Names and directories
+    char const **dirs;
+    struct timespec *mtimes;
+    size_t n_dirs;
+    bool relative; // PATH has entries relative to the working directory
+    path_cmd *cmds; // vec
+} idx;
+
+static void free_index(void);
+static char **complete(char const *text, int start, int end);
+
+// Use command completion for the first word of a command and filename
+// completion for everything else
+void initialize_completion(void)
+{
+    rl_attempted_completion_function = complete;
+    rl_bind_key('\t', rl_complete);
+    atexit(free_index);
+}
+
+static void free_index(void)
+{
+    Free(idx.path);
+    Free(idx.dirs);
+    Free(idx.mtimes);
+    Cleanup(idx.arena, arena_free);
+    if (idx.cmds) {
+        vec_free(idx.cmds);
+        idx.cmds = NULL;
+    }
+}
+
+static int cmd_cmp(void const *a, void const *b)
+{
+    path_cmd const *x = a, *y = b;
+    int ret = strcmp(x->name, y->name);
+    if (ret == 0) {
+        // Earlier directories first, so they win when duplicates are dropped
+        ret = (x->dir > y->dir) - (x->dir < y->dir);
+    }
+    return ret;
+}
+
+static inline bool same_time(struct timespec const *a,
+                             struct timespec const *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// Modification time of dir, zero if it can't be read
+static struct timespec dir_mtime(char const *dir)
+{
+    struct stat st;
+    if (stat(dir, &st) != 0) {
+        return (struct timespec) {0};
+    }
+    return st.st_mtim;
+}
+
+// Add the executables in dir to the index
+static void index_dir(size_t dir_i)
+{
+    DIR *d = opendir(idx.dirs[dir_i]);
+    if (!d) {
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+        if (ent->d_type == DT_DIR) {
+            continue;
+        }
+        // The same test search_path makes, so the index never offers what
+        // the shell wouldn't run
+        struct stat st;
+        if (fstatat(dirfd(d), ent->d_name, &st, 0) == 0 && S_ISREG(st.st_mode)
+                && faccessat(dirfd(d), ent->d_name, X_OK, 0) == 0) {
+            path_cmd c = {arena_strdup(idx.arena, ent->d_name), dir_i};
+            Vec_push(&idx.cmds, c);
+        }
+    }
+    closedir(d);
+}
+
+// Rebuild the index for path
+static void build_index(char const *path)
+{
+    free_index();
+    idx.path = strdup(path);
+    Assert_alloc(idx.path);
+    idx.arena = arena_new();
+    idx.cmds = vec_alloc(INDEX_INIT_SIZE * sizeof *idx.cmds);
+
+    size_t n = 1;
+    for (char const *p = path; *p; p++) {
+        n += *p == ':';
+    }
+    idx.dirs = malloc(n * sizeof *idx.dirs);
+    idx.mtimes = malloc(n * sizeof *idx.mtimes);
+    Assert_alloc(idx.dirs && idx.mtimes);
+    idx.n_dirs = 0;
+    idx.relative = false;
+
+    for (char const *dir = path;; dir++) {
+        char const *end = strchrnul(dir, ':');
+        // Commands in relative directories depend on where the shell is, so
+        // they are left to search_path
+        if (*dir != '/') {
+            idx.relative = true;
+        } else {
+            size_t i = idx.n_dirs++;
+            idx.dirs[i] = arena_strndup(idx.arena, dir, end - dir);
+            idx.mtimes[i] = dir_mtime(idx.dirs[i]);
+            index_dir(i);
+        }
+        if (!*end) {
+            break;
+        }
+        dir = end;
+    }
+
+    size_t len = vec_len(idx.cmds);
+    qsort(idx.cmds, len, sizeof *idx.cmds, cmd_cmp);
+    size_t kept = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!kept || strcmp(idx.cmds[kept - 1].name, idx.cmds[i].name) != 0) {
+            idx.cmds[kept++] = idx.cmds[i];
+        }
+    }
+    vec_setlen(kept, idx.cmds);
+}
+
+// True if the index is up to date for path
+static bool index_fresh(char const *path)
+{
+    if (!idx.path || strcmp(idx.path, path) != 0) {
+        return false;
+    }
+    for (size_t i = 0; i < idx.n_dirs; i++) {
+        struct timespec t = dir_mtime(idx.dirs[i]);
+        if (!same_time(&t, &idx.mtimes[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline char const *current_path(void)
+{
+    char const *path = getenv("PATH");
+    return path ? path : DEFAULT_PATH;
+}
+
+// Index of the first command in the index not ordered before prefix
+static size_t lower_bound(char const *prefix)
+{
+    size_t lo = 0, hi = vec_len(idx.cmds);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(idx.cmds[mid].name, prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Look name up in the index, writing its full path to buf (PATH_MAX bytes).
+// Only an index already built (by completion) that is up to date for path
+// and covers all of it is used. Returns false if name wasn't found in it
+bool path_index_find(char const *name, char const *path, char *buf)
+{
+    if (!idx.path || idx.relative || !index_fresh(path)) {
+        return false;
+    }
+    size_t i = lower_bound(name);
+    if (i == vec_len(idx.cmds) || strcmp(idx.cmds[i].name, name) != 0) {
+        return false;
+    }
+    char const *dir = idx.dirs[idx.cmds[i].dir];
+    int len = snprintf(buf, PATH_MAX, "%s/%s", dir, name);
+    return len > 0 && len < PATH_MAX;
+}
+
+// Readline generator for the names of builtins and executables on PATH
+// starting with text
+static char *command_generator(char const *text, int state)
+{
+    static size_t builtin_i, cmd_i, len;
+    if (!state) {
+        char const *path = current_path();
+        if (!index_fresh(path)) {
+            build_index(path);
+        }
+        builtin_i = 0;
+        cmd_i = lower_bound(text);
+        len = strlen(text);
+    }
+
+    table_entry const *e;
+    while ((e = table_next(&builtin_i, lookup_table))) {
+        if (e->type == CMD && strncmp(e->key, text, len) == 0) {
+            return strdup(e->key);
+        }
+    }
+    if (cmd_i < vec_len(idx.cmds)
+            && strncmp(idx.cmds[cmd_i].name, text, len) == 0) {
+        return strdup(idx.cmds[cmd_i++].name);
+    }
+    return NULL;
+}
+
+// True if the word starting at start is in command position: the first
+// word of the line or of a pipeline stage
+static bool command_position(int start)
+{
+    while (start > 0 && (rl_line_buffer[start - 1] == ' '
+                         || rl_line_buffer[start - 1] == '\t')) {
+        start--;
+    }
+    return start == 0 || rl_line_buffer[start - 1] == '|'
+        || rl_line_buffer[start - 1] == '&';
+}
+
+static char **complete(char const *text, int start, int end)
+{
+    (void) end;
+    // Paths are completed as files. So is anything that matches no command
+    if (!command_position(start) || strchr(text, '/')) {
+        return NULL;
+    }
+    return rl_completion_matches(text, command_generator);
+}
@@ -0,0 +1,384 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// coproc NAME command [arg...]
+// coproc -c NAME
+// coproc
+// cosend NAME [line...]
+//
+// A coprocess is a long-lived command whose stdin and stdout are pipes kept by
+// the shell, so a tool that is slow to start (an interpreter, say) is started
+// once and then asked one line at a time. cosend writes its arguments to the
+// coprocess as a line and copies the line that comes back to stdout, which
+// makes $(cosend NAME ...) the way to use a reply as an argument. Without
+// arguments it does the same for every line of its input, so it can be a
+// stage of a pipeline. The command has to answer every line with exactly one
+// line, and flush it (python -u, jq --unbuffered...), or cosend waits until
+// it is interrupted.
+//
+// The coprocess is a background job in the job table like any other, except
+// that it takes no background slot and `wait` doesn't wait for it: it runs
+// until its input is closed, by coproc -c or the shell exiting. coproc on its
+// own lists the coprocesses that are running.
+
+#define _GNU_SOURCE // dprintf, stpcpy, sigtimedwait
+
+#include <errno.h> // errno, EINTR
+#include <stdlib.h> // malloc, free
+#include <string.h> // strcmp, strdup, strlen, stpcpy, strerror
+
+#include <fcntl.h> // fcntl, F_DUPFD_CLOEXEC
+#include <poll.h> // poll, pollfd
+#include <signal.h> // sigset_t, sigtimedwait
+#include <stdio.h> // dprintf
+#include <sys/uio.h> // writev
+#include <time.h> // timespec
+#include <unistd.h> // close, read
+#ifdef __linux__
+#include <sys/signalfd.h> // signalfd, signalfd_siginfo
+#endif
+
+#include "ds/arena.h" // arena_alloc
+#include "ds/hash_table.h" // table_find
+#include "ds/proc.h" // job, proc, new_job, new_proc, free_single_job
+#include "ds/vec.h" // Vec_push, vec_alloc, vec_len, vec_setlen
+#include "coproc.h" // prototypes
+#include "execute.h" // start_job, lookup_table
+#include "fdio.h" // make_pipe, shell_fd, write_all, line_reader, read_line
+#include "jobs.h" // register_job, mark_proc_completed
+#include "signals.h" // sig_block, sig_setmask
+#include "macros.h" // Stopif, Err_msg, Assert_alloc, Free
+
+#define COPROC_BUF_SIZE 4096
+#define COPROCS_INIT_SIZE 4
+
+typedef struct coproc {
+    char *name;
+    job *j;
+    int in; // Write end of the coprocess's stdin, -1 once closed
+    line_reader out; // Its stdout
+    // Replies still to come for lines sent before a ^C, which are skipped
+    size_t owed;
+} coproc;
+
+// Vec of the coprocesses that are running
+static coproc *coprocs;
+
+// signalfd a ^C is read from while cosend waits, -1 if there is none
+static int intr_fd = -1;
+
+static coproc *find_coproc(char const *name)
+{
+    for (size_t i = 0; coprocs && i < vec_len(coprocs); i++) {
+        if (strcmp(coprocs[i].name, name) == 0) {
+            return &coprocs[i];
+        }
+    }
+    return NULL;
+}
+
+// Called before read blocks on a coprocess or cosend's input. Returns false
+// if ^C was pressed first
+static bool wait_readable(int fd)
+{
+    if (intr_fd < 0) {
+        return true;
+    }
+    struct pollfd fds[] = {
+        {.fd = fd, .events = POLLIN},
+        {.fd = intr_fd, .events = POLLIN},
+    };
+    while (poll(fds, 2, -1) < 0) {
+        if (errno != EINTR) {
+            return true;
+        }
+    }
+#ifdef __linux__
+    if (fds[1].revents) {
+        struct signalfd_siginfo info;
+        (void) !read(intr_fd, &info, sizeof info);
+        return false;
+    }
+#endif
+    return true;
+}
+
+// Write len bytes of line and a newline to fd, with one writev unless the
+// pipe takes less. Returns false with errno set on failure
+static bool write_line(int fd, char const *line, size_t len)
+{
+    struct iovec iov[] = {{(void *) line, len}, {"\n", 1}};
+    ssize_t n;
+    while ((n = writev(fd, iov, 2)) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    if ((size_t) n > len) {
+        return true;
+    }
+    return write_all(fd, line + n, len - n) && write_all(fd, "\n", 1);
+}
+
+// Send line to c and copy its reply to out. Returns the exit code for cosend
+static int round_trip(coproc *c, char const *line, size_t len, int out)
+{
+    Stopif(!write_line(c->in, line, len), return 1,
+           "cosend: %s: %s", c->name, strerror(errno));
+    c->owed++;
+    char *reply;
+    do {
+        reply = read_line(&c->out);
+        if (!reply) {
+            Stopif(c->out.eof, return 1, "cosend: %s has exited", c->name);
+            return M_SIGINT;
+        }
+    } while (--c->owed);
+    Stopif(!write_line(out, reply, strlen(reply)), return 1,
+           "cosend: %s", strerror(errno));
+    return 0;
+}
+
+// Build the job that runs cmd as the coprocess name
+static job *coproc_job(char const *name, char **cmd)
+{
+    job *j = new_job();
+    arena *a = j->arena;
+    proc *p = new_proc(a);
+    Vec_push(&j->procs, p);
+
+    // Named "coproc NAME command args..." in `jobs`
+    size_t name_len = strlen("coproc ") + strlen(name) + 1;
+    for (char **arg = cmd; *arg; arg++) {
+        Vec_push(&p->argv, *arg);
+        name_len += strlen(*arg) + 1;
+    }
+    Vec_push(&p->argv, NULL);
+    j->name = arena_alloc(a, name_len);
+    char *end = stpcpy(stpcpy(j->name, "coproc "), name);
+    for (char **arg = cmd; *arg; arg++) {
+        *end++ = ' ';
+        end = stpcpy(end, *arg);
+    }
+
+    j->bkg = true;
+    j->coproc = true;
+    j->valid = true;
+    return j;
+}
+
+static int start_coproc(proc const *p, char const *name, char **cmd)
+{
+    Stopif(find_coproc(name), return 1, "coproc: %s is already running",
+           name);
+    Stopif(table_find(*cmd, CMD, lookup_table), return 1,
+           "coproc: %s is a builtin", *cmd);
+    // in is the coprocess's stdin, out its stdout
+    int in[2], out[2];
+    Stopif(make_pipe(in) < 0, return M_FAILED_IO,
+           "coproc: could not create pipe: %s", strerror(errno));
+    if (make_pipe(out) < 0) {
+        Err_msg("coproc: could not create pipe: %s", strerror(errno));
+        close(in[0]);
+        close(in[1]);
+        return M_FAILED_IO;
+    }
+
+    job *j = coproc_job(name, cmd);
+    proc *cp = j->procs[0];
+    cp->fds[0] = in[0];
+    cp->fds[1] = out[1];
+    cp->fds[2] = p->fds[2] == 2 ? 2 : fcntl(p->fds[2], F_DUPFD_CLOEXEC, 0);
+    bool registered = register_job(j);
+    if (!registered || start_job(j) != 0) {
+        // The ends meant for the coprocess are only closed once it's started
+        Err_msg("coproc: could not start %s", *cmd);
+        for (int i = 0; i < 3; i++) {
+            if (cp->fds[i] != i) {
+                close(cp->fds[i]);
+            }
+        }
+        close(in[1]);
+        close(out[0]);
+        if (registered) {
+            // Nothing was started, so nothing will be reaped
+            mark_proc_completed(j, cp, M_FAILED_EXEC);
+        } else {
+            free_single_job(j);
+        }
+        return M_FAILED_EXEC;
+    }
+
+    coproc c = {
+        .name = strdup(name),
+        .j = j,
+        .in = shell_fd(in[1]),
+        .out = {.fd = shell_fd(out[0]), .cap = COPROC_BUF_SIZE,
+                .name = "cosend", .ready = wait_readable},
+    };
+    Assert_alloc(c.name);
+    c.out.buf = malloc(c.out.cap);
+    Assert_alloc(c.out.buf);
+    if (!coprocs) {
+        coprocs = vec_alloc(COPROCS_INIT_SIZE * sizeof *coprocs);
+    }
+    Vec_push(&coprocs, c);
+    return 0;
+}
+
+// Close the pipes to the coprocess run by j, if it is one. Called when j is
+// unregistered
+void forget_coproc(job const *j)
+{
+    for (size_t i = 0; coprocs && i < vec_len(coprocs); i++) {
+        coproc *c = &coprocs[i];
+        if (c->j != j) {
+            continue;
+        }
+        if (c->in >= 0) {
+            close(c->in);
+        }
+        close(c->out.fd);
+        free(c->out.buf);
+        free(c->name);
+        size_t last = vec_len(coprocs) - 1;
+        coprocs[i] = coprocs[last];
+        vec_setlen(last, coprocs);
+        return;
+    }
+}
+
+// Close the pipes to every coprocess. For a child of the shell that doesn't
+// exec, on which close-on-exec has no effect: the write end it inherited would
+// keep a coprocess from ever seeing the end of its input
+void forget_coprocs(void)
+{
+    for (size_t i = 0; coprocs && i < vec_len(coprocs); i++) {
+        coproc *c = &coprocs[i];
+        if (c->in >= 0) {
+            close(c->in);
+        }
+        close(c->out.fd);
+        free(c->out.buf);
+        free(c->name);
+    }
+    if (coprocs) {
+        vec_setlen(0, coprocs);
+    }
+}
+
+int m_coproc(proc const *p)
+{
+    char **args = p->argv + 1;
+    if (!*args) {
+        for (size_t i = 0; coprocs && i < vec_len(coprocs); i++) {
+            coproc const *c = &coprocs[i];
+            dprintf(p->fds[1], "%s\t[%zu] %d%s\n", c->name, c->j->index + 1,
+                    c->j->procs[0]->pid, c->in < 0 ? " (input closed)" : "");
+        }
+        return 0;
+    }
+    if (strcmp(*args, "-c") == 0) {
+        Stopif(!args[1], return 1, "usage: coproc -c NAME");
+        coproc *c = find_coproc(args[1]);
+        Stopif(!c, return 1, "coproc: no coprocess called %s", args[1]);
+        if (c->in >= 0) {
+            close(c->in);
+            c->in = -1;
+        }
+        return 0;
+    }
+    Stopif(!args[1], return 1, "usage: coproc NAME command [arg...]");
+    return start_coproc(p, args[0], args + 1);
+}
+
+// Block SIGPIPE while cosend runs, so a coprocess that has gone away is an
+// error instead of the end of the shell, and watch for ^C if the shell keeps
+// SIGINT blocked to read it from its signalfd
+static sigset_t enter_cosend(void)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    sigset_t old = sig_block(set);
+#ifdef __linux__
+    if (sigismember(&old, SIGINT)) {
+        sigemptyset(&set);
+        sigaddset(&set, SIGINT);
+        intr_fd = signalfd(-1, &set, SFD_CLOEXEC);
+    }
+#endif
+    return old;
+}
+
+static void leave_cosend(sigset_t old)
+{
+    if (intr_fd >= 0) {
+        close(intr_fd);
+        intr_fd = -1;
+    }
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    struct timespec now = {0};
+    while (sigtimedwait(&set, NULL, &now) > 0);
+    sig_setmask(old);
+}
+
+int m_cosend(proc const *p)
+{
+    char **args = p->argv + 1;
+    Stopif(!*args, return 1, "usage: cosend NAME [line...]");
+    coproc *c = find_coproc(*args);
+    Stopif(!c, return 1, "cosend: no coprocess called %s", *args);
+    Stopif(c->in < 0, return 1, "cosend: the input of %s is closed", c->name);
+
+    sigset_t old = enter_cosend();
+    int ret = 0;
+    if (args[1]) {
+        // The arguments are sent as one line, separated by spaces
+        size_t len = 0;
+        for (char **arg = args + 1; *arg; arg++) {
+            len += strlen(*arg) + 1;
+        }
+        char *line = malloc(len);
+        Assert_alloc(line);
+        char *end = line;
+        for (char **arg = args + 1; *arg; arg++) {
+            end = stpcpy(end, *arg);
+            *end++ = ' ';
+        }
+        ret = round_trip(c, line, len - 1, p->fds[1]);
+        free(line);
+    } else {
+        line_reader r = {.fd = p->fds[0], .cap = COPROC_BUF_SIZE,
+                         .name = "cosend", .ready = wait_readable};
+        r.buf = malloc(r.cap);
+        Assert_alloc(r.buf);
+        char *line;
+        while (!ret && (line = read_line(&r))) {
+            ret = round_trip(c, line, strlen(line), p->fds[1]);
+        }
+        if (!ret && !r.eof) {
+            ret = M_SIGINT;
+        }
+        free(r.buf);
+    }
+    leave_cosend(old);
+    return ret;
+}
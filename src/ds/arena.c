@@ -0,0 +1,130 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcpy, strlen
+
+#include "arena.h" // arena
+#include "../macros.h" // Assert_alloc
+
+// Size of the first chunk of every arena. A typical command line fits in it
+#define ARENA_INIT_SIZE 1024
+// Chunks double in size until they reach this
+#define ARENA_MAX_CHUNK (64 * 1024)
+
+// Alignment suitable for any object we store
+typedef union arena_align {
+    long double ld;
+    long long ll;
+    void *p;
+    void (*f)(void);
+} arena_align;
+
+#define ARENA_ALIGN (sizeof (arena_align))
+
+typedef struct chunk {
+    struct chunk *prev; // Previously filled chunk
+    size_t size; // Usable bytes in data
+    size_t used; // Bytes handed out
+    arena_align data[];
+} chunk;
+
+struct arena {
+    chunk *head; // Chunk currently being allocated from
+    size_t next_size; // Size of the next chunk allocated
+};
+
+static arena_stats totals;
+
+static chunk *new_chunk(size_t size, chunk *prev)
+{
+    chunk *c = malloc(sizeof *c + size);
+    Assert_alloc(c);
+    totals.chunks++;
+    *c = (chunk) { .prev = prev, .size = size, .used = 0 };
+    return c;
+}
+
+// Allocate new arena. Panics on allocation failure
+arena *arena_new(void)
+{
+    arena *a = malloc(sizeof *a);
+    Assert_alloc(a);
+    a->head = new_chunk(ARENA_INIT_SIZE, NULL);
+    a->next_size = 2 * ARENA_INIT_SIZE;
+    return a;
+}
+
+// Return size bytes of uninitialized memory aligned for any type. Panics on
+// allocation failure
+void *arena_alloc(arena *a, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    totals.allocs++;
+    totals.bytes += size;
+    chunk *c = a->head;
+    if (c->size - c->used < size) {
+        if (size > a->next_size / 2) {
+            // Too big to be worth sharing a chunk, give it its own behind the
+            // current one so the space left in head isn't wasted
+            c->prev = new_chunk(size, c->prev);
+            c->prev->used = size;
+            return c->prev->data;
+        }
+        c = a->head = new_chunk(a->next_size, c);
+        if (a->next_size < ARENA_MAX_CHUNK) {
+            a->next_size *= 2;
+        }
+    }
+    void *ret = (char *) c->data + c->used;
+    c->used += size;
+    return ret;
+}
+
+char *arena_strndup(arena *a, char const *str, size_t n)
+{
+    char *ret = arena_alloc(a, n + 1);
+    memcpy(ret, str, n);
+    ret[n] = '\0';
+    return ret;
+}
+
+char *arena_strdup(arena *a, char const *str)
+{
+    return arena_strndup(a, str, strlen(str));
+}
+
+// Release every allocation made from the arena, and the arena itself
+void arena_free(arena *a)
+{
+    if (!a) {
+        return;
+    }
+    chunk *c = a->head;
+    while (c) {
+        chunk *prev = c->prev;
+        free(c);
+        c = prev;
+    }
+    free(a);
+}
+
+arena_stats arena_totals(void)
+{
+    return totals;
+}
@@ -0,0 +1,42 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef M_ARENA_H
+#define M_ARENA_H
+
+#include <stddef.h>
+
+// Bump allocator. Everything allocated from an arena is released at once by
+// arena_free; individual allocations are never freed
+typedef struct arena arena;
+
+// Totals over every arena since the shell started
+typedef struct arena_stats {
+    size_t allocs; // Calls to arena_alloc
+    size_t bytes; // Bytes handed out by them
+    size_t chunks; // Chunks malloc'd to hold those bytes
+} arena_stats;
+
+arena *arena_new(void);
+void *arena_alloc(arena *a, size_t size);
+char *arena_strdup(arena *a, char const *str);
+char *arena_strndup(arena *a, char const *str, size_t n);
+void arena_free(arena *a);
+arena_stats arena_totals(void);
+
+#endif
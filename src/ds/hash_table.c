@@ -16,107 +16,209 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <stdlib.h> // malloc
+#include <stdint.h> // SIZE_MAX
+#include <stdlib.h> // calloc, free
 #include <string.h> // strcmp
 
-#include "hash_table.h" // hash_table, node
-#include "../macros.h" // Free
+#include "hash_table.h" // hash_table, table_entry
+#include "../macros.h" // Assert_alloc, Free
 
 #ifndef SIZE_MAX
 #define SIZE_MAX ((size_t) -1)
 #endif
 
-static unsigned long get_index(char const *key, size_t size);
+// Grow once more than 3/4 of the slots are in use
+#define Over_load_factor(LEN, CAP) ((LEN) * 4 > (CAP) * 3)
 
-hash_table new_table(size_t nmemb)
+static size_t hash_key(char const *key);
+static table_entry *find_slot(char const *k, size_t hash, int type,
+                              hash_table const *t);
+static void grow_table(hash_table *t);
+
+// Allocate a table with room for at least size slots (rounded up to a power of
+// two). Panics on allocation failure
+hash_table *new_table(size_t size)
 {
-    return vec_alloc(nmemb * sizeof (node *));
+    size_t cap = 1;
+    while (cap < size) {
+        cap <<= 1;
+    }
+    hash_table *t = malloc(sizeof *t);
+    Assert_alloc(t);
+    t->entries = calloc(cap, sizeof *t->entries);
+    Assert_alloc(t->entries);
+    t->cap = cap;
+    t->len = 0;
+    return t;
 }
 
-void delete_node(char const *k, hash_table t)
+// Add v under (k, type). k must stay valid for as long as it's in the table.
+// Returns 0 on success, 1 if (k, type) is already present (its value is left
+// alone) and -1 if t is NULL or type is ANY_TYPE
+int table_add(char const *k, int type, void *v, hash_table *t)
 {
-    node *crawler = t[get_index(k, vec_capacity(t) / sizeof *t)];
-    node *prev = NULL;
-    while (crawler) {
-        if (strcmp(k, crawler->key) == 0) {
-            if (prev) {
-                prev->next = crawler->next;
-            }
-            Free(crawler);
-            return;
-        }
-        prev = crawler;
-        crawler = crawler->next;
+    if (!t || type == ANY_TYPE) {
+        return -1;
+    }
+    size_t hash = hash_key(k);
+    table_entry *e = find_slot(k, hash, type, t);
+    if (e->key) {
+        return 1;
     }
+    if (Over_load_factor(t->len + 1, t->cap)) {
+        grow_table(t);
+        e = find_slot(k, hash, type, t);
+    }
+    *e = (table_entry) {.key = k, .value = v, .hash = hash, .type = type};
+    t->len++;
+    return 0;
 }
 
-int add_node(char const *k, void *v, hash_table t)
+// Returns the value stored under (k, type), or NULL if there is none. With
+// ANY_TYPE the first entry found with key k is returned
+void *table_find(char const *k, int type, hash_table const *t)
 {
     if (!t) {
-        return -1;
+        return NULL;
     }
+    table_entry *e = find_slot(k, hash_key(k), type, t);
+    return e->key ? e->value : NULL;
+}
 
-    node *new = malloc(sizeof (node));
-    Assert_alloc(new);
+// Remove (k, type) from the table and return its value so the caller can free
+// it. Returns NULL if it wasn't there
+void *table_remove(char const *k, int type, hash_table *t)
+{
+    if (!t) {
+        return NULL;
+    }
+    table_entry *e = find_slot(k, hash_key(k), type, t);
+    if (!e->key) {
+        return NULL;
+    }
+    void *ret = e->value;
 
-    new->key = k;
-    new->value = v;
-    unsigned long i = get_index(k, vec_capacity(t) / sizeof *t);
-    new->next = t[i];
+    // Backward shift deletion: move later members of the probe sequence into
+    // the hole so lookups never need tombstones
+    size_t mask = t->cap - 1;
+    size_t hole = e - t->entries;
+    for (size_t i = (hole + 1) & mask; t->entries[i].key; i = (i + 1) & mask) {
+        size_t home = t->entries[i].hash & mask;
+        // Entry can fill the hole only if the hole is between its home slot
+        // and where it currently is
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            t->entries[hole] = t->entries[i];
+            hole = i;
+        }
+    }
+    t->entries[hole] = (table_entry) {0};
+    t->len--;
+    return ret;
+}
 
-    t[i] = new;
-    return 0;
+// Remove every entry of the given type, passing each to destructor first (if
+// not NULL)
+void table_remove_all(int type, void (*destructor)(table_entry *), hash_table *t)
+{
+    if (!t) {
+        return;
+    }
+    table_entry *old = t->entries;
+    size_t old_cap = t->cap;
+    t->entries = calloc(old_cap, sizeof *t->entries);
+    Assert_alloc(t->entries);
+    t->len = 0;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (!old[i].key) {
+            continue;
+        }
+        if (type == ANY_TYPE || old[i].type == type) {
+            if (destructor) {
+                destructor(&old[i]);
+            }
+        } else {
+            *find_slot(old[i].key, old[i].hash, old[i].type, t) = old[i];
+            t->len++;
+        }
+    }
+    free(old);
 }
 
-void *find_node(char const *k, bool (*filter)(void *), hash_table t)
+// Iterate over the table. *i should start at 0. Returns the next occupied
+// entry and moves *i past it, or NULL once every entry has been seen. The
+// table must not be modified during iteration
+table_entry const *table_next(size_t *i, hash_table const *t)
 {
     if (!t) {
         return NULL;
     }
-    node *crawler = t[get_index(k, vec_capacity(t) / sizeof *t)];
-    while (crawler) {
-        if (strcmp(crawler->key, k) == 0) {
-            bool end = filter ? filter(crawler->value) : 1;
-            if (end) {
-                return crawler->value;
-            } else {
-                continue;
-            }
+    for (; *i < t->cap; (*i)++) {
+        if (t->entries[*i].key) {
+            return &t->entries[(*i)++];
         }
-        crawler = crawler->next;
     }
     return NULL;
 }
 
-void free_table(hash_table t, void (*destructor)(node *))
+void free_table(hash_table *t, void (*destructor)(table_entry *))
 {
     if (!t) {
         return;
     }
-    size_t table_cap = vec_capacity(t) / sizeof *t;
-    // Free contents
-    for (size_t i = 0; i < table_cap; i++) {
-        node *crawler = t[i];
-        while (crawler) {
-            if (destructor) {
-                destructor(crawler);
+    if (destructor) {
+        for (size_t i = 0; i < t->cap; i++) {
+            if (t->entries[i].key) {
+                destructor(&t->entries[i]);
             }
-            node *next = crawler->next;
-            Free(crawler);
-            crawler = next;
         }
     }
-    vec_free(t);
+    Free(t->entries);
+    Free(t);
 }
 
+// Returns the slot holding (k, type) or, if it isn't in the table, the empty
+// slot that ends its probe sequence. The load factor guarantees there is one
+static table_entry *find_slot(char const *k, size_t hash, int type,
+                              hash_table const *t)
+{
+    size_t mask = t->cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        table_entry *e = &t->entries[i];
+        if (!e->key) {
+            return e;
+        }
+        if (e->hash == hash && (type == ANY_TYPE || e->type == type)
+                && strcmp(e->key, k) == 0) {
+            return e;
+        }
+    }
+}
+
+// Double number of slots and reinsert everything
+static void grow_table(hash_table *t)
+{
+    Stopif(t->cap > SIZE_MAX / (2 * sizeof *t->entries), exit(M_FAILED_ALLOC),
+           "Hash table too large");
+    table_entry *old = t->entries;
+    size_t old_cap = t->cap;
+    t->cap *= 2;
+    t->entries = calloc(t->cap, sizeof *t->entries);
+    Assert_alloc(t->entries);
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].key) {
+            *find_slot(old[i].key, old[i].hash, old[i].type, t) = old[i];
+        }
+    }
+    free(old);
+}
 
-// Modified djb2
+// djb2
 // Requires key to be a valid string ending in '\0'
-static unsigned long get_index(char const *key, size_t size)
+static size_t hash_key(char const *key)
 {
-    unsigned long hash = 5381;
-    while (*key++) {
-        hash = ((hash << 5) + hash) + *key;
+    size_t hash = 5381;
+    for (; *key; key++) {
+        hash = ((hash << 5) + hash) + (unsigned char) *key;
     }
-    return hash & (size - 1);
+    return hash;
 }
@@ -19,24 +19,35 @@
 #ifndef MARCEL_HASH_H
 #define MARCEL_HASH_H
 
-#define TABLE_INIT_SIZE 1024
+#define TABLE_INIT_SIZE 64
 
-#include <stdbool.h>
-#include "vec.h"
+// Pass as type to match entries of any type
+#define ANY_TYPE (-1)
 
+#include <stdbool.h>
+#include <stddef.h>
 
-typedef struct node {
+typedef struct table_entry {
+    char const *key; // Name of function (or alias), NULL if the slot is empty
     void *value; // Pointer to builtin function (or alias)
-    char const* key; // Name of function (or alias)
-    struct node *next; // Pointer to next node (in case of conflicts)
-} node;
-
-typedef node** hash_table;
-
-hash_table new_table(size_t size);
-int add_node(char const *k, void *v, hash_table t);
-void *find_node(char const *k, bool (*filter)(void *), hash_table t);
-void delete_node(char const *k, hash_table t);
-void free_table(hash_table t, void (*destructor)(node*));
+    size_t hash; // Hash of key, kept to avoid rehashing and most strcmps
+    int type; // What kind of entry this is, chosen by the user of the table
+} table_entry;
+
+// Open addressing (linear probing) table keyed by (key, type) pairs. Keys and
+// values are owned by the user of the table
+typedef struct hash_table {
+    table_entry *entries;
+    size_t cap; // Number of slots, always a power of two
+    size_t len; // Number of occupied slots
+} hash_table;
+
+hash_table *new_table(size_t size);
+int table_add(char const *k, int type, void *v, hash_table *t);
+void *table_find(char const *k, int type, hash_table const *t);
+void *table_remove(char const *k, int type, hash_table *t);
+void table_remove_all(int type, void (*destructor)(table_entry *), hash_table *t);
+table_entry const *table_next(size_t *i, hash_table const *t);
+void free_table(hash_table *t, void (*destructor)(table_entry *));
 
 #endif
@@ -0,0 +1,126 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h> // calloc, free
+
+#include "pid_table.h" // pid_table, pid_entry
+#include "../macros.h" // Assert_alloc, Free
+
+// Grow once more than 3/4 of the slots are in use
+#define Over_load_factor(LEN, CAP) ((LEN) * 4 > (CAP) * 3)
+
+static pid_entry *find_slot(pid_t pid, pid_table const *t);
+
+// Spread sequential pids over the table (Fibonacci hashing)
+static inline size_t hash_pid(pid_t pid)
+{
+    return (size_t) ((unsigned long long) pid * 11400714819323198485ull >> 32);
+}
+
+// Allocate a table with room for at least size slots (rounded up to a power of
+// two). Panics on allocation failure
+pid_table *new_pid_table(size_t size)
+{
+    size_t cap = 1;
+    while (cap < size) {
+        cap <<= 1;
+    }
+    pid_table *t = malloc(sizeof *t);
+    Assert_alloc(t);
+    t->entries = calloc(cap, sizeof *t->entries);
+    Assert_alloc(t->entries);
+    t->cap = cap;
+    t->len = 0;
+    return t;
+}
+
+// Map pid to p and j, replacing any previous mapping of pid
+void pid_add(pid_t pid, proc *p, job *j, pid_table *t)
+{
+    pid_entry *e = find_slot(pid, t);
+    if (!e->pid) {
+        if (Over_load_factor(t->len + 1, t->cap)) {
+            pid_entry *old = t->entries;
+            size_t old_cap = t->cap;
+            t->cap *= 2;
+            t->entries = calloc(t->cap, sizeof *t->entries);
+            Assert_alloc(t->entries);
+            for (size_t i = 0; i < old_cap; i++) {
+                if (old[i].pid) {
+                    *find_slot(old[i].pid, t) = old[i];
+                }
+            }
+            free(old);
+            e = find_slot(pid, t);
+        }
+        t->len++;
+    }
+    *e = (pid_entry) {.pid = pid, .proc = p, .job = j};
+}
+
+// Returns the entry for pid or NULL if there is none
+pid_entry *pid_find(pid_t pid, pid_table const *t)
+{
+    if (pid <= 0) {
+        return NULL;
+    }
+    pid_entry *e = find_slot(pid, t);
+    return e->pid ? e : NULL;
+}
+
+// Remove pid from the table if it's there
+void pid_remove(pid_t pid, pid_table *t)
+{
+    pid_entry *e = pid_find(pid, t);
+    if (!e) {
+        return;
+    }
+    // Backward shift deletion, see table_remove in hash_table.c
+    size_t mask = t->cap - 1;
+    size_t hole = e - t->entries;
+    for (size_t i = (hole + 1) & mask; t->entries[i].pid; i = (i + 1) & mask) {
+        size_t home = hash_pid(t->entries[i].pid) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            t->entries[hole] = t->entries[i];
+            hole = i;
+        }
+    }
+    t->entries[hole] = (pid_entry) {0};
+    t->len--;
+}
+
+void free_pid_table(pid_table *t)
+{
+    if (!t) {
+        return;
+    }
+    Free(t->entries);
+    Free(t);
+}
+
+// Returns the slot holding pid or, if it isn't in the table, the empty slot
+// that ends its probe sequence
+static pid_entry *find_slot(pid_t pid, pid_table const *t)
+{
+    size_t mask = t->cap - 1;
+    for (size_t i = hash_pid(pid) & mask;; i = (i + 1) & mask) {
+        if (!t->entries[i].pid || t->entries[i].pid == pid) {
+            return &t->entries[i];
+        }
+    }
+}
@@ -16,19 +16,23 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <stdlib.h>
+#include <string.h> // memset
 
 #include "proc.h"
 #include "../macros.h"
-// Should be more than enough
-#define INITIAL_PROC_CAP 32
+// Should be more than enough for most pipelines, grown if not
+#define INITIAL_PROC_CAP 4
 
-proc *new_proc(void)
+// Allocate new proc with all fields initialized to 0 (except fds, which are
+// set to stdin, stdout and stderr) out of arena `a`. argv and env start out in
+// the same allocation as the proc and only move if they outgrow it
+proc *new_proc(arena *a)
 {
-    proc *ret = calloc(1, sizeof *ret);
-    Assert_alloc(ret);
-    ret->argv = vec_alloc(ARGV_INIT_SIZE * sizeof *ret->argv);
-    ret->env =  vec_alloc(ARGV_INIT_SIZE * sizeof *ret->env);
+    size_t vec_size = Vec_storage_size(char *, ARGV_INIT_SIZE);
+    char *mem = arena_alloc(a, sizeof (proc) + 2 * vec_size);
+    proc *ret = memset(mem, 0, sizeof *ret);
+    ret->argv = vec_init(mem + sizeof *ret, vec_size, a);
+    ret->env = vec_init(mem + sizeof *ret + vec_size, vec_size, a);
 
     for (size_t i = 0; i < Arr_len(ret->fds); i++) {
         ret->fds[i] = i;
@@ -36,46 +40,80 @@ proc *new_proc(void)
     return ret;
 }
 
-// Frees proc and dynamically allocated members.
-// TODO: Make less ugly.
-void free_proc(proc *p)
+// Allocate new job with all fields initialized to 0 in a fresh arena. Panics
+// on allocation failure
+job *new_job(void)
 {
-    char ***a[] = {&p->argv, &p->env};
-    for (size_t i = 0 ; i < Arr_len(a); i++) {
-        size_t len = vec_len(*a[i]);
-        for (size_t j = 0; j < len; j++) {
-            Free((*a[i])[j]);
-        }
-        vec_free(*a[i]);
+    arena *a = arena_new();
+    job *ret = memset(arena_alloc(a, sizeof *ret), 0, sizeof *ret);
+    ret->arena = a;
+    ret->procs = vec_alloc_arena(INITIAL_PROC_CAP * sizeof *ret->procs, a);
+    return ret;
+}
+
+// Append a copy of every string in the vec src to *dst, allocated out of a
+static void copy_strv(char ***dst, char **src, arena *a)
+{
+    size_t n = vec_len(src);
+    vec_reserve(n, sizeof *src, (vec *) dst);
+    for (size_t i = 0; i < n; i++) {
+        Vec_push(dst, src[i] ? arena_strdup(a, src[i]) : NULL);
     }
-    Free(p);
 }
 
-// Allocate new job with all fields initialized to 0. Panics on allocation
-// failure
-job *new_job(void)
+// Copy what parsing src produced (its procs with their argv and env, IO
+// redirections and flags) into dst, allocating out of dst's arena. Runtime
+// state and dst's name are left alone. dst must not have any procs yet
+void copy_job(job *dst, job const *src)
 {
-    job *ret = calloc(1, sizeof *ret);
-    Assert_alloc(ret);
-    ret->procs = vec_alloc(INITIAL_PROC_CAP * sizeof *ret->procs);
-    return ret;
+    arena *a = dst->arena;
+    size_t n_procs = vec_len(src->procs);
+    vec_reserve(n_procs, sizeof *src->procs, (vec *) &dst->procs);
+    for (size_t i = 0; i < n_procs; i++) {
+        proc const *src_p = src->procs[i];
+        proc *p = new_proc(a);
+        copy_strv(&p->argv, src_p->argv, a);
+        copy_strv(&p->env, src_p->env, a);
+        if (src_p->redirs) {
+            size_t n = vec_len(src_p->redirs);
+            p->redirs = vec_alloc_arena(n * sizeof *p->redirs, a);
+            for (size_t k = 0; k < n; k++) {
+                fd_redir r = src_p->redirs[k];
+                if (r.path) {
+                    r.path = arena_strdup(a, r.path);
+                }
+                Vec_push(&p->redirs, r);
+            }
+        }
+        if (src_p->expand) {
+            size_t n = vec_len(src_p->expand);
+            p->expand = vec_alloc_arena(n * sizeof *p->expand, a);
+            for (size_t k = 0; k < n; k++) {
+                Vec_push(&p->expand, src_p->expand[k]);
+            }
+        }
+        Vec_push(&dst->procs, p);
+    }
+    for (size_t i = 0; i < Arr_len(dst->io); i++) {
+        dst->io[i] = src->io[i];
+        if (src->io[i].path) {
+            dst->io[i].path = arena_strdup(a, src->io[i].path);
+        }
+        if (src->io[i].text) {
+            dst->io[i].text = arena_strndup(a, src->io[i].text,
+                                            src->io[i].text_len);
+        }
+    }
+    dst->bkg = src->bkg;
+    dst->valid = src->valid;
+    dst->timed = src->timed;
 }
 
-// Free all dynamically allocated fields in job and job itself
+// Free job along with everything allocated in its arena
 void free_single_job(job *j)
 {
     if (!j) {
         return;
     }
-    for (size_t i = 0; i < Arr_len(j->io); i++) {
-        Free(j->io[i].path);
-    }
-    Free(j->name);
-    proc **proc_end = j->procs + vec_len(j->procs);
-    for (proc **p_p = j->procs; p_p != proc_end; p_p++) {
-        Cleanup(*p_p, free_proc);
-    }
-    vec_free(j->procs);
-    Free(j);
+    arena_free(j->arena);
 }
-
@@ -19,13 +19,40 @@
 #ifndef M_proc_H
 #define M_proc_H
 
-#define ARGV_INIT_SIZE 1024
+// Initial number of slots in argv and env. Most commands need fewer
+#define ARGV_INIT_SIZE 8
 
 #include <stdbool.h>
+#include <sys/resource.h> // rusage
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h> // timespec
+#include "arena.h"
 #include "vec.h"
 
+// A redirection of a descriptor above 2 (e.g. 3>>log), which only exec
+// honours: the descriptor is kept open by the shell and inherited by every
+// command run from then on
+typedef struct fd_redir {
+    int fd; // Descriptor redirected
+    int src; // Descriptor fd becomes a copy of, REDIR_OPEN or REDIR_CLOSE
+    char *path; // File opened if src is REDIR_OPEN
+    int oflag;
+} fd_redir;
+
+#define REDIR_OPEN (-1)
+#define REDIR_CLOSE (-2)
+
+// An argument that expand_job replaces with the words it expands to when the
+// job is started
+typedef struct expansion {
+    size_t arg; // Index in argv
+    enum {
+        EXPAND_SUB, // $(command): argv[arg] is the command
+        EXPAND_GLOB, // A pattern, with backslash escapes still in it
+    } kind;
+} expansion;
+
 // Struct to model a single command (process)
 typedef struct proc {
     char **argv; // Vec of arguments to be passed to execvp
@@ -35,32 +62,63 @@ typedef struct proc {
     bool completed; // Command has finished executing
     bool stopped; // Command has been stopped
     int exit_code; // Status code proc exited with
+    struct timespec start; // When the command was started (CLOCK_MONOTONIC)
+    struct timespec end; // When it was found to have completed
+    struct rusage usage; // Resources used, as reported when it was reaped
+    fd_redir *redirs; // Vec of redirections of descriptors above 2, or NULL
+    expansion *expand; // Vec of arguments to be expanded, or NULL
 } proc;
 
-proc *new_proc(void);
-void free_proc(proc *c);
+proc *new_proc(arena *a);
+
 
+typedef enum io_kind {
+    IO_NONE, // The fd the job already has is used
+    IO_FILE, // path is opened with oflag
+    IO_DUP, // A copy of descriptor fd, after the files have been opened
+    IO_HERE, // text is fed to stdin (a here-string or here-document)
+} io_kind;
 
 typedef struct proc_io {
-    char *path;
+    io_kind kind;
+    char *path; // IO_FILE: file to open. IO_HERE: here-document delimiter
     int oflag;
+    int fd;
+    char *text; // NULL for a here-document whose body hasn't been read yet
+    size_t text_len;
 } proc_io;
 
+// A job and everything hanging off of it (procs, their argv and env, the
+// strings in them, redirection paths) is allocated from the job's arena
 typedef struct job {
+    arena *arena; // Storage for the job, freed by free_single_job
     char *name; // Name of command
     size_t index; // Index in job table
+    size_t live_index; // Index in list of registered jobs
     proc **procs; // Vec of procs
+    size_t n_completed; // Number of procs that have completed
+    size_t n_stopped; // Number of procs that are stopped (but not completed)
     proc_io io[3]; // stdin, stdout and stderr
     pid_t pgid; // Proc group ID for job
     struct {
         bool notified  : 1; // User has been notified of state change
         bool bkg       : 1; // Job should execute in background
         bool valid     : 1; // Should job be sent to launch_job
+        bool timed     : 1; // Report resource usage on completion (`time`)
+        bool queued    : 1; // Waiting for a background slot to be launched
+        bool slotted   : 1; // Holds one of the background slots
+        bool quiet     : 1; // Started by a builtin that reports on it itself
+        bool coproc    : 1; // A coprocess, with pipes kept by the shell
     };
+    struct job *next_queued; // Next job waiting for a background slot
+    char const *cgroup; // cgroup v2 directory of the job, NULL if it has none
+    struct timespec start; // When the job was launched (CLOCK_MONOTONIC)
+    struct timespec end; // When its last proc completed
     struct termios tmodes; // Terminal modes for job
 } job;
 
 job *new_job(void);
+void copy_job(job *dst, job const *src);
 void free_single_job(job *j);
 
 #endif
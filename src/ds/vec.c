@@ -19,14 +19,10 @@
 #include <stdlib.h> // calloc, realloc
 #include <stdint.h> // uintptr_t
 #include <string.h> // memset
+#include "arena.h" // arena, arena_alloc
 #include "vec.h" // vec
 #include "../macros.h" // Assert_alloc
 
-typedef struct vec_meta {
-    size_t cap;  // Allocated size in bytes
-    size_t len;  // Length of vector
-} vec_meta;
-
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wint-conversion"
 
@@ -42,13 +38,44 @@ vec vec_alloc(size_t size)
     return memset(ret, 0, size);
 }
 
+// Same as vec_alloc, but the vector is allocated from `a` and goes away with it.
+// Growing it leaves the old storage behind in the arena, and vec_free is a
+// no-op
+vec vec_alloc_arena(size_t size, arena *a)
+{
+    vec_meta data = { .cap = size, .len = 0, .arena = a };
+    vec ret = arena_alloc(a, sizeof data + size);
+    memcpy(ret, &data, sizeof data);
+    ret = ((uintptr_t) ret) + sizeof data;
+    return memset(ret, 0, size);
+}
+
+// Make a vector out of size bytes of storage supplied by the caller, e.g. a
+// buffer inside another object, so that a vector that stays small costs no
+// allocation of its own. Storage must be suitably aligned and
+// at least sizeof (vec_meta) bytes (see Vec_storage_size). Once the vector
+// outgrows it, it moves to `a`, or to the heap if `a` is NULL. Storage itself
+// is never freed by the vector
+vec vec_init(void *storage, size_t size, arena *a)
+{
+    vec_meta data = {
+        .cap = size - sizeof data, .len = 0, .arena = a, .borrowed = true,
+    };
+    memcpy(storage, &data, sizeof data);
+    vec ret = ((uintptr_t) storage) + sizeof data;
+    return memset(ret, 0, data.cap);
+}
+
 // NOTE: All the below functions REQUIRE that they be passed a vector. Their
 // behavior is undefined otherwise
 
 // Free vector
 void vec_free(vec v)
 {
-    free((uintptr_t) v - sizeof (vec_meta));
+    vec_meta *data = (uintptr_t) v - sizeof *data;
+    if (!data->arena && !data->borrowed) {
+        free(data);
+    }
 }
 
 // Return the allocated size of the vector in bytes
@@ -69,12 +96,40 @@ void vec_setlen(size_t val, vec v)
     ((vec_meta *)((uintptr_t) v - sizeof (vec_meta)))->len = val;
 }
 
+// Move the vector to storage of bytes bytes (which must not be less than its
+// current capacity). The new space is zeroed
+static int vec_resize(size_t bytes, vec *v)
+{
+    vec_meta *old = (uintptr_t) *v - sizeof *old;
+    vec_meta *ret;
+    if (old->arena || old->borrowed) {
+        // The old storage can't be resized in place, so it's left behind
+        ret = old->arena ? arena_alloc(old->arena, sizeof *ret + bytes)
+                         : malloc(sizeof *ret + bytes);
+        Assert_alloc(ret);
+        memcpy(ret, old, sizeof *ret + old->cap);
+        ret->borrowed = false;
+    } else {
+        ret = realloc(old, sizeof *ret + bytes);
+        Assert_alloc(ret);
+    }
+
+    memset((uintptr_t) (ret + 1) + ret->cap, 0, bytes - ret->cap);
+    ret->cap = bytes;
+    *v = ret + 1;
+    return 0;
+}
+
 // Add element to the end of a vector, growing it if necessary
 int vec_append(void *elem, size_t elem_size, vec *v)
 {
     vec_meta *data = (uintptr_t) *v - sizeof *data;
-    if ((data->len + 1) * elem_size >= data->cap) {
-        vec_grow(v);
+    if ((data->len + 1) * elem_size > data->cap) {
+        int err = data->cap < elem_size ? vec_reserve(1, elem_size, v)
+                                        : vec_grow(v);
+        if (err) {
+            return err;
+        }
         // Reinitialize data in case realloc changed the memory location
         data = (uintptr_t) *v - sizeof *data;
     }
@@ -92,8 +147,7 @@ int vec_grow(vec *v)
         return -1;
     }
 
-    vec ret = (uintptr_t) *v - sizeof (vec_meta);
-    size_t bytes = ((vec_meta*) ret)->cap;
+    size_t bytes = vec_capacity(*v);
     if (bytes < SIZE_MAX / 2) {
         bytes *= 2;
     } else if (bytes < SIZE_MAX) {
@@ -101,15 +155,24 @@ int vec_grow(vec *v)
     } else {
         return 1;
     }
-    ret = realloc(ret, sizeof (vec_meta) + bytes);
-    Assert_alloc(ret);
-
-    size_t *cap = &((vec_meta*) ret)->cap;
-    memset(sizeof (vec_meta) + (uintptr_t) ret + *cap , 0, bytes - *cap);
-    *cap = bytes;
-    *v = (uintptr_t) ret + sizeof (vec_meta);
-    return 0;
+    return vec_resize(bytes, v);
 }
 
+// Make room for n more elements of elem_size bytes with at most one
+// reallocation, to exactly the size needed, so that a vector whose final
+// length is known can be sized up front. Returns -1 if passed bad parameters,
+// 1 if the size overflows, 0 on success
+int vec_reserve(size_t n, size_t elem_size, vec *v)
+{
+    if (!v || !*v) {
+        return -1;
+    }
+    size_t len = vec_len(*v);
+    if (elem_size && n > SIZE_MAX / elem_size - len) {
+        return 1;
+    }
+    size_t bytes = (len + n) * elem_size;
+    return bytes > vec_capacity(*v) ? vec_resize(bytes, v) : 0;
+}
 
 #pragma GCC diagnostic pop
@@ -19,15 +19,41 @@
 #ifndef M_VEC_H
 #define M_VEC_H
 
+#include <stdbool.h>
 #include <stddef.h>
+#include "arena.h"
 
 typedef void* vec;
 
+// Header in front of every vector. Only exposed so that Vec_storage_size can
+// be used to size storage for vec_init
+typedef struct vec_meta {
+    size_t cap;  // Allocated size in bytes
+    size_t len;  // Length of vector
+    arena *arena; // Arena the vector lives in, NULL if on the heap
+    bool borrowed; // Storage was supplied to vec_init and isn't ours to free
+} vec_meta;
+
+// Bytes of storage vec_init needs for a vector with room for N elements of
+// type T
+#define Vec_storage_size(T, N) (sizeof (vec_meta) + (N) * sizeof (T))
+
+// Typed vec_append: append ELEM to the vector of ELEM's type that VP points
+// to
+#define Vec_push(VP, ELEM)                                                  \
+    do {                                                                    \
+        __typeof__(**(VP)) vec_elem_ = (ELEM);                              \
+        vec_append(&vec_elem_, sizeof vec_elem_, (vec *) (VP));             \
+    } while (0)
+
 vec vec_alloc(size_t size);
+vec vec_alloc_arena(size_t size, arena *a);
+vec vec_init(void *storage, size_t size, arena *a);
 void vec_free(vec v);
 size_t vec_capacity(vec v);
 size_t vec_len(vec v);
 void vec_setlen(size_t val, vec v);
 int vec_append(void *elem, size_t elem_size, vec *v);
 int vec_grow(vec *v);
+int vec_reserve(size_t n, size_t elem_size, vec *v);
 #endif
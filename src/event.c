@@ -0,0 +1,180 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Single threaded poll(2) loop multiplexing file descriptors (terminal input,
+// signals, helper pipes) and timers
+
+#include <errno.h> // errno, EINTR
+#include <limits.h> // INT_MAX
+#include <poll.h> // poll, pollfd
+#include <string.h> // strerror
+#include <time.h> // clock_gettime
+
+#include "ds/vec.h" // vec_alloc, Vec_push, vec_len
+#include "event.h" // fd_callback, timer_callback
+#include "macros.h" // Stopif, Err_msg
+
+#define WATCH_INIT_SIZE 8
+
+typedef struct watch {
+    int fd;
+    fd_callback cb;
+    void *data;
+} watch;
+
+typedef struct timer {
+    int id; // 0 once removed
+    long long deadline; // Milliseconds of CLOCK_MONOTONIC
+    timer_callback cb;
+    void *data;
+} timer;
+
+static watch *watches;
+static timer *timers;
+static int next_timer_id = 1;
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Call cb whenever fd is readable. Returns false if fd is already watched
+bool event_add_fd(int fd, fd_callback cb, void *data)
+{
+    if (!watches) {
+        watches = vec_alloc(WATCH_INIT_SIZE * sizeof *watches);
+    }
+    size_t len = vec_len(watches);
+    for (size_t i = 0; i < len; i++) {
+        if (watches[i].fd == fd) {
+            return false;
+        }
+    }
+    watch w = {.fd = fd, .cb = cb, .data = data};
+    Vec_push(&watches, w);
+    return true;
+}
+
+// Stop watching fd. Safe to call from a callback
+void event_remove_fd(int fd)
+{
+    if (!watches) {
+        return;
+    }
+    size_t len = vec_len(watches);
+    for (size_t i = 0; i < len; i++) {
+        if (watches[i].fd == fd) {
+            watches[i] = watches[len - 1];
+            vec_setlen(len - 1, watches);
+            return;
+        }
+    }
+}
+
+// Call cb once, ms milliseconds from now. Returns an id for event_remove_timer
+int event_add_timer(long ms, timer_callback cb, void *data)
+{
+    if (!timers) {
+        timers = vec_alloc(WATCH_INIT_SIZE * sizeof *timers);
+    }
+    timer t = {.id = next_timer_id++, .deadline = now_ms() + ms, .cb = cb,
+               .data = data};
+    Vec_push(&timers, t);
+    return t.id;
+}
+
+// Cancel a timer that hasn't fired yet
+void event_remove_timer(int id)
+{
+    if (!timers) {
+        return;
+    }
+    size_t len = vec_len(timers);
+    for (size_t i = 0; i < len; i++) {
+        if (timers[i].id == id) {
+            timers[i] = timers[len - 1];
+            vec_setlen(len - 1, timers);
+            return;
+        }
+    }
+}
+
+// Run expired timers and return the number of milliseconds until the next one
+// is due, or -1 if there are none
+static int run_timers(void)
+{
+    if (!timers) {
+        return -1;
+    }
+    long long now = now_ms();
+    // Callbacks may add or remove timers, so start over after each one
+    for (size_t i = 0; i < vec_len(timers);) {
+        if (timers[i].deadline <= now) {
+            timer t = timers[i];
+            event_remove_timer(t.id);
+            t.cb(t.data);
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+
+    long long next = -1;
+    for (size_t i = 0; i < vec_len(timers); i++) {
+        long long left = timers[i].deadline - now;
+        if (next < 0 || left < next) {
+            next = left;
+        }
+    }
+    return next > INT_MAX ? INT_MAX : (int) next;
+}
+
+// Block until at least one fd is readable or a timer fires, then dispatch
+// everything that's ready
+void event_wait(void)
+{
+    int timeout = run_timers();
+    size_t n = watches ? vec_len(watches) : 0;
+    struct pollfd fds[n ? n : 1];
+    for (size_t i = 0; i < n; i++) {
+        fds[i] = (struct pollfd) {.fd = watches[i].fd, .events = POLLIN};
+    }
+
+    int ready = poll(fds, n, timeout);
+    if (ready < 0) {
+        Stopif(errno != EINTR, /* No action */, "poll: %s", strerror(errno));
+        return;
+    }
+
+    for (size_t i = 0; i < n && ready; i++) {
+        if (!fds[i].revents) {
+            continue;
+        }
+        ready--;
+        // Earlier callbacks may have added or removed watches
+        for (size_t k = 0; k < vec_len(watches); k++) {
+            if (watches[k].fd == fds[i].fd) {
+                watches[k].cb(watches[k].fd, watches[k].data);
+                break;
+            }
+        }
+    }
+    run_timers();
+}
@@ -0,0 +1,35 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MARCEL_EVENT_H
+#define MARCEL_EVENT_H
+
+#include <stdbool.h>
+
+// Called when fd becomes readable (or hangs up)
+typedef void (*fd_callback)(int fd, void *data);
+// Called once when a timer expires
+typedef void (*timer_callback)(void *data);
+
+bool event_add_fd(int fd, fd_callback cb, void *data);
+void event_remove_fd(int fd);
+int event_add_timer(long ms, timer_callback cb, void *data);
+void event_remove_timer(int id);
+void event_wait(void);
+
+#endif
@@ -16,50 +16,107 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE // posix_spawn_file_actions_addtcsetpgrp_np
+
 #include <errno.h> // errno
+#include <signal.h> // kill, SIGKILL
 #include <stdio.h> // close
 #include <stdlib.h> // calloc, exit, putenv
-#include <string.h> // strerror
+#include <string.h> // strerror, memcpy
 
-#include <fcntl.h> // open, close
+#include <fcntl.h> // open, close, fcntl, F_DUPFD_CLOEXEC
+#include <spawn.h> // posix_spawnp, posix_spawnattr_*, posix_spawn_file_actions_*
+#include <sys/stat.h> // stat, S_ISREG
 #include <sys/types.h> // pid_t
-#include <unistd.h> // close, dup, getpid, setpgid, tcsetpgrp
+#include <time.h> // clock_gettime
+#include <unistd.h> // close, dup, getpid, setpgid, tcsetpgrp, environ
 #include <linux/limits.h> // PATH_MAX
 
-#include "signals.h" // reset_signals
+#include "signals.h" // reset_ignored_signals, ignored_signal_set, sig_setmask
 #include "ds/proc.h" // proc, job
-#include "ds/hash_table.h" // hash_table, add_node, find_node, free_table
-#include "execute.h" // proc_func
+#include "ds/hash_table.h" // hash_table, table_add, table_find, free_table
+#include "complete.h" // path_index_find
+#include "coproc.h" // m_coproc, m_cosend, forget_coprocs
+#include "execute.h" // proc_func, DEFAULT_PATH
+#include "expand.h" // expand_job
+#include "fdio.h" // make_pipe, text_fd
 #include "jobs.h" // interactive, shell_term, wait_for_job, put_job_in_*...
+#include "notify.h" // flush_notifications
+#include "launcher.h" // launcher_spawn, forget_launcher
+#include "options.h" // options, find_option, set_option
+#include "parallel.h" // m_parallel
+#include "prompt.h" // prompt_dir_changed
+#include "resources.h" // enter_job_resources, place_proc, m_ulimit...
+#include "stats.h" // stat_begin, stat_end, stat_end_detail, m_stats
 #include "macros.h" // Stopif, Free, Arr_len
 
 // Default mode with which to create files
 #define FILE_MASK 0666
 
+// glibc 2.35 can hand the terminal to the child as a spawn file action, which
+// is the only thing a foreground job needs that posix_spawn can't otherwise do
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+#define HAVE_SPAWN_TCSETPGRP
+#endif
+
 static void cleanup_builtins(void);
-static void exec_proc(proc const *p);
+static void exec_proc(proc const *p, char const *path, char **envp);
+static pid_t spawn_proc(job const *j, proc const *p, char const *path,
+                        char **envp);
+static pid_t start_proc(job const *j, proc const *p, char const *path,
+                        char **envp);
+static int launch_builtin(job *j, proc *p, builtin const *b);
+static int start_procs(job *j);
 static int m_cd(proc const *p);
+static int m_exec(proc const *p);
 static int m_exit(proc const *p);
+static int m_hash(proc const *p);
 static int m_help(proc const *p);
+static int m_jobs(proc const *p);
+static int m_setopt(proc const *p);
+static int m_wait(proc const *p);
 
 // Names of shell builtins
 static char const *builtin_names[] = {
     "cd",
+    "coproc",
+    "cosend",
+    "exec",
     "exit",
+    "hash",
     "help",
+    "jobs",
+    "parallel",
+    "setopt",
+    "stats",
+    "ulimit",
+    "wait",
 };
 
 // Functions associated with shell builtins
 static proc_func const builtin_funcs[] = {
     m_cd,
+    m_coproc,
+    m_cosend,
+    m_exec,
     m_exit,
+    m_hash,
     m_help,
+    m_jobs,
+    m_parallel,
+    m_setopt,
+    m_stats,
+    m_ulimit,
+    m_wait,
 };
 
 static char oldpwd[PATH_MAX];
 
+// Value of PATH the HASHED entries in lookup_table were resolved against
+static char *hashed_path;
+
 // Hash table for shell builtins
-hash_table lookup_table;
+hash_table *lookup_table;
 
 // Create hashtable of shell builtins
 // Returns true on success, false on failure
@@ -71,9 +128,8 @@ bool initialize_builtins(void)
     for (size_t i = 0; i < Arr_len(builtin_names); i++) {
         builtin *b = malloc(sizeof *b);
         Assert_alloc(b);
-        b->type=CMD;
         b->cmd = builtin_funcs[i];
-        if (add_node(builtin_names[i], b, lookup_table) != 0) {
+        if (table_add(builtin_names[i], CMD, b, lookup_table) != 0) {
             return 0;
         }
     }
@@ -84,7 +140,7 @@ bool initialize_builtins(void)
     return true;
 }
 
-static inline void builtin_destructor(node *n)
+static inline void builtin_destructor(table_entry *n)
 {
     free(n->value);
 }
@@ -93,6 +149,7 @@ static inline void builtin_destructor(node *n)
 static void cleanup_builtins(void)
 {
     free_table(lookup_table, builtin_destructor);
+    Free(hashed_path);
 }
 
 static void fd_cleanup(int *fd_arr, size_t n)
@@ -118,25 +175,434 @@ static void fd_cleanup(int *fd_arr, size_t n)
         }                                       \
     } while (0)
 
-static inline bool filter_command(void *val)
+// Drop every resolved command path from lookup_table
+static void clear_command_hash(void)
+{
+    table_remove_all(HASHED, builtin_destructor, lookup_table);
+    Free(hashed_path);
+}
+
+// Search the directories in dirs for an executable called name, like execvp
+// does. On success the full path is written to buf (PATH_MAX bytes) and true
+// is returned
+static bool search_path(char const *name, char const *dirs, char *buf)
+{
+    size_t name_len = strlen(name);
+    char const *dir = dirs;
+    for (;;) {
+        char const *end = strchrnul(dir, ':');
+        size_t dir_len = end - dir;
+        // An empty entry means the current directory
+        if (dir_len == 0) {
+            dir = ".";
+            dir_len = 1;
+        }
+        if (dir_len + name_len + 2 <= PATH_MAX) {
+            memcpy(buf, dir, dir_len);
+            buf[dir_len] = '/';
+            memcpy(buf + dir_len + 1, name, name_len + 1);
+            struct stat st;
+            if (stat(buf, &st) == 0 && S_ISREG(st.st_mode)
+                    && access(buf, X_OK) == 0) {
+                return true;
+            }
+        }
+        if (!*end) {
+            return false;
+        }
+        dir = end + 1;
+    }
+}
+
+// Resolve name against PATH and remember the result in lookup_table. Returns
+// the cached path or NULL if name isn't an executable on PATH. One found
+// through a relative entry (such as . or an empty one) depends on the working
+// directory, so it is only written to buf (PATH_MAX bytes) and not cached
+static char const *hash_command(char const *name, char *buf)
+{
+    char const *path = getenv("PATH");
+    if (!path) {
+        path = DEFAULT_PATH;
+    }
+
+    // Every cached entry is stale once PATH changes
+    if (hashed_path && strcmp(hashed_path, path) != 0) {
+        clear_command_hash();
+    }
+
+    builtin *b = table_find(name, HASHED, lookup_table);
+    if (b) {
+        return b->path;
+    }
+
+    if (!path_index_find(name, path, buf)
+            && !search_path(name, path, buf)) {
+        return NULL;
+    }
+    if (*buf != '/') {
+        return buf;
+    }
+    if (!hashed_path) {
+        hashed_path = strdup(path);
+        Assert_alloc(hashed_path);
+    }
+    // Key and path live in the same allocation as the entry so that
+    // builtin_destructor frees all of it
+    size_t name_len = strlen(name) + 1;
+    size_t found_len = strlen(buf) + 1;
+    b = malloc(sizeof *b + name_len + found_len);
+    Assert_alloc(b);
+    char *key = (char *) (b + 1);
+    memcpy(key, name, name_len);
+    b->path = key + name_len;
+    memcpy(b->path, buf, found_len);
+    table_add(key, HASHED, b, lookup_table);
+    return b->path;
+}
+
+// Forget the cached location of name, e.g. because the file is gone
+static void unhash_command(char const *name)
+{
+    free(table_remove(name, HASHED, lookup_table));
+}
+
+// Returns the value p assigns to PATH for itself or NULL if it doesn't. Such a
+// proc must not be looked up in (or added to) the command hash
+static char const *own_path(proc const *p)
+{
+    char const *ret = NULL;
+    char **env_end = p->env + vec_len(p->env);
+    for (char **e_p = p->env; e_p != env_end; e_p++) {
+        if (strncmp(*e_p, "PATH=", 5) == 0) {
+            ret = *e_p + 5;
+        }
+    }
+    return ret;
+}
+
+// Returns the file p should execute, or NULL if the command can't be found.
+// buf (PATH_MAX bytes) is used for lookups that bypass the command hash
+static char const *find_command(proc const *p, char *buf)
+{
+    char const *name = *p->argv;
+    if (strchr(name, '/')) {
+        return name;
+    }
+    char const *dirs = own_path(p);
+    if (dirs) {
+        return search_path(name, dirs, buf) ? buf : NULL;
+    }
+    return hash_command(name, buf);
+}
+
+// Length of the name part of a "NAME=VALUE" string
+static inline size_t env_name_len(char const *e)
+{
+    return strchrnul(e, '=') - e;
+}
+
+// Build the environment p is executed with: its own assignments, then every
+// inherited variable they don't override. Only the pointer array is
+// allocated, out of a; the strings are shared with p and environ. Returns
+// environ itself when p has no assignments
+static char **build_envp(proc const *p, arena *a)
+{
+    size_t n_own = vec_len(p->env);
+    if (n_own == 0) {
+        return environ;
+    }
+    size_t n_inherited = 0;
+    while (environ[n_inherited]) {
+        n_inherited++;
+    }
+
+    char **envp = arena_alloc(a, (n_own + n_inherited + 1) * sizeof *envp);
+    size_t len = 0;
+    for (size_t i = 0; i < n_own; i++) {
+        char *e = p->env[i];
+        size_t name_len = env_name_len(e) + 1;
+        // If a name is assigned more than once the last assignment wins
+        bool dup = false;
+        for (size_t k = i + 1; k < n_own && !dup; k++) {
+            dup = strncmp(p->env[k], e, name_len) == 0;
+        }
+        if (!dup) {
+            envp[len++] = e;
+        }
+    }
+    size_t n_set = len;
+    for (size_t i = 0; i < n_inherited; i++) {
+        char *e = environ[i];
+        size_t name_len = env_name_len(e) + 1;
+        bool overridden = false;
+        for (size_t k = 0; k < n_set && !overridden; k++) {
+            overridden = strncmp(envp[k], e, name_len) == 0;
+        }
+        if (!overridden) {
+            envp[len++] = e;
+        }
+    }
+    envp[len] = NULL;
+    return envp;
+}
+
+// Returns true if j can be started with posix_spawn. Everything else falls
+// back to fork + exec_proc. That includes every job under resource control,
+// which the child has to join before it execs
+static inline bool can_spawn(job const *j)
 {
-    builtin *b = val;
-    return b->type == CMD;
+    if (job_resources_active()) {
+        return false;
+    }
+#ifndef HAVE_SPAWN_TCSETPGRP
+    // The child has to take the terminal itself before it execs
+    return !interactive || j->bkg;
+#else
+    (void) j;
+    return true;
+#endif
+}
+
+// Start external command p as part of j. A command that can't be found or
+// executed is marked as completed with M_FAILED_EXEC. Returns 0 on success and
+// M_FAILED_EXEC if no process could be created at all
+static int launch_proc(job *j, proc *p)
+{
+    char buf[PATH_MAX];
+    char const *path = find_command(p, buf);
+    char **envp = build_envp(p, j->arena);
+    pid_t pid;
+    if (!path) {
+        errno = ENOENT;
+        pid = -1;
+    } else if (can_spawn(j)
+               || (launcher_running() && !job_resources_active())) {
+        pid = start_proc(j, p, path, envp);
+        // The hashed location may have gone away since it was cached
+        if (pid < 0 && errno == ENOENT && path != *p->argv && path != buf) {
+            unhash_command(*p->argv);
+            path = hash_command(*p->argv, buf);
+            if (path) {
+                pid = start_proc(j, p, path, envp);
+            } else {
+                errno = ENOENT;
+            }
+        }
+    } else {
+        pid = fork();
+        Stopif(pid < 0, return M_FAILED_EXEC,
+               "Could not fork process: %s", strerror(errno));
+        if (pid == 0) { // Child
+            Set_proc_group(j, pid, j->pgid);
+            enter_job_resources(j);
+            reset_ignored_signals();
+            // The shell blocks the signals it reads from a signalfd
+            sigset_t none;
+            sigemptyset(&none);
+            sig_setmask(none);
+            exec_proc(p, path, envp);
+        }
+    }
+
+    if (pid < 0) {
+        Err_msg("%s: %s", strerror(errno), *p->argv);
+        mark_proc_completed(j, p, M_FAILED_EXEC);
+    } else {
+        Set_proc_group(j, pid, j->pgid);
+        place_proc(j, pid);
+        p->pid = pid;
+        register_proc(j, p);
+    }
+    return 0;
+}
+
+// Run builtin b as p in a child process of its own, so that it runs alongside
+// the rest of j. Like a subshell, nothing the builtin does to the shell's state
+// outlives it. Returns 0 on success and M_FAILED_EXEC if the fork fails
+static int launch_builtin(job *j, proc *p, builtin const *b)
+{
+    pid_t pid = fork();
+    Stopif(pid < 0, return M_FAILED_EXEC,
+           "Could not fork process: %s", strerror(errno));
+    if (pid == 0) { // Child
+        Set_proc_group(j, pid, j->pgid);
+        enter_job_resources(j);
+        reset_ignored_signals();
+        sigset_t none;
+        sigemptyset(&none);
+        sig_setmask(none);
+        // The read end of its own output pipe would keep the builtin from
+        // seeing the next stage go away
+        proc **p_p = j->procs;
+        while (*p_p++ != p);
+        if (p_p != j->procs + vec_len(j->procs)) {
+            close((*p_p)->fds[0]);
+        }
+        leave_job_control();
+        forget_launcher();
+        // cosend talks to a coprocess through them
+        if (b->cmd != m_cosend) {
+            forget_coprocs();
+        }
+        // Stdio buffers inherited from the shell must not be flushed twice
+        _Exit(b->cmd(p));
+    }
+    Set_proc_group(j, pid, j->pgid);
+    place_proc(j, pid);
+    p->pid = pid;
+    register_proc(j, p);
+    return 0;
+}
+
+// Open the files j redirects its IO to, storing the fds in the matching slots
+// of io_fd. Copies (2>&1) are made once every file is open, so they refer to
+// where the fd ends up. Everything opened here is close-on-exec; children get
+// their copies through dup2. Returns false (with nothing left open) if any of
+// them fails
+static bool open_job_io(job const *j, int *io_fd)
+{
+    size_t n = Arr_len(j->io);
+    for (size_t i = 0; i < n; i++) {
+        proc_io const *io = &j->io[i];
+        if (io->kind == IO_FILE) {
+            io_fd[i] = open(io->path, io->oflag | O_CLOEXEC, FILE_MASK);
+        } else if (io->kind == IO_HERE) {
+            io_fd[i] = text_fd(io->text, io->text_len);
+        }
+        Stopif(io_fd[i] == -1, io_fd[i] = i; fd_cleanup(io_fd, n);
+               return false, "%s", strerror(errno));
+    }
+    for (size_t i = 0; i < n; i++) {
+        int src = j->io[i].fd;
+        if (j->io[i].kind != IO_DUP) {
+            continue;
+        }
+        // Past 2 only what exec opened may be used; the shell's own fds are
+        // all close-on-exec
+        int flags = fcntl(src, F_GETFD);
+        Stopif(src > 2 && (flags < 0 || flags & FD_CLOEXEC),
+               fd_cleanup(io_fd, n); return false,
+               "%d: %s", src, strerror(EBADF));
+        io_fd[i] = fcntl(src <= 2 ? io_fd[src] : src, F_DUPFD_CLOEXEC, 3);
+        Stopif(io_fd[i] == -1, io_fd[i] = i; fd_cleanup(io_fd, n);
+               return false, "%s", strerror(errno));
+    }
+    return true;
 }
 
 // Takes a job and returns the exit status of its last process
 int launch_job(job *j)
 {
-    int io_fd[] = {0, 1, 2};
-    // Open IO fds
-    for (size_t i = 0; i < Arr_len(j->io); i++) {
-        if (j->io[i].path) {
-            io_fd[i] = open(j->io[i].path, j->io[i].oflag, FILE_MASK);
+    // Background jobs may have to wait for a slot
+    if (j->bkg && !schedule_job(j)) {
+        return 0;
+    }
+    int ret = start_job(j);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (j->bkg) {
+        // Without job control background jobs are simply left to run
+        if (interactive) {
+            send_to_background(j, false);
+            format_job_info(j, NOTE_LAUNCHED);
+        }
+    } else if (interactive) {
+        send_to_foreground(j, false);
+    } else {
+        wait_for_job(j);
+    }
+
+    return 0;
+}
+
+// Start every proc in j, connected by pipes, without waiting for any of them.
+// The first proc reads from and the last proc writes to the fds they already
+// have unless j redirects them. Those fds are closed once the procs have been
+// started. Returns 0 on success, M_FAILED_IO or M_FAILED_EXEC on failure, in
+// which case every proc in j has been marked completed
+int start_job(job *j)
+{
+    stat_span span = stat_begin();
+    int ret = start_procs(j);
+    stat_end(STAT_LAUNCH, span);
+    return ret;
+}
+
+// Run the command substitutions in j (see expand_job). If that fails, every
+// proc is marked as having failed to start, and false is returned
+static bool expand_or_fail(job *j)
+{
+    if (expand_job(j)) {
+        return true;
+    }
+    proc **proc_end = j->procs + vec_len(j->procs);
+    for (proc **p_p = j->procs; p_p != proc_end; p_p++) {
+        mark_proc_completed(j, *p_p, M_FAILED_EXEC);
+    }
+    return false;
+}
+
+// Give up on starting j at from, after which nothing has been started. The
+// fds the remaining procs hold are closed and they are marked as having failed
+// with err. Those already started are killed, since they would be left reading
+// from or writing to a pipeline that is never finished, and reaped. A
+// foreground j may already have been given the terminal, which the shell takes
+// back. Returns err
+static int abandon_procs(job *j, proc **from, int err)
+{
+    proc **proc_end = j->procs + vec_len(j->procs);
+    for (proc **p_p = from; p_p != proc_end; p_p++) {
+        proc *p = *p_p;
+        fd_cleanup(p->fds, Arr_len(p->fds));
+        for (size_t i = 0; i < Arr_len(p->fds); i++) {
+            p->fds[i] = i;
         }
-        Stopif(io_fd[i] == -1, fd_cleanup(io_fd, i);
-               return M_FAILED_IO, "%s", strerror(errno));
+        mark_proc_completed(j, p, err);
+    }
+    for (proc **p_p = j->procs; p_p != from; p_p++) {
+        proc const *p = *p_p;
+        if (p->pid && !p->completed) {
+            kill(p->pid, SIGKILL);
+        }
+    }
+    wait_for_job(j);
+    if (interactive && !j->bkg && j->pgid) {
+        reclaim_terminal(j);
+    }
+    return err;
+}
+
+// The body of start_job
+static int start_procs(job *j)
+{
+    clock_gettime(CLOCK_MONOTONIC, &j->start);
+    if (!expand_or_fail(j)) {
+        return M_FAILED_EXEC;
     }
     proc **proc_end = j->procs + vec_len(j->procs);
+    int io_fd[] = {j->procs[0]->fds[0], proc_end[-1]->fds[1],
+                   proc_end[-1]->fds[2]};
+    int given[Arr_len(io_fd)];
+    memcpy(given, io_fd, sizeof io_fd);
+    stat_span span = stat_begin();
+    bool opened = open_job_io(j, io_fd);
+    stat_end(STAT_REDIRECT, span);
+    // A given fd that was redirected over would otherwise never be closed,
+    // leaving whoever reads from it waiting
+    for (size_t i = 0; i < Arr_len(io_fd); i++) {
+        if (given[i] != io_fd[i] && given[i] != (int) i) {
+            close(given[i]);
+        }
+    }
+    if (!opened) {
+        // Everything open_job_io was given has been closed
+        j->procs[0]->fds[0] = STDIN_FILENO;
+        proc_end[-1]->fds[1] = STDOUT_FILENO;
+        proc_end[-1]->fds[2] = STDERR_FILENO;
+        return abandon_procs(j, j->procs, M_FAILED_IO);
+    }
 
     // Set input fd in first process
     j->procs[0]->fds[0] = io_fd[0];
@@ -150,67 +616,157 @@ int launch_job(job *j)
         if (p_p != proc_end - 1) {
             proc *p_next = *(p_p+1);
             int fd[2];
-            pipe(fd);
+            span = stat_begin();
+            int err = make_pipe(fd);
+            stat_end(STAT_PIPE, span);
+            Stopif(err < 0, return abandon_procs(j, p_p, M_FAILED_IO),
+                   "Could not create pipe: %s", strerror(errno));
             p->fds[1] = fd[1];
             p_next->fds[0] = fd[0];
         }
 
-        builtin *b = find_node(p->argv[0],filter_command, lookup_table);
+        builtin *b = table_find(p->argv[0], CMD, lookup_table);
 
-        if (b) { // Builtin found
-            p->exit_code = b->cmd(p);
-            p->completed = 1;
+        clock_gettime(CLOCK_MONOTONIC, &p->start);
+        if (b && proc_end - j->procs == 1) { // Builtin found
+            mark_proc_completed(j, p, b->cmd(p));
         } else {
-            pid_t pid = fork();
-            Stopif(pid < 0, return M_FAILED_EXEC, "Could not fork process: %s",
-                   strerror(errno));
-            if (pid == 0) { // Child
-                Set_proc_group(j, pid, j->pgid);
-                reset_ignored_signals();
-                exec_proc(p);
-            } else { // Parent
-                Set_proc_group(j, pid, j->pgid);
-                p->pid = pid;
+            // A builtin in a pipeline runs in a child of its own; one that
+            // filled its pipe would block the shell before the stages
+            // reading from it were started
+            span = stat_begin();
+            int err = b ? launch_builtin(j, p, b) : launch_proc(j, p);
+            stat_end_detail(STAT_SPAWN, span, *p->argv, strlen(*p->argv));
+            if (err != 0) {
+                return abandon_procs(j, p_p, M_FAILED_EXEC);
             }
         }
 
         fd_cleanup(p->fds, Arr_len(io_fd));
     }
+    return 0;
+}
 
-    if (!interactive) {
-        wait_for_job(j);
-    } else if (j->bkg) {
-        send_to_background(j, false);
-        format_job_info(j, "launched");
-    } else {
-        send_to_foreground(j, false);
+// Replace the shell with j instead of forking, for when nothing is left to do
+// once j completes. Only a single external command in the foreground that
+// isn't timed, with no jobs waiting to be launched, can be run this way;
+// anything else is handed to launch_job. Returns only if j was
+// not exec'd, with the same result as launch_job
+int exec_job(job *j)
+{
+    // What is run may depend on the output of a substitution
+    if (!expand_or_fail(j)) {
+        return M_FAILED_EXEC;
+    }
+    proc *p = *j->procs;
+    if (interactive || j->bkg || j->timed || queued_job_count()
+        || vec_len(j->procs) != 1
+        || table_find(*p->argv, CMD, lookup_table)) {
+        return launch_job(j);
     }
 
-    return 0;
+    int io_fd[] = {0, 1, 2};
+    if (!open_job_io(j, io_fd)) {
+        mark_proc_completed(j, p, M_FAILED_IO);
+        return M_FAILED_IO;
+    }
+    memcpy(p->fds, io_fd, sizeof io_fd);
+
+    char buf[PATH_MAX];
+    char const *path = find_command(p, buf);
+    Stopif(!path, mark_proc_completed(j, p, M_FAILED_EXEC);
+           return M_FAILED_EXEC, "%s: %s", strerror(ENOENT), *p->argv);
+
+    // Nothing buffered by the shell may be lost
+    fflush(NULL);
+    exec_proc(p, path, build_envp(p, j->arena));
+    return M_FAILED_EXEC;
 }
 
 
-static void exec_proc(proc const *p)
+// Replace the current process with p, executing the file at path with
+// environment envp
+static void exec_proc(proc const *p, char const *path, char **envp)
 {
-    char **env_end = p->env + vec_len(p->env);
-    for (char **e_p = p->env; e_p != env_end; e_p++) {
-        char *e = *e_p;
-        char *value = e + strlen(e) + 1;
-        unsetenv(e);
-        Stopif(setenv(e, value, 1) == -1, /* No action */,
-               "Could not set the following variable %s to %s", e, value);
-    }
-
     for (size_t i = 0;  i < Arr_len(p->fds); i++) {
         dup2(p->fds[i], i);
     }
 
+    execve(path, p->argv, envp);
+    // The hashed path may be stale. The parent's hash is not touched from
+    // here; the spawn path takes care of that
+    if (errno == ENOENT && path != *p->argv) {
+        execvpe(*p->argv, p->argv, envp);
+    }
+
     // _Exit is used because cleanup_jobs is executed when `exit` is run and we
     // don't want to kill our other processes
-    Stopif(execvp(*p->argv, p->argv) == -1, _Exit(M_FAILED_EXEC),"%s: %s",
-           strerror(errno), *p->argv);
+    Err_msg("%s: %s", strerror(errno), *p->argv);
+    _Exit(M_FAILED_EXEC);
+}
+
+// Start p, executing the file at path with environment envp, without copying
+// the shell's address space. Process group, terminal and signal setup that the
+// fork path does by hand are expressed as spawn attributes and file actions
+// instead. Returns pid of the child, or -1 with errno set on failure (including
+// failure to exec)
+static pid_t spawn_proc(job const *j, proc const *p, char const *path,
+                        char **envp)
+{
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_init(&attr);
+    posix_spawn_file_actions_init(&actions);
+
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    sigset_t sigdef = ignored_signal_set();
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigdefault(&attr, &sigdef);
+    posix_spawnattr_setsigmask(&attr, &mask);
+
+    if (interactive) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, j->pgid);
+#ifdef HAVE_SPAWN_TCSETPGRP
+        // Has to run before stdin is replaced below
+        if (!j->bkg) {
+            posix_spawn_file_actions_addtcsetpgrp_np(&actions, SHELL_TERM);
+        }
+#endif
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    for (size_t i = 0; i < Arr_len(p->fds); i++) {
+        if (p->fds[i] != (int) i) {
+            posix_spawn_file_actions_adddup2(&actions, p->fds[i], i);
+        }
+    }
+
+    pid_t pid;
+    int err = posix_spawn(&pid, path, &actions, &attr, p->argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return pid;
 }
 
+// Start p through the launcher if there is one that takes it, otherwise with
+// spawn_proc. The launcher hands foreground jobs the terminal itself, so it is
+// also used where can_spawn says no; the rare request it turns down there
+// gets the terminal from Set_proc_group in the parent instead
+static pid_t start_proc(job const *j, proc const *p, char const *path,
+                        char **envp)
+{
+    pid_t pid;
+    if (launcher_spawn(j, p, path, envp, &pid)) {
+        return pid;
+    }
+    return spawn_proc(j, p, path, envp);
+}
 
 static int m_cd(proc const *p)
 {
@@ -227,6 +783,71 @@ static int m_cd(proc const *p)
     getcwd(oldpwd, PATH_MAX);
     Stopif(chdir(dir) == -1, return 1, "%s", strerror(errno));
     if (old) Free(dir);
+    prompt_dir_changed();
+    return 0;
+}
+
+// Make fd r->fd what r says, for as long as the shell runs. Returns false on
+// failure
+static bool apply_redir(fd_redir const *r)
+{
+    // The shell's own fds are all close-on-exec, and must not be clobbered
+    int flags = fcntl(r->fd, F_GETFD);
+    Stopif(flags >= 0 && flags & FD_CLOEXEC, return false,
+           "exec: fd %d is in use by the shell", r->fd);
+    if (r->src == REDIR_CLOSE) {
+        close(r->fd);
+        return true;
+    } else if (r->src != REDIR_OPEN) {
+        Stopif(dup2(r->src, r->fd) < 0, return false,
+               "exec: %d: %s", r->src, strerror(errno));
+        return true;
+    }
+    // Not close-on-exec: every command from now on inherits it
+    int fd = open(r->path, r->oflag, FILE_MASK);
+    Stopif(fd < 0, return false, "exec: %s: %s", r->path, strerror(errno));
+    if (fd != r->fd) {
+        int err = dup2(fd, r->fd) < 0 ? errno : 0;
+        close(fd);
+        Stopif(err, return false, "exec: %s: %s", r->path, strerror(err));
+    }
+    return true;
+}
+
+// exec COMMAND [ARG...]: replace the shell with COMMAND
+// exec REDIRECTIONS: apply them to the shell itself, so that they stay in
+// effect for every command run afterwards, e.g. `exec 3>>log` and then
+// `cmd >&3`, without the file being opened again for each of them
+static int m_exec(proc const *p)
+{
+    size_t n = p->redirs ? vec_len(p->redirs) : 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!apply_redir(&p->redirs[i])) {
+            return 1;
+        }
+    }
+    if (p->argv[1]) {
+        proc cmd = *p;
+        cmd.argv = p->argv + 1;
+        char buf[PATH_MAX];
+        char const *path = find_command(&cmd, buf);
+        Stopif(!path, return M_FAILED_EXEC,
+               "exec: %s: %s", *cmd.argv, strerror(ENOENT));
+        char **envp = build_envp(&cmd, arena_new());
+        reset_ignored_signals();
+        sigset_t none;
+        sigemptyset(&none);
+        sig_setmask(none);
+        // Nothing buffered by the shell may be lost
+        fflush(NULL);
+        exec_proc(&cmd, path, envp);
+    }
+    for (size_t i = 0; i < Arr_len(p->fds); i++) {
+        if (p->fds[i] != (int) i) {
+            Stopif(dup2(p->fds[i], i) < 0, return 1,
+                   "exec: %s", strerror(errno));
+        }
+    }
     return 0;
 }
 
@@ -237,6 +858,41 @@ static int m_exit(proc const *p)
     exit(exit_code);
 }
 
+// hash: list cached command locations
+// hash -r: forget all of them
+// hash NAME...: look up each NAME now and remember where it is
+static int m_hash(proc const *p)
+{
+    char **args = p->argv + 1;
+    if (!*args) {
+        table_entry const *e;
+        for (size_t i = 0; (e = table_next(&i, lookup_table));) {
+            if (e->type == HASHED) {
+                builtin *b = e->value;
+                dprintf(p->fds[1], "%s\t%s\n", e->key, b->path);
+            }
+        }
+        return 0;
+    }
+
+    if (strcmp(*args, "-r") == 0) {
+        clear_command_hash();
+        return 0;
+    }
+
+    int ret = 0;
+    char buf[PATH_MAX];
+    for (; *args; args++) {
+        // Builtins and paths are never looked up in PATH
+        if (table_find(*args, CMD, lookup_table) || strchr(*args, '/')) {
+            continue;
+        }
+        Stopif(!hash_command(*args, buf), ret = 1, "hash: %s: not found",
+               *args);
+    }
+    return ret;
+}
+
 static int m_help(proc const *p)
 {
     char help_msg[] = "Marcel the Shell (with shoes on) v. " VERSION "\n"
@@ -246,3 +902,42 @@ static int m_help(proc const *p)
     write(p->fds[1], help_msg, sizeof help_msg / sizeof (char));
     return 0;
 }
+
+static int m_jobs(proc const *p)
+{
+    // Pick up anything that finished since the last prompt
+    report_job_status();
+    flush_notifications();
+    list_jobs(p->fds[1]);
+    return 0;
+}
+
+// setopt: list every option with its value
+// setopt NAME: show one option
+// setopt NAME VALUE: set it
+static int m_setopt(proc const *p)
+{
+    char **args = p->argv + 1;
+    if (!*args) {
+        for (size_t i = 0; i < Arr_len(options); i++) {
+            print_option(p->fds[1], &options[i]);
+        }
+        return 0;
+    }
+    option *o = find_option(args[0]);
+    Stopif(!o, return 1, "setopt: no such option: %s", args[0]);
+    if (!args[1]) {
+        print_option(p->fds[1], o);
+        return 0;
+    }
+    Stopif(args[2], return 1, "usage: setopt [name [value]]");
+    return set_option(o, args[1]) ? 0 : 1;
+}
+
+// wait: block until every queued background job has been launched and every
+// background job has completed
+static int m_wait(proc const *p)
+{
+    (void) p;
+    return wait_for_background(false) ? 0 : M_SIGINT;
+}
@@ -23,10 +23,15 @@
 #include "ds/hash_table.h"
 #include "ds/proc.h" // proc
 
+// Search path used by execvp when PATH is unset
+#define DEFAULT_PATH "/bin:/usr/bin"
+
 // Builtin function
 typedef int (*proc_func)(proc const*);
 
 int launch_job(job *j);
+int start_job(job *j);
+int exec_job(job *j);
 bool initialize_builtins(void);
 
 
@@ -35,15 +40,17 @@ typedef struct builtin {
     union {
         proc_func cmd;
         char *var;
+        char *path; // Resolved location of an external command
     };
-    int type;
 } builtin;
 
+// Types of entries in lookup_table
 enum {
     CMD,
     VAR,
+    HASHED,
 };
 
-extern hash_table lookup_table;
+extern hash_table *lookup_table;
 
 #endif
@@ -0,0 +1,309 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Command substitution: an argument $(command) is replaced by the words of
+// what command writes to its stdout, split on spaces, tabs and newlines.
+// Substitutions are run when the job using them is started, as jobs of their
+// own that are started with start_job and waited for like a foreground job,
+// while the output is read from a pipe.
+//
+// Output is read in large chunks into buffers in the arena of the job whose
+// argv the words go in, and split as it arrives. Each word is NUL terminated
+// where it lies and handed to argv as is, so output is never copied as a
+// whole; only a word cut off by the end of a buffer is moved to the start of
+// the next one. The submax option caps how much output a substitution may
+// produce.
+//
+// The words of the output are globbed like any other pattern, as are the
+// arguments the lexer found wildcards in (see wildcard.c).
+
+#include <errno.h> // errno
+#include <string.h> // strerror, strlen, memcpy
+
+#include <fcntl.h> // fcntl, FD_CLOEXEC
+#include <unistd.h> // read, close, lseek, dup
+
+#include "ds/arena.h" // arena_alloc, arena_strndup
+#include "ds/proc.h" // job, proc, new_job, free_single_job
+#include "ds/hash_table.h" // table_find
+#include "ds/vec.h" // Vec_push, vec_len, vec_setlen, vec_alloc_arena
+#include "execute.h" // start_job, lookup_table, CMD
+#include "expand.h" // prototypes
+#include "fdio.h" // make_pipe, scratch_fd
+#include "jobs.h" // interactive, register_job, wait_for_job...
+#include "options.h" // Num_opt, OPT_SUBMAX
+#include "parse_cache.h" // parse_job
+#include "stats.h" // stat_begin, stat_end_detail
+#include "wildcard.h" // has_glob_magic, glob_word, glob_literal
+#include "macros.h" // Stopif, Err_msg, Cleanup
+
+// Size of the buffers output is read into, unless a word needs more
+#define SUB_CHUNK (64 * 1024)
+
+// Splits output into words as it is read
+typedef struct word_reader {
+    arena *a; // Where buffers are allocated
+    char *buf;
+    size_t cap;
+    size_t len; // Bytes in buf
+    size_t word; // Start of the word being read
+    bool in_word;
+    size_t total; // Bytes read so far
+} word_reader;
+
+static inline bool is_separator(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+// Make room for at least one more byte in r's buffer. When it is full a new
+// one is started, with the word being read (if any) moved to its start
+static void make_room(word_reader *r)
+{
+    if (r->len < r->cap) {
+        return;
+    }
+    size_t keep = r->in_word ? r->len - r->word : 0;
+    size_t cap = 2 * keep > SUB_CHUNK ? 2 * keep : SUB_CHUNK;
+    char *buf = arena_alloc(r->a, cap);
+    if (keep) {
+        memcpy(buf, r->buf + r->word, keep);
+    }
+    r->buf = buf;
+    r->cap = cap;
+    r->len = keep;
+    r->word = 0;
+}
+
+// Split the bytes of r's buffer from from on, appending every word that ends
+// in them to *argv
+static void split_words(word_reader *r, size_t from, char ***argv)
+{
+    for (size_t i = from; i < r->len; i++) {
+        if (is_separator(r->buf[i])) {
+            if (r->in_word) {
+                r->buf[i] = '\0';
+                Vec_push(argv, r->buf + r->word);
+                r->in_word = false;
+            }
+        } else if (!r->in_word) {
+            r->word = i;
+            r->in_word = true;
+        }
+    }
+}
+
+// Read fd until EOF, appending the words read to *argv. Returns false on a
+// read error or once more than submax bytes have been read
+static bool read_words(int fd, word_reader *r, char ***argv)
+{
+    size_t max = Num_opt(OPT_SUBMAX);
+    for (;;) {
+        make_room(r);
+        ssize_t n = read(fd, r->buf + r->len, r->cap - r->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        Stopif(n < 0, return false, "$(...): %s", strerror(errno));
+        if (n == 0) {
+            break;
+        }
+        r->total += n;
+        Stopif(max && r->total > max, return false,
+               "$(...): output is over submax (%zu bytes)", max);
+        size_t from = r->len;
+        r->len += n;
+        split_words(r, from, argv);
+    }
+    // The last word doesn't have to be followed by anything
+    if (r->in_word) {
+        make_room(r);
+        r->buf[r->len] = '\0';
+        Vec_push(argv, r->buf + r->word);
+        r->in_word = false;
+    }
+    return true;
+}
+
+// Make fd into something j's output can be read from once it has been
+// started. That is a pipe, unless j is a builtin on its own: it is run by the
+// shell itself, which would block as soon as a pipe filled up with nobody
+// reading from it yet. Its output is collected in a scratch file instead,
+// which fd[0] reads from the start once the builtin has returned. Returns 0 on
+// success, -1 with errno set on failure
+static int open_output(job const *j, int fd[2])
+{
+    if (vec_len(j->procs) != 1
+        || !table_find(*j->procs[0]->argv, CMD, lookup_table)) {
+        return make_pipe(fd);
+    }
+    fd[1] = scratch_fd("marcel-sub");
+    if (fd[1] < 0) {
+        return -1;
+    }
+    fd[0] = dup(fd[1]);
+    if (fd[0] < 0 || fcntl(fd[0], F_SETFD, FD_CLOEXEC) < 0) {
+        int err = errno;
+        if (fd[0] >= 0) {
+            close(fd[0]);
+        }
+        close(fd[1]);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Run cmd, appending the words of its output to *argv, which is allocated out
+// of a. Returns false if cmd couldn't be run or its output couldn't be read in
+// full, or it was killed by a signal. Its exit status doesn't matter otherwise
+static bool substitute(char const *cmd, arena *a, char ***argv)
+{
+    size_t len = strlen(cmd);
+    job *j = new_job();
+    j->name = arena_strndup(j->arena, cmd, len);
+    Stopif(!parse_job(j, len), free_single_job(j); return false,
+           "$(%s): could not parse command", cmd);
+    proc_io const *in = &j->io[STDIN_FILENO];
+    Stopif(in->kind == IO_HERE && !in->text, free_single_job(j); return false,
+           "$(%s): here-documents can't be used here", cmd);
+    // Waited for here, with the terminal, and reported by no one
+    j->bkg = false;
+    j->quiet = true;
+
+    // What is run may depend on the output of a substitution
+    if (!expand_job(j)) {
+        free_single_job(j);
+        return false;
+    }
+    int fd[2];
+    Stopif(open_output(j, fd) < 0, free_single_job(j); return false,
+           "$(%s): %s", cmd, strerror(errno));
+    proc *last = j->procs[vec_len(j->procs) - 1];
+    last->fds[1] = fd[1];
+    Stopif(!register_job(j), close(fd[0]); close(fd[1]); free_single_job(j);
+           return false, "$(%s): could not register job", cmd);
+
+    // start_job closes fd[1] whether or not it succeeds
+    bool ok = start_job(j) == 0;
+    if (ok) {
+        word_reader r = {.a = a};
+        ok = lseek(fd[0], 0, SEEK_SET) >= 0 || errno == ESPIPE;
+        ok = ok && read_words(fd[0], &r, argv);
+    }
+    // Anything still writing after a failure gets SIGPIPE
+    close(fd[0]);
+    wait_for_job(j);
+    // ^C during a substitution cancels the command using it as well
+    if (ok && last->completed && last->exit_code == M_SIGINT) {
+        ok = false;
+    }
+    if (interactive) {
+        reclaim_terminal(j);
+    }
+    Cleanup(j, unregister_job);
+    return ok;
+}
+
+// Run the substitution cmd, appending the words of its output to *argv.
+// Words with wildcards in them are globbed in turn, and kept as they are if
+// they match nothing. Returns false if the substitution failed
+static bool expand_sub(char const *cmd, arena *a, char ***argv)
+{
+    stat_span span = stat_begin();
+    size_t start = vec_len(*argv);
+    bool ok = substitute(cmd, a, argv);
+    stat_end_detail(STAT_SUBST, span, cmd, strlen(cmd));
+    if (!ok) {
+        return false;
+    }
+    size_t end = vec_len(*argv);
+    size_t first = start;
+    while (first < end && !has_glob_magic((*argv)[first],
+                                          strlen((*argv)[first]))) {
+        first++;
+    }
+    if (first == end) {
+        return true;
+    }
+    // Matches replace the words, so the ones from the first pattern on are
+    // taken out and put back
+    size_t n = end - first;
+    char **words = arena_alloc(a, n * sizeof *words);
+    memcpy(words, *argv + first, n * sizeof *words);
+    vec_setlen(first, *argv);
+    for (size_t i = 0; i < n; i++) {
+        if (!has_glob_magic(words[i], strlen(words[i]))
+            || !glob_word(words[i], a, argv)) {
+            Vec_push(argv, words[i]);
+        }
+    }
+    return true;
+}
+
+// Kind of expansion argument i of p gets, -1 if it has none
+static int expansion_kind(proc const *p, size_t i)
+{
+    for (size_t k = 0; k < vec_len(p->expand); k++) {
+        if (p->expand[k].arg == i) {
+            return p->expand[k].kind;
+        }
+    }
+    return -1;
+}
+
+// Run the command substitutions and glob the patterns in the argvs of j's
+// procs, replacing each with the words they expand to. A pattern that matches
+// nothing is kept, less its escapes. Once a proc's argv has been expanded it
+// is left alone. Returns false if a substitution failed or a proc was left
+// without a command
+bool expand_job(job *j)
+{
+    for (size_t i = 0; i < vec_len(j->procs); i++) {
+        proc *p = j->procs[i];
+        if (!p->expand) {
+            continue;
+        }
+        // Never less than what is there already, which includes the NULL
+        size_t n = vec_len(p->argv);
+        char **argv = vec_alloc_arena(n * sizeof *argv, j->arena);
+        for (size_t arg = 0; arg + 1 < n; arg++) {
+            char *word = p->argv[arg];
+            switch (expansion_kind(p, arg)) {
+            case EXPAND_SUB:
+                if (!expand_sub(word, j->arena, &argv)) {
+                    return false;
+                }
+                break;
+            case EXPAND_GLOB:
+                if (!glob_word(word, j->arena, &argv)) {
+                    Vec_push(&argv, glob_literal(word));
+                }
+                break;
+            default:
+                Vec_push(&argv, word);
+            }
+        }
+        Stopif(!vec_len(argv), return false,
+               "$(%s): no command left to run", p->argv[0]);
+        Vec_push(&argv, NULL);
+        p->argv = argv;
+        p->expand = NULL;
+    }
+    return true;
+}
@@ -0,0 +1,232 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE // pipe2, splice, F_SETPIPE_SZ, memfd_create
+
+#include <errno.h> // errno
+#include <stdbool.h> // bool
+#include <stdlib.h> // realloc, mkstemp
+#include <string.h> // memchr, memmove, strerror
+
+#include <fcntl.h> // pipe2, splice, fcntl, O_CLOEXEC
+#include <limits.h> // PIPE_BUF
+#include <sys/mman.h> // memfd_create, MFD_CLOEXEC
+#include <sys/sendfile.h> // sendfile
+#include <sys/stat.h> // fstat, S_ISREG, S_ISFIFO
+#include <unistd.h> // read, write, close, lseek, unlink
+
+#include "fdio.h" // prototypes
+#include "options.h" // Num_opt, OPT_PIPESIZE
+#include "macros.h" // Stopif, Assert_alloc
+
+// Most bytes moved by one sendfile or splice call
+#define COPY_CHUNK (1 << 20)
+// Buffer used when the kernel can't copy by itself
+#define COPY_BUF_SIZE (64 * 1024)
+
+// Move fd, which the shell keeps open for itself, to the lowest free
+// descriptor from SHELL_FD_MIN up, closed on exec. Returns the new descriptor,
+// or fd itself if it can't be moved (or is -1)
+int shell_fd(int fd)
+{
+    if (fd < 0 || fd >= SHELL_FD_MIN) {
+        return fd;
+    }
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_MIN);
+    if (moved < 0) {
+        return fd;
+    }
+    close(fd);
+    return moved;
+}
+
+// Create a pipe that isn't inherited across exec, with the buffer size
+// requested by the pipesize option. The size is best effort: it is capped by
+// the system's pipe-max-size for unprivileged users. Returns 0 on success, -1
+// with errno set on failure
+int make_pipe(int fd[2])
+{
+    if (pipe2(fd, O_CLOEXEC) < 0) {
+        return -1;
+    }
+#ifdef F_SETPIPE_SZ
+    if (Num_opt(OPT_PIPESIZE)) {
+        fcntl(fd[1], F_SETPIPE_SZ, (int) Num_opt(OPT_PIPESIZE));
+    }
+#endif
+    return 0;
+}
+
+// Write all of buf to out. Returns false with errno set on failure
+bool write_all(int out, char const *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = write(out, buf, len);
+        if (n < 0 && errno != EINTR) {
+            return false;
+        }
+        if (n > 0) {
+            buf += n;
+            len -= n;
+        }
+    }
+    return true;
+}
+
+// Returns an fd, not inherited across exec, that reads the len bytes of text
+// and then EOF, or -1 with errno set on failure. Nothing touches the
+// filesystem: text that a pipe is guaranteed to hold in full is written into
+// one, anything longer into a memfd
+int text_fd(char const *text, size_t len)
+{
+    int fd[2];
+    if (len <= PIPE_BUF) {
+        if (pipe2(fd, O_CLOEXEC) < 0) {
+            return -1;
+        }
+        bool ok = write_all(fd[1], text, len);
+        int err = errno;
+        close(fd[1]);
+        if (!ok) {
+            close(fd[0]);
+            errno = err;
+            return -1;
+        }
+        return fd[0];
+    }
+    int mem = memfd_create("marcel-here", MFD_CLOEXEC);
+    if (mem < 0) {
+        return -1;
+    }
+    if (!write_all(mem, text, len) || lseek(mem, 0, SEEK_SET) < 0) {
+        int err = errno;
+        close(mem);
+        errno = err;
+        return -1;
+    }
+    return mem;
+}
+
+// Returns a file, not inherited across exec, to collect output in without a
+// reader having to keep up as it is written: a memfd named name, or an
+// unlinked temporary file where there are none. -1 with errno set on failure
+int scratch_fd(char const *name)
+{
+#ifdef MFD_CLOEXEC
+    return memfd_create(name, MFD_CLOEXEC);
+#else
+    (void) name;
+    char path[] = "/tmp/marcel-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    return fd;
+#endif
+}
+
+// Copy everything from in's current offset to EOF to out. The data doesn't go
+// through user space when the kernel can move it: sendfile from a regular file
+// (which includes a memfd), splice when either end is a pipe. Anything else
+// is read and written. Returns 0 on success, -1 with errno set on failure
+int copy_fd(int in, int out)
+{
+    enum { SENDFILE, SPLICE, READ_WRITE } how = READ_WRITE;
+    struct stat in_st, out_st;
+    if (fstat(in, &in_st) == 0 && S_ISREG(in_st.st_mode)) {
+        how = SENDFILE;
+    } else if (S_ISFIFO(in_st.st_mode)
+               || (fstat(out, &out_st) == 0 && S_ISFIFO(out_st.st_mode))) {
+        how = SPLICE;
+    }
+
+    bool copied = false;
+    for (;;) {
+        ssize_t n;
+        if (how == SENDFILE) {
+            n = sendfile(out, in, NULL, COPY_CHUNK);
+        } else if (how == SPLICE) {
+            n = splice(in, NULL, out, NULL, COPY_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+        } else {
+            char buf[COPY_BUF_SIZE];
+            n = read(in, buf, sizeof buf);
+            if (n > 0 && !write_all(out, buf, n)) {
+                return -1;
+            }
+        }
+
+        if (n == 0) {
+            return 0;
+        } else if (n > 0) {
+            copied = true;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (how != READ_WRITE && !copied
+                   && (errno == EINVAL || errno == ENOSYS)) {
+            // This pair of fds isn't supported, e.g. out is opened O_APPEND
+            how = READ_WRITE;
+        } else {
+            return -1;
+        }
+    }
+}
+
+// Returns the next line from r (without its newline, NUL terminated) or NULL
+// at EOF. The line is only valid until the next call. r->buf must have been
+// allocated with room for r->cap bytes
+char *read_line(line_reader *r)
+{
+    for (;;) {
+        char *line = r->buf + r->start;
+        char *nl = memchr(line, '\n', r->len - r->start);
+        if (nl || (r->eof && r->start < r->len)) {
+            char *end = nl ? nl : r->buf + r->len;
+            *end = '\0';
+            r->start = end - r->buf + (nl ? 1 : 0);
+            return line;
+        }
+        if (r->eof) {
+            return NULL;
+        }
+        // Move the partial line to the front, making room to read more
+        memmove(r->buf, line, r->len - r->start);
+        r->len -= r->start;
+        r->start = 0;
+        // Leave space for the NUL that terminates a final line
+        if (r->len + 1 >= r->cap) {
+            r->cap *= 2;
+            r->buf = realloc(r->buf, r->cap);
+            Assert_alloc(r->buf);
+        }
+        if (r->ready && !r->ready(r->fd)) {
+            return NULL;
+        }
+        ssize_t n = read(r->fd, r->buf + r->len, r->cap - r->len - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        Stopif(n < 0, /* Treat as EOF */, "%s: %s", r->name, strerror(errno));
+        if (n <= 0) {
+            r->eof = true;
+        } else {
+            r->len += n;
+        }
+    }
+}
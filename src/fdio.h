@@ -0,0 +1,52 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef M_FDIO_H
+#define M_FDIO_H
+
+#include <stdbool.h>
+#include <stddef.h> // size_t
+
+// Lowest descriptor the shell keeps its own files at, leaving the ones below
+// for exec redirections
+#define SHELL_FD_MIN 10
+
+// Reads lines from an fd without going through stdio, which would read ahead
+// of what the shell has consumed
+typedef struct line_reader {
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t start; // Start of the first unread line
+    size_t len; // Bytes in buf
+    bool eof;
+    char const *name; // What read errors are reported as coming from
+    // Called before blocking in read, may be NULL. If it returns false
+    // read_line gives up and returns NULL, without setting eof
+    bool (*ready)(int fd);
+} line_reader;
+
+int shell_fd(int fd);
+int make_pipe(int fd[2]);
+int copy_fd(int in, int out);
+bool write_all(int out, char const *buf, size_t len);
+char *read_line(line_reader *r);
+int text_fd(char const *text, size_t len);
+int scratch_fd(char const *name);
+
+#endif
@@ -0,0 +1,353 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE // memrchr
+
+#include <errno.h> // errno
+#include <stdio.h> // readline, snprintf
+#include <stdlib.h> // malloc, free, atexit, mkstemp
+#include <string.h> // strlen, strndup, memrchr
+
+#include <fcntl.h> // open, O_*
+#include <sys/file.h> // flock
+#include <sys/mman.h> // mmap, munmap
+#include <sys/stat.h> // fstat, stat, fchmod
+#include <sys/uio.h> // writev
+#include <sys/wait.h> // waitpid
+#include <unistd.h> // close, fork, setsid, unlink, write
+
+#include <readline/readline.h> // rl_*, Keymap
+#include <readline/history.h> // add_history, history_*_history_state
+
+#include "fdio.h" // shell_fd
+#include "history.h" // prototypes
+#include "options.h" // Num_opt, OPT_HISTSIZE, OPT_HISTFILESIZE
+#include "stats.h" // stat_begin, stat_end_detail
+#include "macros.h" // Stopif, Assert_alloc, Free, Arr_len
+
+// Entries handed to readline at a time as it moves back past the oldest one
+#define HIST_CHUNK 256
+#define HIST_MODE 0600
+
+// The history file is only ever appended to, one entry per line, by every
+// shell using it. Entries that were in the file at startup are read straight
+// from a private mapping of it and are given to readline only once it moves
+// back far enough to need them
+static int hist_fd = -1;
+static char *hist_path;
+static char const *hist_map;
+static size_t hist_map_len;
+// Entries of the mapping before this offset haven't been given to readline
+static size_t hist_loaded;
+
+static void cleanup_history(void);
+static size_t load_older(size_t n);
+static void load_all(void);
+static void compact_in_background(size_t keep);
+static void rebind_history_commands(Keymap map);
+
+static int hist_previous(int count, int key);
+static int hist_beginning(int count, int key);
+static int hist_reverse_search(int count, int key);
+static int hist_search_backward(int count, int key);
+
+// Readline commands that look further back than the entries already loaded,
+// mapped to the wrappers that load more first
+static struct {
+    char const *name;
+    rl_command_func_t *orig;
+    rl_command_func_t *wrapper;
+} const history_commands[] = {
+    {"previous-history", rl_get_previous_history, hist_previous},
+    {"beginning-of-history", rl_beginning_of_history, hist_beginning},
+    {"reverse-search-history", rl_reverse_search_history, hist_reverse_search},
+    {"history-search-backward", rl_history_search_backward,
+     hist_search_backward},
+};
+
+// Open the history file at path, creating it if need be, and give readline
+// its last histsize entries. Older entries are loaded when readline asks for
+// them. If the file has grown past histfilesize it is trimmed in the
+// background. Returns true on success, false if the file can't be used, in
+// which case history is only kept in memory
+bool initialize_history(char const *path)
+{
+    // Readline reads inputrc on initialization, which may bind commands
+    // that have to be replaced below
+    rl_initialize();
+    char const *maps[] = {"emacs", "vi-command", "vi-insert"};
+    for (size_t i = 0; i < Arr_len(maps); i++) {
+        rebind_history_commands(rl_get_keymap_by_name(maps[i]));
+    }
+    for (size_t i = 0; i < Arr_len(history_commands); i++) {
+        rl_add_defun(history_commands[i].name, history_commands[i].wrapper,
+                     -1);
+    }
+
+    hist_path = strdup(path);
+    Assert_alloc(hist_path);
+    atexit(cleanup_history);
+    hist_fd = shell_fd(open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC,
+                            HIST_MODE));
+    Stopif(hist_fd < 0, return false, "%s: %s", path, strerror(errno));
+
+    struct stat st;
+    if (fstat(hist_fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, hist_fd, 0);
+        if (map != MAP_FAILED) {
+            hist_map = map;
+            hist_loaded = hist_map_len = st.st_size;
+        }
+    }
+    load_older(Num_opt(OPT_HISTSIZE));
+
+    size_t cap = Num_opt(OPT_HISTFILESIZE);
+    // Leave some slack so the file isn't rewritten on every startup
+    if (cap && hist_map_len > cap + cap / 2) {
+        compact_in_background(cap);
+    }
+    return true;
+}
+
+static void cleanup_history(void)
+{
+    if (hist_map) {
+        munmap((void *) hist_map, hist_map_len);
+    }
+    if (hist_fd >= 0) {
+        close(hist_fd);
+    }
+    Free(hist_path);
+}
+
+// Add line to readline's history and append it to the history file, with a
+// single write so that entries from concurrent shells never interleave
+void save_history(char const *line)
+{
+    add_history(line);
+    if (hist_fd < 0 || !*line) {
+        return;
+    }
+
+    stat_span span = stat_begin();
+    flock(hist_fd, LOCK_SH);
+    // A compaction may have replaced the file since it was opened
+    struct stat fd_st, path_st;
+    while (fstat(hist_fd, &fd_st) == 0 && stat(hist_path, &path_st) == 0
+           && (fd_st.st_ino != path_st.st_ino
+               || fd_st.st_dev != path_st.st_dev)) {
+        int fd = open(hist_path, O_RDWR | O_APPEND | O_CLOEXEC);
+        if (fd < 0) {
+            break;
+        }
+        close(hist_fd);
+        hist_fd = shell_fd(fd);
+        flock(hist_fd, LOCK_SH);
+    }
+
+    struct iovec iov[] = {
+        {.iov_base = (char *) line, .iov_len = strlen(line)},
+        {.iov_base = "\n", .iov_len = 1},
+    };
+    Stopif(writev(hist_fd, iov, Arr_len(iov)) < 0, /* No action */,
+           "%s: %s", hist_path, strerror(errno));
+    flock(hist_fd, LOCK_UN);
+    stat_end_detail(STAT_HISTORY, span, "save", 4);
+}
+
+// Prepend up to n of the entries not yet given to readline to its history.
+// Returns the number added
+static size_t load_older(size_t n)
+{
+    if (!n || !hist_loaded) {
+        return 0;
+    }
+    stat_span span = stat_begin();
+    HIST_ENTRY **older = malloc(n * sizeof *older);
+    Assert_alloc(older);
+    // Walk back from the oldest entry loaded so far, filling older from the
+    // end so that it ends up oldest first
+    size_t k = n;
+    while (k && hist_loaded) {
+        size_t end = hist_loaded;
+        if (hist_map[end - 1] == '\n') {
+            end--;
+        }
+        char const *nl = memrchr(hist_map, '\n', end);
+        size_t start = nl ? (size_t) (nl - hist_map) + 1 : 0;
+        hist_loaded = start;
+        if (start != end) {
+            char *line = strndup(hist_map + start, end - start);
+            Assert_alloc(line);
+            older[--k] = alloc_history_entry(line, NULL);
+            free(line);
+        }
+    }
+
+    size_t added = n - k;
+    if (added) {
+        HISTORY_STATE *state = history_get_history_state();
+        size_t len = state->length;
+        HIST_ENTRY **list = malloc((added + len + 1) * sizeof *list);
+        Assert_alloc(list);
+        memcpy(list, older + k, added * sizeof *list);
+        if (len) {
+            memcpy(list + added, state->entries, len * sizeof *list);
+        }
+        list[added + len] = NULL;
+        free(state->entries);
+        state->entries = list;
+        state->length += added;
+        state->size = state->length + 1;
+        // Keep readline pointing at the same entry
+        state->offset += added;
+        history_set_history_state(state);
+        free(state);
+    }
+    free(older);
+    stat_end_detail(STAT_HISTORY, span, "load", 4);
+    return added;
+}
+
+// Give readline every entry in the file, for commands that search all of it
+static void load_all(void)
+{
+    size_t n = 0;
+    for (char const *p = hist_map, *end = hist_map + hist_loaded;
+         p && p != end; n++) {
+        p = memchr(p, '\n', end - p);
+        if (p) {
+            p++;
+        }
+    }
+    load_older(n);
+}
+
+static int hist_previous(int count, int key)
+{
+    if (where_history() < count) {
+        load_older(count - where_history() + HIST_CHUNK);
+    }
+    return rl_get_previous_history(count, key);
+}
+
+static int hist_beginning(int count, int key)
+{
+    load_all();
+    return rl_beginning_of_history(count, key);
+}
+
+static int hist_reverse_search(int count, int key)
+{
+    load_all();
+    return rl_reverse_search_history(count, key);
+}
+
+static int hist_search_backward(int count, int key)
+{
+    load_all();
+    return rl_history_search_backward(count, key);
+}
+
+// Point every key in map (and the keymaps under it) bound to one of
+// history_commands at its wrapper instead
+static void rebind_history_commands(Keymap map)
+{
+    if (!map) {
+        return;
+    }
+    for (int i = 0; i < KEYMAP_SIZE; i++) {
+        if (map[i].type == ISKMAP) {
+            // Readline keeps submaps in the function slot
+            rebind_history_commands((Keymap) map[i].function);
+        } else if (map[i].type == ISFUNC) {
+            for (size_t k = 0; k < Arr_len(history_commands); k++) {
+                if (map[i].function == history_commands[k].orig) {
+                    map[i].function = history_commands[k].wrapper;
+                }
+            }
+        }
+    }
+}
+
+// Replace the history file with the whole entries in its last keep bytes.
+// Shells appending to it hold a shared lock while they do, and reopen the file
+// if they find it was replaced
+static void compact_history(size_t keep)
+{
+    int fd = open(hist_path, O_RDONLY | O_CLOEXEC);
+    Stopif(fd < 0, return, "%s: %s", hist_path, strerror(errno));
+    flock(fd, LOCK_EX);
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size > keep) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+
+    char const *end = (char const *) map + st.st_size;
+    char const *start = end - keep;
+    // Don't keep the tail of a partial entry
+    char const *nl = memchr(start, '\n', end - start);
+    start = nl ? nl + 1 : end;
+
+    size_t tmp_len = strlen(hist_path) + sizeof ".XXXXXX";
+    char *tmp = malloc(tmp_len);
+    Assert_alloc(tmp);
+    snprintf(tmp, tmp_len, "%s.XXXXXX", hist_path);
+    int tmp_fd = mkstemp(tmp);
+    bool ok = tmp_fd >= 0 && fchmod(tmp_fd, st.st_mode & 07777) == 0;
+    while (ok && start != end) {
+        ssize_t n = write(tmp_fd, start, end - start);
+        ok = n > 0 || (n < 0 && errno == EINTR);
+        start += n > 0 ? n : 0;
+    }
+    if (tmp_fd >= 0) {
+        ok = close(tmp_fd) == 0 && ok;
+    }
+    if (ok) {
+        ok = rename(tmp, hist_path) == 0;
+    }
+    if (!ok && tmp_fd >= 0) {
+        unlink(tmp);
+    }
+    free(tmp);
+    munmap(map, st.st_size);
+    close(fd);
+}
+
+// Compact the history file in a detached grandchild, so the shell neither
+// waits for it nor ever has it reported as one of its children
+static void compact_in_background(size_t keep)
+{
+    pid_t pid = fork();
+    Stopif(pid < 0, return, "Could not fork process: %s", strerror(errno));
+    if (pid == 0) {
+        if (fork() == 0) {
+            // Keep the terminal's signals away from it
+            setsid();
+            compact_history(keep);
+        }
+        _Exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
@@ -16,20 +16,35 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <stdlib.h> // atexit
+#define _GNU_SOURCE // wait4, MAP_ANONYMOUS, MAP_NORESERVE
+
+#include <stdint.h> // SIZE_MAX
+#include <stdlib.h> // atexit, getenv
 #include <string.h> // strerror
 #include <errno.h> // errno
 
 #include <signal.h> // kill
+#include <sys/mman.h> // mmap, munmap
+#include <sys/resource.h> // rusage
+#include <sys/time.h> // timeradd
 #include <sys/types.h> // pid_t
-#include <sys/wait.h> // waitpid
+#include <sys/wait.h> // wait4
 #include <termios.h> // termios, TCSADRAIN
+#include <time.h> // clock_gettime
 #include <unistd.h> // getpgid, tcgetpgrp, tcsetpgrp, getpgrp...
 
+#include "ds/pid_table.h" // pid_table, pid_add, pid_find, pid_remove
 #include "ds/proc.h" // job, free_single_job, proc
-#include "ds/vec.h" // dyn_arrray, vec_alloc
+#include "ds/vec.h" // Vec_push, vec_alloc, vec_len, vec_setlen
+#include "execute.h" // launch_job
 #include "jobs.h" // function prototypes
-#include "signals.h" // sig_flags, WAITING_FOR_INPUT
+#include "coproc.h" // forget_coproc
+#include "launcher.h" // launcher_exited
+#include "notify.h" // notify_printf, count_note, flush_notifications...
+#include "resources.h" // release_job_resources, cgroup_usage
+#include "options.h" // Num_opt, OPT_MAXJOBS
+#include "signals.h" // sigset_t, sig_wait
+#include "stats.h" // stat_begin, stat_end
 #include "macros.h" // Cleanup, Stopif, Err_msg
 
 #ifndef WAIT_ANY
@@ -37,20 +52,52 @@
 #endif
 
 #define JOB_TABLE_INIT_SIZE 256
+// Most jobs that can be registered at once. The table is reserved in full up
+// front and only backed by memory as it fills, so slots never move
+#define JOB_TABLE_SLOTS (64 * 1024)
+#define NO_SLOT SIZE_MAX
+
+// A slot of the job table. The index of a job's slot is its job number (less
+// one) for as long as it is registered
+typedef struct job_slot {
+    job *j; // NULL if the slot is free
+    size_t next_free; // Next slot on the free list, if this one is on it
+} job_slot;
 
 bool interactive;
-static job **job_table;
+static job_slot *job_table;
+// Slots below this have been used: they either hold a job or are on the free
+// list. Everything from here on is untouched
+static size_t table_used;
+// Most recently freed slot below table_used, NO_SLOT if there is none
+static size_t free_slot = NO_SLOT;
+// Registered jobs, densely packed and in no particular order
+static job **live_jobs;
+// Pids of procs that haven't completed yet
+static pid_table *running_procs;
 static pid_t shell_pgid;
 static struct termios shell_tmodes;
+// Background jobs waiting for a slot, oldest first
+static job *queue_head, *queue_tail;
+static size_t n_queued;
+// Number of background jobs holding a slot
+static size_t slots_used;
 
 static void cleanup_jobs(void);
 
-// Put shell in forground if interactive
-// Returns true on success, false on failure
-bool initialize_job_control(void)
+// Put shell in forground if interactive, which it is when try_interactive is
+// set and stdin is a terminal. Returns true on success, false on failure
+bool initialize_job_control(bool try_interactive)
 {
-    job_table = vec_alloc(JOB_TABLE_INIT_SIZE * sizeof *job_table);
-    interactive = isatty(SHELL_TERM);
+    void *table = mmap(NULL, JOB_TABLE_SLOTS * sizeof *job_table,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    Stopif(table == MAP_FAILED, return false,
+           "Could not allocate job table: %s", strerror(errno));
+    job_table = table;
+    live_jobs = vec_alloc(JOB_TABLE_INIT_SIZE * sizeof *live_jobs);
+    running_procs = new_pid_table(PID_TABLE_INIT_SIZE);
+    interactive = try_interactive && isatty(SHELL_TERM);
     if (interactive) {
         // Loop until in foreground
         while ((shell_pgid = getpgrp()) != tcgetpgrp(SHELL_TERM)) {
@@ -73,22 +120,41 @@ bool initialize_job_control(void)
 // Free job table and kill all background jobs
 static void cleanup_jobs(void)
 {
-    job **end = job_table + vec_len(job_table);
-    for (job **j_p = job_table; j_p != end; j_p++) {
-        job *j = *j_p;
-        if (!j) {
-            continue;
-        }
-
+    while (vec_len(live_jobs)) {
+        job *j = live_jobs[vec_len(live_jobs) - 1];
         if (j->bkg) {
-            kill(j->pgid, SIGHUP);
+            // Without job control background jobs share the shell's process
+            // group and are left running. Queued jobs have no processes
+            if (interactive && j->pgid) {
+                kill(j->pgid, SIGHUP);
+            }
         } else {
+            // Returns at once for a job with nothing started, like the
+            // builtin that is exiting
             wait_for_job(j);
         }
 
-        free_single_job(j);
+        unregister_job(j);
     }
-    vec_free(job_table);
+    munmap(job_table, JOB_TABLE_SLOTS * sizeof *job_table);
+    job_table = NULL;
+    vec_free(live_jobs);
+    free_pid_table(running_procs);
+}
+
+// Drop job control in a child forked by the shell to run a builtin. None of the
+// shell's jobs are the child's to wait for, signal or start, so the tables are
+// emptied without freeing the jobs, which the shell still owns
+void leave_job_control(void)
+{
+    interactive = false;
+    table_used = 0;
+    free_slot = NO_SLOT;
+    vec_setlen(0, live_jobs);
+    free_pid_table(running_procs);
+    running_procs = new_pid_table(PID_TABLE_INIT_SIZE);
+    queue_head = queue_tail = NULL;
+    n_queued = slots_used = 0;
 }
 
 // Put job in foreground, continuing if cont is true
@@ -103,13 +169,16 @@ void send_to_foreground(job *j, bool cont)
                "Error continuing process: %s", strerror(errno));
     }
     wait_for_job(j);
-    // Put shell in foreground
-    tcsetpgrp(SHELL_TERM, shell_pgid);
+    reclaim_terminal(j);
+}
 
-    // Restore terminal modes
+// Put the shell back in the foreground after j had the terminal, saving j's
+// terminal modes and restoring the shell's
+void reclaim_terminal(job *j)
+{
+    tcsetpgrp(SHELL_TERM, shell_pgid);
     tcgetattr(SHELL_TERM, &j->tmodes);
     tcsetattr(SHELL_TERM, TCSADRAIN, &shell_tmodes);
-
 }
 
 // Put job in background, send SIGCONT if cont is true
@@ -121,35 +190,71 @@ void send_to_background(job *j, bool cont)
     }
 }
 
+// Record that p has finished with the given exit code
+void mark_proc_completed(job *j, proc *p, int exit_code)
+{
+    if (p->completed) {
+        return;
+    }
+    p->exit_code = exit_code;
+    p->completed = true;
+    clock_gettime(CLOCK_MONOTONIC, &p->end);
+    if (++j->n_completed == vec_len(j->procs)) {
+        j->end = p->end;
+    }
+    if (p->stopped) {
+        p->stopped = false;
+        j->n_stopped--;
+    }
+    // Its pid may be reused from now on
+    if (p->pid) {
+        pid_remove(p->pid, running_procs);
+    }
+}
+
+// Remember p as part of j, so its status changes can be found by pid. p->pid
+// has to be set
+void register_proc(job *j, proc *p)
+{
+    pid_add(p->pid, p, j, running_procs);
+}
+
 // Find proc that corresponds with pid and mark it as stopped or completed as
-// apropriate.  Return true on success, false on failure
+// apropriate, keeping the resources it used if it completed.  Return true on
+// success, false on failure
 // TODO: Extend to returning information about other kinds of signals
-bool mark_proc_status(pid_t pid, int status)
+bool mark_proc_status(pid_t pid, int status, struct rusage const *usage)
 {
     if (pid > 0) {
-        job **job_end = job_table + vec_len(job_table);
-        for (job **j_p = job_table; j_p != job_end; j_p++) {
-            job *j = *j_p;
-            if (!j) {
-                continue;
+        pid_entry *e = pid_find(pid, running_procs);
+        if (!e) {
+            // The launcher is the shell's child without being part of a job
+            if (launcher_exited(pid)) {
+                return true;
+            }
+            Err_msg("No child process %d", pid);
+            return false;
+        }
+        proc *p = e->proc;
+        job *j = e->job;
+        if (WIFSTOPPED(status)) {
+            if (!p->stopped) {
+                p->stopped = true;
+                j->n_stopped++;
             }
-            proc **proc_end = vec_len(j->procs) + j->procs;
-            for (proc **p_p = j->procs; p_p != proc_end; p_p++) {
-                proc *p = *p_p;
-                if (p->pid == pid) {
-                    if (WIFSTOPPED(status) || WIFCONTINUED(status)) {
-                        p->stopped = !p->stopped;
-                        j->notified = false;
-                    } else {
-                        p->exit_code = (WIFSIGNALED(status)) ? M_SIGINT : WEXITSTATUS(status);
-                        p->completed = true;
-                    }
-                    return true;
-                }
+            j->notified = false;
+        } else if (WIFCONTINUED(status)) {
+            if (p->stopped) {
+                p->stopped = false;
+                j->n_stopped--;
             }
+            j->notified = false;
+        } else {
+            p->usage = *usage;
+            mark_proc_completed(j, p, WIFSIGNALED(status) ? M_SIGINT
+                                                          : WEXITSTATUS(status));
         }
-        Err_msg("No child process %d", pid);
-        return false;
+        return true;
     } else if (pid == 0 || errno == ECHILD) {
         // No processes available to report
         return false;
@@ -164,9 +269,28 @@ void check_job_status(void)
 {
     int status = 0;
     pid_t pid = 0;
+    struct rusage usage;
     do {
-        pid = waitpid(WAIT_ANY, &status, WUNTRACED | WNOHANG | WCONTINUED);
-    } while (mark_proc_status(pid, status));
+        pid = wait4(WAIT_ANY, &status, WUNTRACED | WNOHANG | WCONTINUED, &usage);
+    } while (mark_proc_status(pid, status, &usage));
+}
+
+// What wait_for_job waits on next: j's process group, or without job control
+// the first of its procs that is still running. Returns 0 if none of its procs
+// has been started (a builtin that is running, a queued job)
+static pid_t wait_target(job const *j)
+{
+    if (j->pgid) {
+        return -j->pgid;
+    }
+    proc **proc_end = j->procs + vec_len(j->procs);
+    for (proc **p_p = j->procs; p_p != proc_end; p_p++) {
+        proc const *p = *p_p;
+        if (p->pid && !p->completed && !p->stopped) {
+            return p->pid;
+        }
+    }
+    return 0;
 }
 
 // Check for processes with statuses to report (blocking)
@@ -174,53 +298,195 @@ void wait_for_job(job *j)
 {
     int status;
     pid_t pid;
-    do {
-        pid = waitpid(-j->pgid, &status, WUNTRACED | WCONTINUED);
-    } while (mark_proc_status(pid, status)
-             && !is_stopped(j)
-             && !is_completed(j));
+    struct rusage usage;
+    // Jobs made up only of builtins are already completed
+    while (!is_stopped(j) && !is_completed(j)) {
+        // Never WAIT_ANY, which would block on whatever other child changes
+        // state next, or forever
+        pid_t target = wait_target(j);
+        if (!target) {
+            break;
+        }
+        pid = wait4(target, &status, WUNTRACED | WCONTINUED, &usage);
+        if (!mark_proc_status(pid, status, &usage)) {
+            break;
+        }
+    }
+}
+
+static inline double timespec_secs(struct timespec const *start,
+                                   struct timespec const *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
 
+static inline double timeval_secs(struct timeval const *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// Resources used by all of j's procs together
+static struct rusage job_usage(job const *j)
+{
+    struct rusage total = {0};
+    proc **proc_end = j->procs + vec_len(j->procs);
+    for (proc **p_p = j->procs; p_p != proc_end; p_p++) {
+        struct rusage const *u = &(*p_p)->usage;
+        timeradd(&total.ru_utime, &u->ru_utime, &total.ru_utime);
+        timeradd(&total.ru_stime, &u->ru_stime, &total.ru_stime);
+        if (u->ru_maxrss > total.ru_maxrss) {
+            total.ru_maxrss = u->ru_maxrss;
+        }
+        total.ru_nvcsw += u->ru_nvcsw;
+        total.ru_nivcsw += u->ru_nivcsw;
+    }
+    return total;
 }
 
-void format_job_info(job *j, char const *msg)
+// Print usage according to fmt, a TIMEFORMAT string. Recognises %R (wall
+// time), %U (user time), %S (system time), %M (max RSS in kB), %w and %c
+// (voluntary and involuntary context switches) and %%. Nothing else is
+// special
+static void print_timeformat(char const *fmt, double real,
+                             struct rusage const *u)
 {
-    fprintf(stderr, "[%zu] %d (%s): %s\n", j->index+1, j->pgid,  msg, j->name);
+    for (; *fmt; fmt++) {
+        if (*fmt != '%' || !fmt[1]) {
+            notify_printf("%c", *fmt);
+            continue;
+        }
+        switch (*++fmt) {
+        case 'R': notify_printf("%.3f", real); break;
+        case 'U': notify_printf("%.3f", timeval_secs(&u->ru_utime)); break;
+        case 'S': notify_printf("%.3f", timeval_secs(&u->ru_stime)); break;
+        case 'M': notify_printf("%ld", u->ru_maxrss); break;
+        case 'w': notify_printf("%ld", u->ru_nvcsw); break;
+        case 'c': notify_printf("%ld", u->ru_nivcsw); break;
+        case '%': notify_printf("%%"); break;
+        default: notify_printf("%%%c", *fmt); break;
+        }
+    }
+}
+
+// Write the log mode line for j: the time, job number, pgid, state, exit
+// status, wall time and command, separated by tabs. Status and wall time are
+// - until the job has completed
+static void log_job_info(job *j, note_kind kind)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    notify_printf("%lld.%03ld\t%zu\t%d\t%s\t", (long long) now.tv_sec,
+                  now.tv_nsec / 1000000, j->index + 1, j->pgid,
+                  note_names[kind]);
+    if (kind == NOTE_COMPLETED) {
+        notify_printf("%d\t%.3f\t",
+                      j->procs[vec_len(j->procs) - 1]->exit_code,
+                      timespec_secs(&j->start, &j->end));
+    } else {
+        notify_printf("-\t-\t");
+    }
+    // Keep it one line of fields whatever the command has in it
+    for (char const *c = j->name; *c; c++) {
+        notify_printf("%c", *c == '\t' || *c == '\n' ? ' ' : *c);
+    }
+    notify_printf("\n");
+}
+
+// Report a change in j's state, in the way OPT_NOTIFY asks for. Nothing is
+// written until flush_notifications
+void format_job_info(job *j, note_kind kind)
+{
+    switch (get_notify_mode()) {
+    case NOTIFY_SUMMARY:
+        count_note(kind);
+        if (kind == NOTE_COMPLETED
+            && j->procs[vec_len(j->procs) - 1]->exit_code != 0) {
+            count_note(NOTE_FAILED);
+        }
+        return;
+    case NOTIFY_LOG:
+        log_job_info(j, kind);
+        return;
+    case NOTIFY_LINES:
+        break;
+    }
+    notify_printf("[%zu] %d (%s): %s", j->index + 1, j->pgid,
+                  note_names[kind], j->name);
+    // Completed jobs are followed by what they used if TIMEFORMAT is set
+    char const *fmt = getenv("TIMEFORMAT");
+    if (fmt && is_completed(j)) {
+        struct rusage usage = job_usage(j);
+        notify_printf(" ");
+        print_timeformat(fmt, timespec_secs(&j->start, &j->end), &usage);
+    }
+    notify_printf("\n");
+}
+
+static void print_usage_row(char const *name, double real,
+                            struct rusage const *u)
+{
+    notify_printf("%9.3fs %9.3fs %9.3fs %8ldkB %7ld %7ld  %s\n", real,
+                  timeval_secs(&u->ru_utime), timeval_secs(&u->ru_stime),
+                  u->ru_maxrss, u->ru_nvcsw, u->ru_nivcsw, name);
+}
+
+// Report what each stage of a completed job used, followed by the totals for
+// the whole job. This is the output of `time`, which is collected with the
+// job notifications
+void print_job_times(job *j)
+{
+    notify_printf("%10s %10s %10s %10s %7s %7s\n",
+                  "real", "user", "sys", "maxrss", "vcsw", "ivcsw");
+    size_t n_procs = vec_len(j->procs);
+    for (size_t i = 0; i < n_procs; i++) {
+        proc *p = j->procs[i];
+        print_usage_row(*p->argv, timespec_secs(&p->start, &p->end),
+                        &p->usage);
+    }
+    if (n_procs > 1) {
+        struct rusage usage = job_usage(j);
+        print_usage_row("total", timespec_secs(&j->start, &j->end), &usage);
+    }
 }
 
 // Notify user of changes in job status, free job if completed
 // Return exit code of the completed job that was launched most recently
 int report_job_status(void)
 {
+    stat_span span = stat_begin();
     check_job_status();
     int ret = 0;
-    job **job_end = job_table + vec_len(job_table);
-    for (job **j_p = job_table; j_p != job_end; j_p++) {
-        job *j = *j_p;
-        if (!j) {
-            continue;
-        }
+    size_t ret_index = 0;
+    bool found = false;
+    for (size_t i = 0; i < vec_len(live_jobs);) {
+        job *j = live_jobs[i];
         // If all procs have completed, job is completed
         if (is_completed(j)) {
-            // Only notify about background jobs
-            if (j->bkg) {
-                format_job_info(j, "completed");
+            // Only notify about background jobs, and only at a terminal
+            if (j->bkg && interactive && !j->quiet) {
+                format_job_info(j, NOTE_COMPLETED);
+            }
+            if (j->timed) {
+                print_job_times(j);
             }
             // Get exit code from last process in
-            ret = j->procs[vec_len(j->procs) - 1]->exit_code;
-
-            // We are removing last job, calculate new last job index
-            if (j_p + 1 >= job_end) {
-                job **j_crawl = j_p - 1;
-                for (; j_crawl >= job_table && !*j_crawl; j_crawl--);
-                vec_setlen(j_crawl - job_table + 1, job_table);
+            if (!found || j->index >= ret_index) {
+                ret = j->procs[vec_len(j->procs) - 1]->exit_code;
+                ret_index = j->index;
+                found = true;
             }
-            free_single_job(j);
-            *j_p = NULL;
+            // Moves another job into slot i
+            unregister_job(j);
+            continue;
         } else if (is_stopped(j) && !j->notified) {
-            format_job_info(j, "stopped");
+            format_job_info(j, NOTE_STOPPED);
             j->notified = true;
         }
+        i++;
     }
+    // Completed jobs may have freed slots
+    start_queued_jobs();
+    stat_end(STAT_REAP, span);
     return ret;
 
 }
@@ -232,6 +498,7 @@ static void mark_running(job *j)
     for (proc **p_p = j->procs; p_p != proc_end; p_p++) {
         (*p_p)->stopped = false;
     }
+    j->n_stopped = 0;
 
     j->notified = false;
 }
@@ -249,60 +516,219 @@ void continue_job(job *j)
 // Return true if all processes in job have stopped or completed
 bool is_stopped(job *j)
 {
-    proc **proc_end = j->procs + vec_len(j->procs);
-    for (proc **p_p = j->procs; p_p != proc_end; p_p++) {
-        proc *p = *p_p;
-        if (!p->completed && !p->stopped) {
-            return false;
-        }
-    }
-    return true;
+    return j->n_completed + j->n_stopped == vec_len(j->procs);
 }
 
 // Check if all processes in job are completed
 bool is_completed(job *j)
 {
-    proc **proc_end = j->procs + vec_len(j->procs);
-    for (proc **p_p = j->procs; p_p != proc_end; p_p++) {
-        if (!(*p_p)->completed) {
-            return false;
-        }
-    }
-    return true;
+    return j->n_completed == vec_len(j->procs);
 }
 
-// Add job to global job list, return false if job table needs to expand, but
-// expansion failed or if job table has not been initialized
+// Number of jobs that have been launched but not yet reported as completed
+size_t live_job_count(void)
+{
+    return vec_len(live_jobs);
+}
+
+// Add job to global job list, giving it the most recently freed slot or a new
+// one. Returns false if the table is full or has not been initialized
 bool register_job(job *j)
 {
     if (!job_table) {
         return false;
     }
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wincompatible-pointer-types"
-    size_t job_cap = vec_capacity(job_table) / sizeof *job_table;
-    // Grow job table if necessary
-    if (vec_len(job_table) + 1 >= job_cap
-            && vec_grow(&job_table) != 0) {
+    size_t i = free_slot;
+    if (i != NO_SLOT) {
+        free_slot = job_table[i].next_free;
+    } else if (table_used < JOB_TABLE_SLOTS) {
+        i = table_used++;
+    } else {
         return false;
     }
-#pragma GCC diagnostic pop
-
-    // Find empty slot in table to place job
-    job **job_end = job_table + job_cap;
-    for (job **j_p = job_table; j_p != job_end; j_p++) {
-        if (!*j_p) {
-            *j_p = j;
-            size_t i = j_p - job_table;
-            j->index = i;
-            if (i >= vec_len(job_table)) {
-                vec_setlen(vec_len(job_table) + 1, job_table);
+    job_table[i].j = j;
+    j->index = i;
+    j->live_index = vec_len(live_jobs);
+    Vec_push(&live_jobs, j);
+    return true;
+}
+
+// Remove job from the job table and free it
+void unregister_job(job *j)
+{
+    // Fill the hole in live_jobs with the last job
+    size_t last = vec_len(live_jobs) - 1;
+    live_jobs[j->live_index] = live_jobs[last];
+    live_jobs[j->live_index]->live_index = j->live_index;
+    vec_setlen(last, live_jobs);
+
+    job_table[j->index].j = NULL;
+    if (!last) {
+        // Job numbers start over from 1 once there are no jobs left
+        table_used = 0;
+        free_slot = NO_SLOT;
+    } else {
+        job_table[j->index].next_free = free_slot;
+        free_slot = j->index;
+    }
+
+    proc **proc_end = j->procs + vec_len(j->procs);
+    for (proc **p_p = j->procs; p_p != proc_end; p_p++) {
+        if (!(*p_p)->completed && (*p_p)->pid) {
+            pid_remove((*p_p)->pid, running_procs);
+        }
+    }
+    if (j->slotted) {
+        slots_used--;
+    }
+    if (j->queued) {
+        // Only happens on exit, so the walk doesn't matter
+        job **q = &queue_head;
+        for (; *q != j; q = &(*q)->next_queued);
+        *q = j->next_queued;
+        if (queue_tail == j) {
+            queue_tail = NULL;
+            for (job *crawl = queue_head; crawl; crawl = crawl->next_queued) {
+                queue_tail = crawl;
             }
-            return true;
         }
+        n_queued--;
+    }
+    if (j->coproc) {
+        forget_coproc(j);
+    }
+    release_job_resources(j);
+    free_single_job(j);
+}
+
+static inline bool slot_available(void)
+{
+    return !Num_opt(OPT_MAXJOBS) || slots_used < (size_t) Num_opt(OPT_MAXJOBS);
+}
+
+// Called before launching background job j. Returns true if j got a slot and
+// can be launched now, otherwise it is queued until one frees up
+bool schedule_job(job *j)
+{
+    if (j->slotted) {
+        return true;
+    }
+    if (!n_queued && slot_available()) {
+        slots_used++;
+        j->slotted = true;
+        return true;
+    }
+    j->queued = true;
+    j->next_queued = NULL;
+    *(queue_tail ? &queue_tail->next_queued : &queue_head) = j;
+    queue_tail = j;
+    n_queued++;
+    if (interactive) {
+        format_job_info(j, NOTE_QUEUED);
+    }
+    return false;
+}
 
+// Launch queued jobs, oldest first, for as long as there are free slots
+void start_queued_jobs(void)
+{
+    while (queue_head && slot_available()) {
+        job *j = queue_head;
+        queue_head = j->next_queued;
+        if (!queue_head) {
+            queue_tail = NULL;
+        }
+        n_queued--;
+        j->queued = false;
+        j->slotted = true;
+        slots_used++;
+        launch_job(j);
     }
+}
 
+size_t queued_job_count(void)
+{
+    return n_queued;
+}
+
+// True if there is anything for `wait` to wait for: a queued job or a
+// background job that is still running
+static bool background_pending(void)
+{
+    if (n_queued) {
+        return true;
+    }
+    for (size_t i = 0; i < vec_len(live_jobs); i++) {
+        job *j = live_jobs[i];
+        // Coprocesses run until their input is closed
+        if (j->bkg && !j->quiet && !j->coproc && !is_completed(j)
+            && !is_stopped(j)) {
+            return true;
+        }
+    }
     return false;
+}
 
+// Block until some child changes state. Interactively SIGCHLD and SIGINT are
+// taken with sig_wait, whether they come through a signalfd or a handler (see
+// watch_signals), so ^C can interrupt. Returns false if it did
+bool wait_for_child(void)
+{
+    if (interactive) {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGCHLD);
+        sigaddset(&set, SIGINT);
+        int sig = sig_wait(set);
+        return sig != -1 && sig != SIGINT;
+    }
+    int status;
+    struct rusage usage;
+    pid_t pid = wait4(WAIT_ANY, &status, WUNTRACED | WCONTINUED, &usage);
+    mark_proc_status(pid, status, &usage);
+    return true;
+}
+
+// Wait until the queue has drained and every background job has completed
+// (or stopped), reporting them as usual. If queue_only is set it is enough
+// for every queued job to have been launched. Returns false if interrupted
+bool wait_for_background(bool queue_only)
+{
+    while (queue_only ? n_queued : background_pending()) {
+        if (!wait_for_child()) {
+            return false;
+        }
+        exit_code = report_job_status();
+        flush_notifications();
+    }
+    return true;
+}
+
+// Write a line for every background or stopped job to fd, in order of job
+// number
+void list_jobs(int fd)
+{
+    for (size_t i = 0; i < table_used; i++) {
+        job *j = job_table[i].j;
+        if (!j || j->quiet || !(j->bkg || is_stopped(j))) {
+            continue;
+        }
+        // Without job control there is no process group to show
+        pid_t pid = j->pgid ? j->pgid : j->procs[0]->pid;
+        char const *state = j->queued ? "queued"
+                          : is_completed(j) ? "done"
+                          : is_stopped(j) ? "stopped"
+                          : "running";
+        dprintf(fd, "[%zu] %d (%s): %s", j->index + 1, pid, state, j->name);
+        double cpu;
+        long long mem;
+        if (cgroup_usage(j, &cpu, &mem)) {
+            dprintf(fd, "  [cpu %.2fs", cpu);
+            if (mem >= 0) {
+                dprintf(fd, ", mem %.1fM", mem / (1024.0 * 1024));
+            }
+            dprintf(fd, "]");
+        }
+        dprintf(fd, "\n");
+    }
 }
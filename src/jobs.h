@@ -20,24 +20,39 @@
 #define M_JOB_CTRL
 
 #include <stdbool.h>
+#include <sys/resource.h> // rusage
 #include "ds/proc.h" // job
+#include "notify.h" // note_kind
 
 #define SHELL_TERM STDIN_FILENO
 
 extern bool interactive;
 
 
-bool initialize_job_control(void);
+bool initialize_job_control(bool try_interactive);
+void leave_job_control(void);
 void send_to_foreground(job *j, bool cont);
 void send_to_background(job *j, bool cont);
-bool mark_proc_status(pid_t pid, int status);
+void reclaim_terminal(job *j);
+void mark_proc_completed(job *j, proc *p, int exit_code);
+void register_proc(job *j, proc *p);
+bool mark_proc_status(pid_t pid, int status, struct rusage const *usage);
 void check_job_status(void);
 void wait_for_job(job *j);
-void format_job_info(job *j, char const *msg);
+void format_job_info(job *j, note_kind kind);
+void print_job_times(job *j);
 int report_job_status(void);
 void continue_job(job *j);
 job *find_job(pid_t pgid, job const *crawler);
 bool is_stopped(job *j);
 bool is_completed(job *j);
 bool register_job(job *j);
+void unregister_job(job *j);
+size_t live_job_count(void);
+bool schedule_job(job *j);
+void start_queued_jobs(void);
+size_t queued_job_count(void);
+bool wait_for_child(void);
+bool wait_for_background(bool queue_only);
+void list_jobs(int fd);
 #endif
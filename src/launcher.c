@@ -0,0 +1,410 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// An optional helper that starts external commands on the shell's behalf. It
+// is forked while the shell is still small, so creating a child from it stays
+// cheap however much memory the shell goes on to map. Where the shell has to
+// fork (foreground jobs without posix_spawn_file_actions_addtcsetpgrp_np), the
+// cost of copying its page tables grows with history, caches and job arenas;
+// the launcher takes the terminal for the child itself, so every command can
+// be started the way posix_spawn does it, from a process that stays small.
+//
+// Requests travel over a SOCK_SEQPACKET socket, one message each: a
+// launch_hdr followed by the path, the working directory, argv and envp as NUL
+// terminated strings, with the proc's three fds attached as SCM_RIGHTS. The
+// launcher creates the child with CLONE_PARENT, which makes it a child of the
+// shell rather than of the launcher, so job control, wait4 and rusage work
+// exactly as they do for processes the shell started itself. The reply is the
+// child's pid once it has exec'd, or the errno it failed with.
+//
+// Anything the launcher can't take (an oversized request, a launcher that has
+// gone away) is reported to the caller, which starts the proc itself instead.
+
+#define _GNU_SOURCE // MSG_CMSG_CLOEXEC, clone
+
+#include <errno.h> // errno
+#include <sched.h> // clone, CLONE_*
+#include <signal.h> // SIGCHLD, sigemptyset, sigfillset
+#include <stdlib.h> // malloc, free, atexit
+#include <string.h> // strerror, strlen, memcpy, stpcpy
+
+#include <sys/socket.h> // socketpair, sendmsg, recvmsg, CMSG_*
+#include <sys/wait.h> // waitpid
+#include <unistd.h> // fork, close, chdir, dup2, execve, getcwd
+#include <linux/limits.h> // PATH_MAX
+
+#include "signals.h" // reset_ignored_signals, sig_setmask
+#include "fdio.h" // shell_fd
+#include "jobs.h" // interactive, SHELL_TERM
+#include "launcher.h" // prototypes
+#include "options.h" // Num_opt, OPT_LAUNCHER
+#include "macros.h" // Stopif, Err_msg, Arr_len
+
+// Largest request sent to the launcher. argv and envp that don't fit are
+// started by the shell itself
+#define LAUNCH_MSG_MAX (64 * 1024)
+// Stack the child runs on until it execs
+#define LAUNCH_STACK_SIZE (64 * 1024)
+
+enum {
+    LAUNCH_PGROUP = 1 << 0, // Join the process group in pgid (0: a new one)
+    LAUNCH_FOREGROUND = 1 << 1, // Take the terminal for that process group
+};
+
+typedef struct launch_hdr {
+    pid_t pgid;
+    int flags; // LAUNCH_*
+    unsigned argc; // Strings in argv, not counting the NULL
+    unsigned envc; // Strings in envp, not counting the NULL
+} launch_hdr;
+
+typedef struct launch_reply {
+    pid_t pid; // The child, or -1 if it couldn't be created
+    int err; // errno the child failed with, 0 if it exec'd
+} launch_reply;
+
+// The shell's end of the socket, -1 when there is no launcher
+static int launcher_sock = -1;
+static pid_t launcher_pid;
+
+static _Noreturn void serve_launches(int sock);
+
+// Fork the launcher if it isn't running yet. Returns false on failure
+bool start_launcher(void)
+{
+    static bool registered;
+    if (launcher_sock >= 0) {
+        return true;
+    }
+    int sv[2];
+    Stopif(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0,
+           return false, "Could not start launcher: %s", strerror(errno));
+    pid_t pid = fork();
+    Stopif(pid < 0, close(sv[0]); close(sv[1]); return false,
+           "Could not start launcher: %s", strerror(errno));
+    if (pid == 0) {
+        close(sv[0]);
+        serve_launches(sv[1]);
+    }
+    close(sv[1]);
+    launcher_sock = shell_fd(sv[0]);
+    launcher_pid = pid;
+    if (!registered) {
+        registered = !atexit(stop_launcher);
+    }
+    return true;
+}
+
+// Shut the launcher down and reap it
+void stop_launcher(void)
+{
+    if (launcher_sock < 0) {
+        return;
+    }
+    // It exits as soon as it sees its end of the socket close
+    close(launcher_sock);
+    launcher_sock = -1;
+    waitpid(launcher_pid, NULL, 0);
+    launcher_pid = 0;
+}
+
+// Drop the launcher without touching it, for use in a child of the shell:
+// whatever the child starts has to be its own child, and the shell's requests
+// and replies must not be interleaved with the child's
+void forget_launcher(void)
+{
+    if (launcher_sock >= 0) {
+        close(launcher_sock);
+        launcher_sock = -1;
+        launcher_pid = 0;
+    }
+}
+
+// Start or stop the launcher to match the launcher option
+void update_launcher(void)
+{
+    if (!Num_opt(OPT_LAUNCHER)) {
+        stop_launcher();
+    } else if (!start_launcher()) {
+        Num_opt(OPT_LAUNCHER) = 0;
+    }
+}
+
+// Returns true if pid, reaped by the shell, was the launcher. The shell starts
+// procs itself from then on
+bool launcher_exited(pid_t pid)
+{
+    if (!launcher_pid || pid != launcher_pid) {
+        return false;
+    }
+    close(launcher_sock);
+    launcher_sock = -1;
+    launcher_pid = 0;
+    Num_opt(OPT_LAUNCHER) = 0;
+    Err_msg("launcher exited, commands are started by the shell again");
+    return true;
+}
+
+bool launcher_running(void)
+{
+    return launcher_sock >= 0;
+}
+
+// The launcher broke off mid-request. It is reaped like any other child
+static void lost_launcher(void)
+{
+    Err_msg("Lost launcher: %s", errno ? strerror(errno) : "connection closed");
+    forget_launcher();
+}
+
+// Start p as part of j through the launcher, the same way spawn_proc would.
+// Returns false if the launcher can't take p, in which case the caller has to
+// start it by other means. Otherwise *pid is the child's pid, or -1 with errno
+// set if it could not be started
+bool launcher_spawn(job const *j, proc const *p, char const *path,
+                    char **envp, pid_t *pid)
+{
+    if (launcher_sock < 0) {
+        return false;
+    }
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof cwd)) {
+        return false;
+    }
+
+    launch_hdr h = {.pgid = j->pgid};
+    if (interactive) {
+        h.flags = LAUNCH_PGROUP | (j->bkg ? 0 : LAUNCH_FOREGROUND);
+    }
+    size_t len = sizeof h + strlen(path) + 1 + strlen(cwd) + 1;
+    for (char **s = p->argv; *s; s++, h.argc++) {
+        len += strlen(*s) + 1;
+    }
+    for (char **s = envp; *s; s++, h.envc++) {
+        len += strlen(*s) + 1;
+    }
+    if (len > LAUNCH_MSG_MAX) {
+        return false;
+    }
+
+    char *buf = arena_alloc(j->arena, len);
+    memcpy(buf, &h, sizeof h);
+    char *end = stpcpy(buf + sizeof h, path) + 1;
+    end = stpcpy(end, cwd) + 1;
+    for (char **s = p->argv; *s; s++) {
+        end = stpcpy(end, *s) + 1;
+    }
+    for (char **s = envp; *s; s++) {
+        end = stpcpy(end, *s) + 1;
+    }
+
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof p->fds)];
+    } ctl;
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = ctl.buf, .msg_controllen = sizeof ctl.buf,
+    };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof p->fds);
+    memcpy(CMSG_DATA(c), p->fds, sizeof p->fds);
+
+    ssize_t n;
+    while ((n = sendmsg(launcher_sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    if (n < 0) {
+        lost_launcher();
+        return false;
+    }
+    launch_reply r;
+    while ((n = recv(launcher_sock, &r, sizeof r, 0)) < 0 && errno == EINTR);
+    if (n != sizeof r) {
+        if (n >= 0) {
+            errno = 0;
+        }
+        lost_launcher();
+        // It went away before saying whether the child was created; report
+        // the launch as failed rather than starting p twice
+        errno = ECHILD;
+        *pid = -1;
+        return true;
+    }
+    if (r.err) {
+        // The failed child is the shell's to reap, but belongs to no job
+        if (r.pid > 0) {
+            waitpid(r.pid, NULL, 0);
+        }
+        errno = r.err;
+        *pid = -1;
+    } else {
+        *pid = r.pid;
+    }
+    return true;
+}
+
+// What the launcher hands the child it clones. The child shares the
+// launcher's memory until it execs, so err is how a failure gets back
+typedef struct launch_args {
+    launch_hdr const *h;
+    char const *path;
+    char const *cwd;
+    char **argv;
+    char **envp;
+    int const *fds;
+    int err;
+} launch_args;
+
+// Set the child up the way the fork path in launch_proc does, then exec. Runs
+// on its own stack in the launcher's address space
+static int exec_launched(void *arg)
+{
+    launch_args *a = arg;
+    if (a->h->flags & LAUNCH_PGROUP) {
+        setpgid(0, a->h->pgid);
+        // Has to come before stdin is replaced below
+        if (a->h->flags & LAUNCH_FOREGROUND) {
+            tcsetpgrp(SHELL_TERM, getpgrp());
+        }
+    }
+    reset_ignored_signals();
+    sigset_t none;
+    sigemptyset(&none);
+    sig_setmask(none);
+
+    if (chdir(a->cwd) == 0) {
+        for (int i = 0; i < 3; i++) {
+            if (a->fds[i] != i) {
+                dup2(a->fds[i], i);
+            }
+        }
+        execve(a->path, a->argv, a->envp);
+    }
+    a->err = errno;
+    _exit(M_FAILED_EXEC);
+}
+
+// Carry out one request of len bytes in buf, with the proc's fds already
+// received
+static launch_reply launch(char *buf, size_t len, int const *fds)
+{
+    launch_reply r = {.pid = -1, .err = EINVAL};
+    launch_hdr h;
+    if (len < sizeof h || buf[len - 1] != '\0') {
+        return r;
+    }
+    memcpy(&h, buf, sizeof h);
+
+    // Pointers for argv and envp, each followed by a NULL
+    char **strv = malloc((h.argc + h.envc + 2) * sizeof *strv);
+    if (!strv) {
+        r.err = ENOMEM;
+        return r;
+    }
+    char *s = buf + sizeof h, *end = buf + len;
+    char *path = s;
+    s += strlen(s) + 1;
+    char *cwd = s < end ? s : NULL;
+    s += cwd ? strlen(s) + 1 : 0;
+    size_t i = 0;
+    for (; s < end && i < h.argc; i++, s += strlen(s) + 1) {
+        strv[i] = s;
+    }
+    strv[i++] = NULL;
+    char **envp = strv + i;
+    for (; s < end && i < h.argc + h.envc + 1; i++, s += strlen(s) + 1) {
+        strv[i] = s;
+    }
+    strv[i++] = NULL;
+    if (!cwd || i != h.argc + h.envc + 2 || !h.argc) {
+        free(strv);
+        return r;
+    }
+
+    // The same clone posix_spawn does, except that the child's parent is the
+    // shell. Until it execs or exits the launcher is suspended, so one stack
+    // is enough. Signals stay blocked so no handler runs on it meanwhile
+    static char stack[LAUNCH_STACK_SIZE] __attribute__((aligned(16)));
+    launch_args a = {&h, path, cwd, strv, envp, fds, 0};
+    sigset_t all;
+    sigfillset(&all);
+    sigset_t old = sig_setmask(all);
+    r.pid = clone(exec_launched, stack + sizeof stack,
+                  CLONE_VM | CLONE_VFORK | CLONE_PARENT | SIGCHLD, &a);
+    r.err = r.pid < 0 ? errno : a.err;
+    sig_setmask(old);
+    free(strv);
+    return r;
+}
+
+// Body of the launcher: serve requests on sock until the shell closes it
+static _Noreturn void serve_launches(int sock)
+{
+    // Keep ^C and friends meant for the shell's process group away
+    if (interactive) {
+        setpgid(0, 0);
+    }
+    static char buf[LAUNCH_MSG_MAX];
+    int fds[3];
+    for (;;) {
+        struct iovec iov = {.iov_base = buf, .iov_len = sizeof buf};
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(sizeof fds)];
+        } ctl;
+        struct msghdr msg = {
+            .msg_iov = &iov, .msg_iovlen = 1,
+            .msg_control = ctl.buf, .msg_controllen = sizeof ctl.buf,
+        };
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            _Exit(0);
+        }
+
+        // Padding in the control buffer can let one fd more through than
+        // asked for. Any beyond the expected three are closed right away
+        size_t n_fds = 0;
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            size_t got = (c->cmsg_len - CMSG_LEN(0)) / sizeof *fds;
+            for (size_t i = 0; i < got; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(c) + i * sizeof fd, sizeof fd);
+                if (n_fds < Arr_len(fds)) {
+                    fds[n_fds++] = fd;
+                } else {
+                    close(fd);
+                    n_fds++;
+                }
+            }
+        }
+        launch_reply r = {.pid = -1, .err = EINVAL};
+        if (n_fds == Arr_len(fds)
+            && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+            r = launch(buf, n, fds);
+        }
+        for (size_t i = 0; i < n_fds && i < Arr_len(fds); i++) {
+            close(fds[i]);
+        }
+        while (send(sock, &r, sizeof r, MSG_NOSIGNAL) < 0 && errno == EINTR);
+    }
+}
@@ -0,0 +1,36 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef M_LAUNCHER_H
+#define M_LAUNCHER_H
+
+#include <stdbool.h> // bool
+#include <sys/types.h> // pid_t
+
+#include "ds/proc.h" // job, proc
+
+bool start_launcher(void);
+void stop_launcher(void);
+void forget_launcher(void);
+void update_launcher(void);
+bool launcher_exited(pid_t pid);
+bool launcher_running(void);
+bool launcher_spawn(job const *j, proc const *p, char const *path,
+                    char **envp, pid_t *pid);
+
+#endif
@@ -16,156 +16,446 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE // memrchr
+
+#include <errno.h> // errno
 #include <stdio.h> // readline
 #include <stdlib.h> // calloc, getenv
-#include <string.h> // strerror, strcmp
+#include <string.h> // strerror, strcmp, memchr
 
-#include <unistd.h> // getcwd
+#include <fcntl.h> // open, O_CLOEXEC
+#include <sys/mman.h> // mmap, munmap
+#include <sys/stat.h> // fstat
+#include <unistd.h> // getcwd, getopt, read
 
-#include <readline/readline.h> // readline, rl_complete
-#include <readline/history.h> // add_history
+#include <readline/readline.h> // readline, rl_complete, rl_callback_*
 
-#include "signals.h" // initialize_signal_handling, sig_flags...
+#include "signals.h" // initialize_signal_handling, watch_signals...
 #include "ds/proc.h" // proc, job etc.
-#include "execute.h" // launch_job, initialize_builtins
-#include "jobs.h" // initialize_job_control, report_job_status
-#include "lexer.h" // YY_BUFFER_STATE, yy_delete_buffer, yy_scan_string
-#include "macros.h" // Stopif, Free
-#include "parser.h" // yyparse
+#include "complete.h" // initialize_completion
+#include "event.h" // event_add_fd, event_add_timer, event_wait
+#include "execute.h" // launch_job, exec_job, initialize_builtins
+#include "history.h" // initialize_history, save_history
+#include "jobs.h" // initialize_job_control, report_job_status...
+#include "notify.h" // flush_notifications, notifications_pending
+#include "launcher.h" // update_launcher
+#include "options.h" // initialize_options, Num_opt
+#include "parse_cache.h" // initialize_parse_cache, parse_job
+#include "prompt.h" // initialize_prompt, get_prompt, refresh_prompt
+#include "stats.h" // stat_begin, stat_end_detail
+#include "macros.h" // Stopif, Free, Cleanup, Assert_alloc
 
-#define MAX_PROMPT_LEN 1024
 #define HIST_FILE ".marcel.hist"
+// Size of the reads done on non-interactive input
+#define BATCH_BUF_SIZE (64 * 1024)
+// Prompt for the lines of a here-document
+#define HERE_DOC_PROMPT "> "
+// How long job notifications wait for other children to change state, so a
+// fan-out of jobs finishing together is shown (and redrawn over) once
+#define NOTIFY_DELAY_MS 20
 int exit_code;
 
-static char *saved_line;
-static int saved_point;
-static inline int restore_buffer(void);
-static inline void prepare_for_processing(void);
-static inline void gen_prompt(char *buf);
+// Signals handled by the interactive event loop
+static int const watched_signals[] = {SIGCHLD, SIGINT, SIGWINCH};
+
+// Set by handle_line once readline has seen EOF
+static bool input_done;
+
+// Job waiting for the body of its here-document, which is made of the lines
+// read after it, up to the delimiter
+static struct {
+    job *j;
+    bool last; // Passed on to run_line
+    char *body;
+    size_t len;
+    size_t cap;
+} here_doc;
+
+static void run_line(char const *line, size_t len, bool last);
+static void feed_here_doc(char const *line, size_t len);
+static void end_here_doc(bool eof);
+static void run_interactive(void);
+static void run_buffer(char const *buf, size_t len, bool exec_last);
+static void run_fd(int fd);
+static void run_file(char const *path);
 static inline char *path_concat(char *dir, char *file);
-static inline char *get_input(void);
-
-// This has to ba a macro because sigsetjmp is picky about the its stack frame
-// it returns into
-// Turns on asynchronous handling for SIGCHLD and is the destination for the
-// sigsetjmp calls in the handler. When returning from longjmp, ensures
-// readline's temporary variables are cleaned up. Additionally, informs signal
-// handler that it should longjmp out
-#define prepare_for_input()                                             \
-    do {                                                                \
-        sig_handle(SIGCHLD);                                            \
-        /* siglongjmp from signal handler returns here */               \
-        while (sigsetjmp(sigbuf, 1)) {                                  \
-            sig_flags &= ~WAITING_FOR_INPUT;                            \
-            if (!(sig_flags & NO_RESTORE)) {                            \
-                saved_line  = rl_copy_text(0, rl_end);                  \
-                saved_point = rl_point;                                 \
-                rl_pre_input_hook = restore_buffer;                     \
-                rl_replace_line("",0);                                  \
-                rl_redisplay();                                         \
-            }                                                           \
-            putchar('\n');                                              \
-            sig_flags &= ~NO_RESTORE;                                   \
-        }                                                               \
-        run_queued_signals();                                           \
-        sig_flags |= WAITING_FOR_INPUT;                                 \
-    } while (false)
-
-int main(void)
+
+// marcel [-l] [-c command | script]
+// With neither, commands are read from stdin: interactively if it is a
+// terminal, otherwise in the same batch mode as a script. -l starts commands
+// through the launcher, forked before the shell has grown
+int main(int argc, char *argv[])
 {
+    char const *command = NULL;
+    bool launcher = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:l")) != -1) {
+        switch (opt) {
+        case 'c':
+            command = optarg;
+            break;
+        case 'l':
+            launcher = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-l] [-c command | script]\n", argv[0]);
+            return M_FAILED_INIT;
+        }
+    }
+    char const *script = command ? NULL : argv[optind];
+
     Stopif(!initialize_builtins(), return M_FAILED_INIT,
            "Could not initialize builtin commands");
-    Stopif(!initialize_job_control(), return M_FAILED_INIT,
+    Stopif(!initialize_options(), return M_FAILED_INIT,
+           "Could not initialize options");
+    Stopif(!initialize_parse_cache(), return M_FAILED_INIT,
+           "Could not initialize parse cache");
+    Stopif(!initialize_job_control(!command && !script), return M_FAILED_INIT,
            "Could not initialize job control");
     initialize_signal_handling();
+    // Forked after the signals are set up, since its children inherit them
+    if (launcher) {
+        Num_opt(OPT_LAUNCHER) = 1;
+        update_launcher();
+    }
 
-    // Use tab for shell completion
-    rl_bind_key('\t', rl_complete);
-    rl_set_signals();
+    if (interactive) {
+        // Use tab for shell completion
+        initialize_completion();
 
-    // Setup history
-    char *home = getenv("HOME");
-    char *hist_path = path_concat(home, HIST_FILE);
-    read_history(hist_path);
+        // Setup history
+        char *home = getenv("HOME");
+        char *hist_path = path_concat(home, HIST_FILE);
+        initialize_history(hist_path);
+        free(hist_path);
 
-    // buffer for stdin
-    char *line = NULL;
+        run_interactive();
+    } else {
+        if (command) {
+            run_buffer(command, strlen(command), true);
+        } else if (script) {
+            run_file(script);
+        } else {
+            run_fd(STDIN_FILENO);
+        }
+        end_here_doc(true);
+        // Queued background jobs still have to be started
+        wait_for_background(true);
+    }
+    return exit_code;
+}
 
-    prepare_for_input();
-    while ((line = get_input())) {
-        prepare_for_processing();
+// Register and run j. If last is set, nothing will be run after it
+static void run_job(job *j, bool last)
+{
+    register_job(j);
+    if (last) {
+        exec_job(j);
+    } else {
+        launch_job(j);
+    }
+}
 
-        job *j = new_job();
-        j->name = strdup(line);
-        Assert_alloc(j->name);
+// Parse and execute a single line of input, which need not be NUL
+// terminated. If last is set, nothing will be run after it. A job with a
+// here-document is held back until feed_here_doc has its body
+static void run_line(char const *line, size_t len, bool last)
+{
+    stat_span span = stat_begin();
+    job *j = new_job();
+    j->name = arena_strndup(j->arena, line, len);
 
-        add_history(line);
-        YY_BUFFER_STATE b = yy_scan_string(line);
+    if (!parse_job(j, len)) {
+        Cleanup(j, free_single_job);
+    } else if (j->io[STDIN_FILENO].kind == IO_HERE
+               && !j->io[STDIN_FILENO].text) {
+        here_doc.j = j;
+        here_doc.last = last;
+        here_doc.len = 0;
+    } else {
+        run_job(j, last);
+    }
+    exit_code = report_job_status();
+    flush_notifications();
+    stat_end_detail(STAT_COMMAND, span, line, len);
+}
 
-        if (!yyparse(j) && j->valid) {
-            register_job(j);
-            launch_job(j);
-        } else {
-            Cleanup(j, free_single_job);
+// Add a line of input to the pending here-document, running its job once the
+// line is the delimiter
+static void feed_here_doc(char const *line, size_t len)
+{
+    char const *delim = here_doc.j->io[STDIN_FILENO].path;
+    if (strlen(delim) == len && memcmp(line, delim, len) == 0) {
+        end_here_doc(false);
+        return;
+    }
+    if (here_doc.len + len + 1 > here_doc.cap) {
+        here_doc.cap = 2 * (here_doc.len + len + 1);
+        here_doc.body = realloc(here_doc.body, here_doc.cap);
+        Assert_alloc(here_doc.body);
+    }
+    memcpy(here_doc.body + here_doc.len, line, len);
+    here_doc.len += len;
+    here_doc.body[here_doc.len++] = '\n';
+}
+
+// Run the job of the pending here-document, if any, with the body read so
+// far. eof is set if the input ended before the delimiter was seen
+static void end_here_doc(bool eof)
+{
+    job *j = here_doc.j;
+    if (!j) {
+        return;
+    }
+    proc_io *io = &j->io[STDIN_FILENO];
+    if (eof) {
+        Err_msg("here-document delimited by end-of-file (wanted \"%s\")",
+                io->path);
+    }
+    io->text = arena_strndup(j->arena, here_doc.body ? here_doc.body : "",
+                             here_doc.len);
+    io->text_len = here_doc.len;
+    here_doc.j = NULL;
+    run_job(j, here_doc.last);
+    exit_code = report_job_status();
+    flush_notifications();
+}
+
+// True if the line has nothing to run: it is blank or a comment (which
+// includes a #! line)
+static inline bool skip_line(char const *line, char const *end)
+{
+    while (line != end && (*line == ' ' || *line == '\t' || *line == '\r')) {
+        line++;
+    }
+    return line == end || *line == '#';
+}
+
+// Find the next line in [*pos, end) with something to run, storing its length
+// in len and advancing *pos past it. Returns NULL if there is none
+static char const *next_line(char const **pos, char const *end, size_t *len)
+{
+    while (*pos != end) {
+        char const *line = *pos;
+        char const *nl = memchr(line, '\n', end - line);
+        char const *line_end = nl ? nl : end;
+        *pos = nl ? nl + 1 : end;
+        if (!skip_line(line, line_end)) {
+            *len = line_end - line;
+            return line;
         }
+    }
+    return NULL;
+}
 
-        Cleanup(b, yy_delete_buffer);
-        Free(line);
-        exit_code = report_job_status();
-        prepare_for_input();
+// Run every line of buf. If exec_last is set the final command replaces the
+// shell, the way the last command of -c is run
+static void run_buffer(char const *buf, size_t len, bool exec_last)
+{
+    char const *end = buf + len;
+    while (buf != end) {
+        if (here_doc.j) {
+            // Blank lines and comments are part of the body
+            char const *line = buf;
+            char const *nl = memchr(line, '\n', end - line);
+            buf = nl ? nl + 1 : end;
+            feed_here_doc(line, (nl ? nl : end) - line);
+            continue;
+        }
+        size_t line_len, next_len;
+        char const *line = next_line(&buf, end, &line_len);
+        if (!line) {
+            break;
+        }
+        char const *next = buf;
+        run_line(line, line_len,
+                 exec_last && !next_line(&next, end, &next_len));
     }
+}
 
-    write_history(hist_path);
-    free(hist_path);
-    return exit_code;
+// Run the lines read from fd until EOF. Input is read in large chunks and
+// every complete line in a chunk is run before the next read
+static void run_fd(int fd)
+{
+    size_t cap = BATCH_BUF_SIZE;
+    char *buf = malloc(cap);
+    Assert_alloc(buf);
+    size_t len = 0;
+
+    ssize_t n;
+    while ((n = read(fd, buf + len, cap - len)) != 0) {
+        if (n < 0) {
+            Stopif(errno != EINTR, break, "%s", strerror(errno));
+            continue;
+        }
+        len += n;
+        char *last_nl = memrchr(buf, '\n', len);
+        if (!last_nl) {
+            // A single line that doesn't fit yet
+            if (len == cap) {
+                cap *= 2;
+                buf = realloc(buf, cap);
+                Assert_alloc(buf);
+            }
+            continue;
+        }
+        size_t done = last_nl + 1 - buf;
+        run_buffer(buf, done, false);
+        memmove(buf, buf + done, len - done);
+        len -= done;
+    }
+    // Last line may not end in a newline
+    run_buffer(buf, len, false);
+    free(buf);
+}
+
+// Run the script at path, mapping it into memory if it is a regular file
+static void run_file(char const *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    Stopif(fd < 0, exit_code = M_FAILED_IO; return,
+           "%s: %s", path, strerror(errno));
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        run_fd(fd);
+        close(fd);
+    } else {
+        close(fd);
+        run_buffer(map, st.st_size, false);
+        munmap(map, st.st_size);
+    }
+}
+
+// Hand readline a new prompt reflecting the current state of the shell
+static void update_prompt(void)
+{
+    rl_set_prompt(here_doc.j ? HERE_DOC_PROMPT : get_prompt(exit_code));
 }
 
+// Redraw the line being edited after an asynchronous prompt segment changed
+static void repaint_prompt(void)
+{
+    rl_clear_visible_line();
+    update_prompt();
+    rl_on_new_line();
+    rl_forced_update_display();
+}
+
+// Called by readline with every complete line of input, NULL on EOF
+static void handle_line(char *line)
+{
+    if (!line) {
+        input_done = true;
+        end_here_doc(true);
+        return;
+    }
+    save_history(line);
+    if (here_doc.j) {
+        feed_here_doc(line, strlen(line));
+    } else {
+        run_line(line, strlen(line), false);
+    }
+    Free(line);
+    refresh_prompt();
+    update_prompt();
+}
 
-// For symmetry with prepare_for_input. Turns off async handling for SIGCHLD
-// and informs signal handler that it shouldn't longjmp out
-static inline void prepare_for_processing(void)
+static void read_input(int fd, void *data)
 {
-    sig_flags &= ~WAITING_FOR_INPUT;
-    sig_default(SIGCHLD);
+    (void) fd;
+    (void) data;
+    rl_callback_read_char();
 }
 
+// Id of the timer that shows job notifications, 0 if there is none
+static int notify_timer;
 
-// Prints prompt and returns line entered by user. Returned string must be
-// freed. Returns NULL on EOF
-static inline char *get_input(void)
+// Put the job notifications collected so far above the line being edited,
+// which is redrawn with the prompt brought up to date
+static void show_notifications(void *data)
 {
-    char prompt_buf[MAX_PROMPT_LEN] = {0};
-    gen_prompt(prompt_buf);
-    return readline(prompt_buf);
+    (void) data;
+    notify_timer = 0;
+    rl_clear_visible_line();
+    flush_notifications();
+    update_prompt();
+    rl_on_new_line();
+    rl_forced_update_display();
 }
 
-// Creates shell prompt based on username and current directory
-static inline void gen_prompt(char *buf)
+// Act on a signal delivered through the event loop. Anything printed is put
+// above the line being edited, which is redrawn afterwards
+static void handle_signal(int signo)
 {
-    char *user = getenv("USER");
-    char *dir = getcwd(NULL, 1024);
-    char sym = (strcmp(user, "root")) ? '$' : '#';
-    snprintf(buf, MAX_PROMPT_LEN, "%-3d [%s:%s] %c ", (unsigned char) exit_code,
-             user, dir, sym);
-    Free(dir);
+    switch (signo) {
+    case SIGINT:
+        // Throw away the line being edited, and any here-document, and start
+        // over
+        exit_code = M_SIGINT;
+        if (here_doc.j) {
+            Cleanup(here_doc.j, free_single_job);
+        }
+        rl_free_line_state();
+        rl_callback_sigcleanup();
+        rl_replace_line("", 0);
+        rl_crlf();
+        update_prompt();
+        rl_on_new_line();
+        rl_redisplay();
+        break;
+    case SIGCHLD:
+        // Foreground jobs have already been reaped and reported
+        if (!live_job_count()) {
+            break;
+        }
+        int old_code = exit_code;
+        exit_code = report_job_status();
+        // The line being edited is only redrawn if something changed, once
+        // the event loop has picked up whatever else is about to
+        if ((notifications_pending() || exit_code != old_code)
+            && !notify_timer) {
+            notify_timer = event_add_timer(NOTIFY_DELAY_MS, show_notifications,
+                                           NULL);
+        }
+        break;
+    case SIGWINCH:
+        rl_resize_terminal();
+        break;
+    }
 }
 
-// Restores the user's input to readline's buffer
-static inline int restore_buffer(void)
+static void read_signal_fd(int fd, void *data)
 {
-    // Temporarily block signals;
-    sigset_t new;
-    sigfillset(&new);
-    sigset_t old = sig_block(new);
-    rl_replace_line(saved_line, 0);
-    rl_point = saved_point;
-    rl_redisplay();
-    saved_point = 0;
-    Free(saved_line);
-    rl_pre_input_hook = NULL;
-    // Restore signal mask
-    sig_setmask(old);
-    return 0;
+    (void) data;
+    read_signals(fd, handle_signal);
+}
+
+// Read and execute lines from the terminal until EOF. Input, child status
+// changes and other signals are all multiplexed by the event loop, with
+// readline driven through its callback interface so background jobs can be
+// reported while a line is being edited
+static void run_interactive(void)
+{
+    // Signals are handled by us between calls to rl_callback_read_char
+    rl_catch_signals = 0;
+    rl_catch_sigwinch = 0;
+
+    int sig_fd = watch_signals(watched_signals, Arr_len(watched_signals));
+    Stopif(sig_fd == -1, return, "Could not set up signal handling");
+    event_add_fd(sig_fd, read_signal_fd, NULL);
+    event_add_fd(STDIN_FILENO, read_input, NULL);
+
+    initialize_prompt(repaint_prompt);
+    rl_callback_handler_install(get_prompt(exit_code), handle_line);
+    while (!input_done) {
+        event_wait();
+    }
+    rl_callback_handler_remove();
 }
 
 static inline char *path_concat(char *dir, char *file)
@@ -0,0 +1,167 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Job notifications and the rest of what the job code reports (job times)
+// are collected here instead of being written to stderr as they happen, and
+// written in one go by flush_notifications at points where that is safe: by
+// the main loop once a line has run or children have been reaped, with the
+// line being edited cleared. A fan-out of hundreds of jobs then costs one
+// write and one redisplay per batch of reaped children rather than each
+
+#include <stdarg.h> // va_list, va_start, va_end
+#include <stdio.h> // vsnprintf
+#include <stdlib.h> // realloc
+#include <string.h> // strcmp
+
+#include <unistd.h> // STDERR_FILENO
+
+#include "fdio.h" // write_all
+#include "notify.h" // prototypes
+#include "options.h" // Str_opt, OPT_NOTIFY
+#include "macros.h" // Assert_alloc, Err_msg, Arr_len
+
+#define NOTIFY_BUF_INIT 1024
+
+char const *const note_names[N_NOTES] = {
+    [NOTE_LAUNCHED] = "launched",
+    [NOTE_QUEUED] = "queued",
+    [NOTE_COMPLETED] = "completed",
+    [NOTE_FAILED] = "failed",
+    [NOTE_STOPPED] = "stopped",
+};
+
+static char const *const mode_names[] = {
+    [NOTIFY_LINES] = "lines",
+    [NOTIFY_SUMMARY] = "summary",
+    [NOTIFY_LOG] = "log",
+};
+
+static notify_mode mode;
+
+static struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+} pending;
+
+// What summary mode has counted since the last flush
+static size_t counts[N_NOTES];
+
+notify_mode get_notify_mode(void)
+{
+    return mode;
+}
+
+// Called when OPT_NOTIFY changes
+void update_notify(void)
+{
+    // Whatever was collected is shown the way it was meant to be
+    flush_notifications();
+    char const *name = Str_opt(OPT_NOTIFY);
+    mode = NOTIFY_LINES;
+    if (!name || !*name) {
+        return;
+    }
+    for (size_t i = 0; i < Arr_len(mode_names); i++) {
+        if (strcmp(name, mode_names[i]) == 0) {
+            mode = i;
+            return;
+        }
+    }
+    Err_msg("notify: unknown mode %s, using lines (or summary, log)", name);
+}
+
+// Append to what the next flush writes
+void notify_printf(char const *fmt, ...)
+{
+    va_list ap;
+    for (;;) {
+        va_start(ap, fmt);
+        size_t room = pending.cap - pending.len;
+        int n = vsnprintf(pending.buf + pending.len, room, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            return;
+        }
+        if ((size_t) n < room) {
+            pending.len += n;
+            return;
+        }
+        size_t cap = pending.cap ? pending.cap : NOTIFY_BUF_INIT;
+        while (cap <= pending.len + n) {
+            cap *= 2;
+        }
+        pending.buf = realloc(pending.buf, cap);
+        Assert_alloc(pending.buf);
+        pending.cap = cap;
+    }
+}
+
+// Count a change for the summary
+void count_note(note_kind kind)
+{
+    counts[kind]++;
+}
+
+// True if flush_notifications has something to write
+bool notifications_pending(void)
+{
+    if (pending.len) {
+        return true;
+    }
+    for (size_t i = 0; i < N_NOTES; i++) {
+        if (counts[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Append a line like "42 jobs completed, 2 failed" for what was counted, and
+// start counting over
+static void summarize(void)
+{
+    bool first = true;
+    for (size_t i = 0; i < N_NOTES; i++) {
+        if (!counts[i]) {
+            continue;
+        }
+        if (first) {
+            notify_printf("%zu job%s %s", counts[i], counts[i] == 1 ? "" : "s",
+                          note_names[i]);
+            first = false;
+        } else {
+            notify_printf(", %zu %s", counts[i], note_names[i]);
+        }
+        counts[i] = 0;
+    }
+    if (!first) {
+        notify_printf("\n");
+    }
+}
+
+// Write everything collected so far to stderr
+void flush_notifications(void)
+{
+    summarize();
+    if (!pending.len) {
+        return;
+    }
+    (void) write_all(STDERR_FILENO, pending.buf, pending.len);
+    pending.len = 0;
+}
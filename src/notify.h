@@ -0,0 +1,53 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef M_NOTIFY_H
+#define M_NOTIFY_H
+
+#include <stdbool.h>
+
+#include "macros.h" // __attribute__
+
+// How job notifications are shown, set with `setopt notify`
+typedef enum {
+    NOTIFY_LINES, // A line for every job, as it changes
+    NOTIFY_SUMMARY, // A count of each kind of change since the last flush
+    NOTIFY_LOG, // A tab separated line for every job, for log collectors
+} notify_mode;
+
+// Changes in a job's state that are notified
+typedef enum {
+    NOTE_LAUNCHED,
+    NOTE_QUEUED,
+    NOTE_COMPLETED,
+    NOTE_FAILED, // Completed with a nonzero status, only counted in summaries
+    NOTE_STOPPED,
+    N_NOTES,
+} note_kind;
+
+extern char const *const note_names[N_NOTES];
+
+notify_mode get_notify_mode(void);
+void update_notify(void);
+void notify_printf(char const *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+void count_note(note_kind kind);
+bool notifications_pending(void);
+void flush_notifications(void);
+
+#endif
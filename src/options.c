@@ -0,0 +1,176 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE // dprintf
+
+#include <errno.h> // errno
+#include <stdio.h> // dprintf
+#include <stdlib.h> // strtol, atexit
+#include <string.h> // strcmp, strdup
+
+#include <unistd.h> // sysconf
+
+#include "jobs.h" // start_queued_jobs
+#include "launcher.h" // update_launcher
+#include "notify.h" // update_notify
+#include "options.h" // option, prototypes
+#include "prompt.h" // refresh_prompt
+#include "resources.h" // update_affinity
+#include "stats.h" // update_trace
+#include "macros.h" // Stopif, Free, Arr_len, Assert_alloc
+
+option options[N_OPTIONS] = {
+    [OPT_MAXJOBS] = {
+        .name = "maxjobs", .type = OPT_NUM, .min = 0,
+        .help = "background jobs run at once, 0 for no limit (default: CPUs)",
+        .on_change = start_queued_jobs,
+    },
+    [OPT_HISTSIZE] = {
+        .name = "histsize", .type = OPT_NUM, .num = 1000, .min = 0,
+        .help = "history entries loaded at startup, more are loaded on demand",
+    },
+    [OPT_HISTFILESIZE] = {
+        .name = "histfilesize", .type = OPT_NUM, .num = 64 << 20, .min = 0,
+        .help = "bytes the history file is trimmed to, 0 for no limit",
+    },
+    [OPT_PROMPTCMD] = {
+        .name = "promptcmd", .type = OPT_STR,
+        .help = "command run in the background whose output is shown in the "
+                "prompt, e.g. git branch --show-current",
+        .on_change = refresh_prompt,
+    },
+    [OPT_PIPESIZE] = {
+        .name = "pipesize", .type = OPT_NUM, .min = 0,
+        .help = "bytes buffered by pipes between stages, 0 for the default",
+    },
+    [OPT_LAUNCHER] = {
+        .name = "launcher", .type = OPT_NUM, .min = 0,
+        .help = "start commands from a small helper process, best set early "
+                "with -l (0: off)",
+        .on_change = update_launcher,
+    },
+    [OPT_CGROUP] = {
+        .name = "cgroup", .type = OPT_STR,
+        .help = "writable cgroup v2 directory that every job gets a cgroup of "
+                "its own in",
+    },
+    [OPT_CPUMAX] = {
+        .name = "cpumax", .type = OPT_STR,
+        .help = "cpu.max of each job's cgroup, e.g. '50000 100000' for half a "
+                "CPU",
+    },
+    [OPT_MEMMAX] = {
+        .name = "memmax", .type = OPT_STR,
+        .help = "memory.max of each job's cgroup, e.g. 512M",
+    },
+    [OPT_CPUS] = {
+        .name = "cpus", .type = OPT_STR,
+        .help = "CPUs jobs are pinned to, e.g. 0-3,8 or node0 for those of a "
+                "NUMA node",
+        .on_change = update_affinity,
+    },
+    [OPT_TRACEFILE] = {
+        .name = "tracefile", .type = OPT_STR,
+        .help = "file the shell appends Chrome/Perfetto trace events of its "
+                "own work to",
+        .on_change = update_trace,
+    },
+    [OPT_SUBMAX] = {
+        .name = "submax", .type = OPT_NUM, .min = 0,
+        .help = "bytes of output a $(...) may produce before the command "
+                "using it fails, 0 for no limit",
+    },
+    [OPT_GLOBCACHE] = {
+        .name = "globcache", .type = OPT_NUM, .min = 0,
+        .help = "seconds a directory listing read for a glob is reused for "
+                "while the directory is unchanged (0: off)",
+    },
+    [OPT_NOTIFY] = {
+        .name = "notify", .type = OPT_STR,
+        .help = "how job notifications are shown: lines (default), summary "
+                "(counts of each change) or log (tab separated fields)",
+        .on_change = update_notify,
+    },
+};
+
+static void cleanup_options(void);
+
+// Fill in defaults that depend on the machine
+// Returns true on success, false on failure
+bool initialize_options(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    Num_opt(OPT_MAXJOBS) = cpus > 0 ? cpus : 1;
+    return !atexit(cleanup_options);
+}
+
+static void cleanup_options(void)
+{
+    for (size_t i = 0; i < Arr_len(options); i++) {
+        if (options[i].type == OPT_STR) {
+            Free(options[i].str);
+        }
+    }
+}
+
+// Returns the option called name, NULL if there is none
+option *find_option(char const *name)
+{
+    for (size_t i = 0; i < Arr_len(options); i++) {
+        if (strcmp(options[i].name, name) == 0) {
+            return &options[i];
+        }
+    }
+    return NULL;
+}
+
+// Parse value and store it in o. Returns false (leaving o alone) if value isn't
+// valid for o
+bool set_option(option *o, char const *value)
+{
+    if (o->type == OPT_NUM) {
+        char *end;
+        errno = 0;
+        long num = strtol(value, &end, 10);
+        Stopif(errno || !*value || *end, return false,
+               "%s: not a number: %s", o->name, value);
+        Stopif(num < o->min, return false,
+               "%s: must be at least %ld", o->name, o->min);
+        o->num = num;
+    } else {
+        char *str = strdup(value);
+        Assert_alloc(str);
+        Free(o->str);
+        o->str = str;
+    }
+    if (o->on_change) {
+        o->on_change();
+    }
+    return true;
+}
+
+// Write "name value # help" for o to out
+void print_option(int out, option const *o)
+{
+    if (o->type == OPT_NUM) {
+        dprintf(out, "%s\t%ld\t# %s\n", o->name, o->num, o->help);
+    } else {
+        dprintf(out, "%s\t%s\t# %s\n", o->name, o->str ? o->str : "",
+                o->help);
+    }
+}
@@ -0,0 +1,70 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef M_OPTIONS_H
+#define M_OPTIONS_H
+
+#include <stdbool.h>
+
+// Shell options, set with the setopt builtin
+enum {
+    OPT_MAXJOBS, // Background jobs allowed to run at once, 0 for no limit
+    OPT_HISTSIZE, // History entries loaded at startup
+    OPT_HISTFILESIZE, // Bytes the history file is trimmed to, 0 for no limit
+    OPT_PROMPTCMD, // Command whose output is shown in the prompt
+    OPT_PIPESIZE, // Buffer size of pipes between stages, 0 for the default
+    OPT_LAUNCHER, // Start commands through the launcher process
+    OPT_CGROUP, // cgroup v2 directory each job gets a leaf cgroup in
+    OPT_CPUMAX, // cpu.max of every job's cgroup
+    OPT_MEMMAX, // memory.max of every job's cgroup
+    OPT_CPUS, // CPUs and NUMA nodes jobs are pinned to
+    OPT_TRACEFILE, // File trace events of the shell's own work are appended to
+    OPT_SUBMAX, // Output allowed from a command substitution, 0 for no limit
+    OPT_GLOBCACHE, // Seconds directory listings are kept for globbing
+    OPT_NOTIFY, // How job notifications are shown: lines, summary or log
+    N_OPTIONS
+};
+
+typedef enum {
+    OPT_NUM,
+    OPT_STR,
+} opt_type;
+
+typedef struct option {
+    char const *name;
+    opt_type type;
+    union {
+        long num;
+        char *str;
+    };
+    long min; // Smallest value a numeric option may be set to
+    char const *help;
+    void (*on_change)(void); // Called after the option is set, may be NULL
+} option;
+
+extern option options[N_OPTIONS];
+
+#define Num_opt(ID) (options[ID].num)
+#define Str_opt(ID) (options[ID].str)
+
+bool initialize_options(void);
+option *find_option(char const *name);
+bool set_option(option *o, char const *value);
+void print_option(int out, option const *o);
+
+#endif
@@ -0,0 +1,322 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// parallel [-j N] [-k] command [arg...]
+//
+// Runs command once for every line read from stdin, with up to N (default: the
+// maxjobs option, or the number of CPUs if that is unlimited) running at once.
+// Every {} in the arguments is replaced by the line; if there is none the line
+// is appended as the last argument. Each run is an ordinary job in the job
+// table, started with start_job and reaped like any other, but parallel frees
+// it itself instead of it being reported. With -k the output of every run is
+// buffered and written out in input order, so it is never interleaved.
+
+#define _GNU_SOURCE // dprintf
+
+#include <errno.h> // errno
+#include <stdlib.h> // malloc, strtol
+#include <string.h> // strstr, strlen
+
+#include <fcntl.h> // open, fcntl, F_DUPFD_CLOEXEC
+#include <signal.h> // kill
+#include <unistd.h> // close, lseek, sysconf
+
+#include "ds/arena.h" // arena_alloc, arena_strdup
+#include "ds/proc.h" // job, proc, new_job, new_proc
+#include "ds/vec.h" // Vec_push, vec_reserve, vec_len
+#include "execute.h" // start_job
+#include "fdio.h" // copy_fd, scratch_fd, line_reader, read_line
+#include "jobs.h" // register_job, wait_for_child, check_job_status...
+#include "options.h" // Num_opt, OPT_MAXJOBS
+#include "parallel.h" // m_parallel
+#include "macros.h" // Stopif, Cleanup, Assert_alloc, Arr_len
+
+#define ITEM_BUF_SIZE 4096
+// Completed runs kept for -k while an earlier one is still going, per slot
+#define BACKLOG_PER_SLOT 4
+
+// One run of the command
+typedef struct item {
+    job *j; // NULL once the run has completed
+    int out; // Buffered output with -k, -1 otherwise
+    int exit_code;
+} item;
+
+typedef struct run_state {
+    proc const *tmpl; // The parallel proc itself
+    char **cmd; // Command and arguments to run for each line
+    bool keep_order;
+    size_t n_slots;
+    // Runs that have been started and not yet flushed, in input order.
+    // Circular, with room for n_slots * BACKLOG_PER_SLOT of them
+    item *items;
+    size_t cap, head, count;
+    size_t running;
+    size_t failed;
+} run_state;
+
+// Copy arg into a, replacing every {} with item. Sets *found if there was one
+static char *substitute(arena *a, char const *arg, char const *item,
+                        bool *found)
+{
+    char const *brace = strstr(arg, "{}");
+    if (!brace) {
+        return arena_strdup(a, arg);
+    }
+    *found = true;
+    size_t n_braces = 0;
+    for (char const *b = brace; b; b = strstr(b + 2, "{}")) {
+        n_braces++;
+    }
+    size_t item_len = strlen(item);
+    char *ret = arena_alloc(a, strlen(arg) + n_braces * item_len + 1);
+    char *out = ret;
+    while (brace) {
+        memcpy(out, arg, brace - arg);
+        out += brace - arg;
+        memcpy(out, item, item_len);
+        out += item_len;
+        arg = brace + 2;
+        brace = strstr(arg, "{}");
+    }
+    strcpy(out, arg);
+    return ret;
+}
+
+// Build the job that runs the command for line
+static job *item_job(run_state const *s, char const *line)
+{
+    job *j = new_job();
+    arena *a = j->arena;
+    proc *p = new_proc(a);
+    Vec_push(&j->procs, p);
+
+    // Room for every argument, the line if it isn't substituted, and NULL
+    size_t n_args = 0;
+    while (s->cmd[n_args]) {
+        n_args++;
+    }
+    vec_reserve(n_args + 2, sizeof *p->argv, (vec *) &p->argv);
+    bool found = false;
+    size_t name_len = 0;
+    for (char **arg = s->cmd; *arg; arg++) {
+        char *sub = substitute(a, *arg, line, &found);
+        Vec_push(&p->argv, sub);
+        name_len += strlen(sub) + 1;
+    }
+    if (!found) {
+        Vec_push(&p->argv, arena_strdup(a, line));
+        name_len += strlen(line) + 1;
+    }
+    Vec_push(&p->argv, NULL);
+    // Assignments made for parallel apply to every run
+    size_t n_env = vec_len(s->tmpl->env);
+    vec_reserve(n_env, sizeof *p->env, (vec *) &p->env);
+    for (size_t i = 0; i < n_env; i++) {
+        Vec_push(&p->env, s->tmpl->env[i]);
+    }
+
+    // Name it after the command that is actually run, for `jobs`
+    j->name = arena_alloc(a, name_len);
+    char *name = j->name;
+    for (char **arg = p->argv; *arg; arg++) {
+        size_t len = strlen(*arg);
+        memcpy(name, *arg, len);
+        name += len;
+        *name++ = ' ';
+    }
+    name[-1] = '\0';
+
+    // Kept off the terminal and out of notifications
+    j->bkg = true;
+    j->quiet = true;
+    j->valid = true;
+    return j;
+}
+
+// Write everything in the buffer fd to out and close it
+static void flush_buffer(int fd, int out)
+{
+    lseek(fd, 0, SEEK_SET);
+    Stopif(copy_fd(fd, out) < 0, /* No action */,
+           "parallel: %s", strerror(errno));
+    close(fd);
+}
+
+static inline int dup_fd(int fd, int target)
+{
+    return fd == target ? fd : fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+// Close the fds start_item opened for it and its proc p, whose job was never
+// registered to take them over
+static void close_item_fds(item *it, proc const *p)
+{
+    for (size_t i = 0; i < Arr_len(p->fds); i++) {
+        if (p->fds[i] >= 0 && p->fds[i] != (int) i) {
+            close(p->fds[i]);
+        }
+    }
+    if (it->out >= 0) {
+        close(it->out);
+        it->out = -1;
+    }
+}
+
+// Start the command for line as the newest run. Returns false if it couldn't
+// be started at all
+static bool start_item(run_state *s, char const *line)
+{
+    job *j = item_job(s, line);
+    proc *p = j->procs[0];
+    item *it = &s->items[(s->head + s->count) % s->cap];
+    *it = (item) {.j = j, .out = -1};
+
+    // Runs must not eat the input meant for later ones
+    p->fds[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    Stopif(p->fds[0] < 0, free_single_job(j); return false,
+           "parallel: /dev/null: %s", strerror(errno));
+    if (s->keep_order) {
+        it->out = scratch_fd("parallel");
+        Stopif(it->out < 0, /* Write directly */,
+               "parallel: can't buffer output: %s", strerror(errno));
+    }
+    p->fds[1] = dup_fd(it->out >= 0 ? it->out : s->tmpl->fds[1], 1);
+    p->fds[2] = dup_fd(s->tmpl->fds[2], 2);
+
+    Stopif(!register_job(j), close_item_fds(it, p); free_single_job(j);
+           return false, "parallel: could not register job");
+    s->count++;
+    if (start_job(j) != 0) {
+        // Nothing was started, so nothing will be reaped
+        mark_proc_completed(j, p, M_FAILED_EXEC);
+    }
+    s->running++;
+    return true;
+}
+
+// Note runs that have completed since the last check and free their jobs.
+// report_job_status would free them as well, so it must not run in between
+static void collect_completed(run_state *s)
+{
+    for (size_t i = 0; i < s->count; i++) {
+        item *it = &s->items[(s->head + i) % s->cap];
+        if (it->j && is_completed(it->j)) {
+            it->exit_code = it->j->procs[0]->exit_code;
+            if (it->exit_code) {
+                s->failed++;
+            }
+            Cleanup(it->j, unregister_job);
+            s->running--;
+        }
+    }
+}
+
+// Write out the buffered output of completed runs at the front, in order
+static void flush_completed(run_state *s)
+{
+    while (s->count && !s->items[s->head].j) {
+        item *it = &s->items[s->head];
+        if (it->out >= 0) {
+            flush_buffer(it->out, s->tmpl->fds[1]);
+        }
+        s->head = (s->head + 1) % s->cap;
+        s->count--;
+    }
+}
+
+// Stop every run still going, on ^C
+static void kill_running(run_state *s)
+{
+    for (size_t i = 0; i < s->count; i++) {
+        job *j = s->items[(s->head + i) % s->cap].j;
+        if (j && j->procs[0]->pid) {
+            kill(j->pgid ? -j->pgid : j->procs[0]->pid, SIGTERM);
+        }
+    }
+}
+
+// Number of runs allowed at once when -j isn't given
+static size_t default_slots(void)
+{
+    if (Num_opt(OPT_MAXJOBS)) {
+        return Num_opt(OPT_MAXJOBS);
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? cpus : 1;
+}
+
+int m_parallel(proc const *p)
+{
+    run_state s = {.tmpl = p, .n_slots = default_slots()};
+    char **args = p->argv + 1;
+    for (; *args && **args == '-'; args++) {
+        if (strcmp(*args, "-k") == 0) {
+            s.keep_order = true;
+        } else if (strncmp(*args, "-j", 2) == 0) {
+            char const *num = (*args)[2] ? *args + 2 : *++args;
+            char *end;
+            long n = num ? strtol(num, &end, 10) : 0;
+            Stopif(!num || *end || n < 1, return 1,
+                   "parallel: -j needs a positive number");
+            s.n_slots = n;
+        } else {
+            break;
+        }
+    }
+    Stopif(!*args, return 1, "usage: parallel [-j N] [-k] command [arg...]");
+    s.cmd = args;
+
+    s.cap = s.keep_order ? s.n_slots * BACKLOG_PER_SLOT : s.n_slots;
+    s.items = malloc(s.cap * sizeof *s.items);
+    Assert_alloc(s.items);
+    line_reader r = {.fd = p->fds[0], .cap = ITEM_BUF_SIZE,
+                     .name = "parallel"};
+    r.buf = malloc(r.cap);
+    Assert_alloc(r.buf);
+
+    bool more = true, interrupted = false;
+    for (;;) {
+        // Fill free slots, as long as the backlog has room
+        while (more && s.running < s.n_slots && s.count < s.cap) {
+            char *line = read_line(&r);
+            more = line && start_item(&s, line);
+        }
+        check_job_status();
+        collect_completed(&s);
+        flush_completed(&s);
+        if (!s.running) {
+            if (!more) {
+                break;
+            }
+            continue;
+        }
+        if (!wait_for_child() && !interrupted) {
+            interrupted = true;
+            more = false;
+            kill_running(&s);
+        }
+    }
+
+    free(r.buf);
+    free(s.items);
+    if (interrupted) {
+        return M_SIGINT;
+    }
+    return s.failed ? 1 : 0;
+}
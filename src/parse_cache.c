@@ -0,0 +1,128 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Lines that are run over and over (scripts, generated input) are only lexed
+// and parsed the first time. The job each distinct line parses into is kept
+// as a template, and later occurrences of the line get a copy of it. The
+// templates are kept in a hash table keyed by line and evicted in least
+// recently used order
+
+#include <stdlib.h> // atexit
+
+#include "ds/arena.h" // arena_alloc
+#include "ds/hash_table.h" // hash_table, table_add, table_find, table_remove
+#include "ds/proc.h" // job, new_job, copy_job, free_single_job
+#include "parse_cache.h" // function prototypes
+#include "stats.h" // stat_begin, stat_end, stat_end_detail
+// parser.h defines the YY_DECL that lexer.h declares yylex with
+#include "parser.h" // yyparse, scan_line
+#include "lexer.h" // YY_BUFFER_STATE, yy_delete_buffer
+#include "macros.h" // Cleanup
+
+// A cached parse. Allocated in the arena of its template, whose name is the
+// line it was parsed from
+typedef struct cache_entry {
+    job *tmpl;
+    struct cache_entry *prev; // More recently used
+    struct cache_entry *next; // Less recently used
+} cache_entry;
+
+static hash_table *cache;
+static cache_entry *mru, *lru;
+
+static void free_parse_cache(void);
+
+// Returns true on success, false on failure. Until this is called parse_job
+// parses every line
+bool initialize_parse_cache(void)
+{
+    cache = new_table(2 * PARSE_CACHE_SIZE);
+    if (!cache) {
+        return false;
+    }
+    return !atexit(free_parse_cache);
+}
+
+static void free_parse_cache(void)
+{
+    while (lru) {
+        cache_entry *e = lru;
+        lru = e->prev;
+        free_single_job(e->tmpl);
+    }
+    mru = NULL;
+    free_table(cache, NULL);
+    cache = NULL;
+}
+
+static void unlink_entry(cache_entry *e)
+{
+    *(e->prev ? &e->prev->next : &mru) = e->next;
+    *(e->next ? &e->next->prev : &lru) = e->prev;
+}
+
+static void push_front(cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = mru;
+    *(mru ? &mru->prev : &lru) = e;
+    mru = e;
+}
+
+// Keep a copy of the freshly parsed j, making room if necessary
+static void add_template(job const *j)
+{
+    if (cache->len == PARSE_CACHE_SIZE) {
+        cache_entry *old = lru;
+        unlink_entry(old);
+        table_remove(old->tmpl->name, 0, cache);
+        free_single_job(old->tmpl);
+    }
+    job *tmpl = new_job();
+    tmpl->name = arena_strdup(tmpl->arena, j->name);
+    copy_job(tmpl, j);
+
+    cache_entry *e = arena_alloc(tmpl->arena, sizeof *e);
+    e->tmpl = tmpl;
+    table_add(tmpl->name, 0, e, cache);
+    push_front(e);
+}
+
+// Fill in j from the line in its name, of length len. Returns false if the
+// line does not parse into anything to run
+bool parse_job(job *j, size_t len)
+{
+    stat_span span = stat_begin();
+    cache_entry *e = cache ? table_find(j->name, 0, cache) : NULL;
+    if (e) {
+        copy_job(j, e->tmpl);
+        unlink_entry(e);
+        push_front(e);
+        stat_end_detail(STAT_PARSE, span, "cached", 6);
+        return true;
+    }
+
+    YY_BUFFER_STATE b = scan_line(j->arena, j->name, len);
+    bool ok = !yyparse(j) && j->valid;
+    Cleanup(b, yy_delete_buffer);
+    if (ok && cache) {
+        add_template(j);
+    }
+    stat_end(STAT_PARSE, span);
+    return ok;
+}
@@ -0,0 +1,32 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef M_PARSE_CACHE_H
+#define M_PARSE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "ds/proc.h" // job
+
+// Number of distinct lines whose parse is kept
+#define PARSE_CACHE_SIZE 128
+
+bool initialize_parse_cache(void);
+bool parse_job(job *j, size_t len);
+
+#endif
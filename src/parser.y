@@ -17,7 +17,9 @@
 */
 
 %{
+#include <ctype.h> // isdigit
 #include <errno.h> // errno
+#include <stdlib.h> // strtol
 #include <string.h>
 
 #include <fcntl.h> // read, write, O_*
@@ -25,9 +27,9 @@
 
 #include "execute.h" // builtin, lookup_table
 #include "ds/proc.h" // proc, job
-#include "ds/vec.h" // vec_append
-#include "lexer.h" // yylex (in bison generated code)
-#include "macros.h" // Stopif, Free
+#include "ds/vec.h" // vec_append, vec_alloc_arena, Vec_push
+#include "wildcard.h" // glob_literal
+#include "macros.h" // Stopif, Err_msg
 
 #define P_TRUNCATE (O_WRONLY | O_TRUNC | O_CREAT)
 #define P_APPEND (O_WRONLY | O_APPEND | O_CREAT)
@@ -35,16 +37,82 @@
 
 // I hate to use a macro for this but the lack of code duplication is worth it
 #define Add_io_mod(PATH, FD, OFLAG)                                                                 \
+    Add_io(FD, ((proc_io) {.kind = IO_FILE, .path = PATH, .oflag = OFLAG}), PATH)
+
+#define Add_io(FD, IO, WHAT)                                                                        \
     do {                                                                                            \
-        if (!p_job->io[FD].path) {                                                                  \
-            p_job->io[FD] = (proc_io) {.path = PATH, .oflag = OFLAG};                               \
+        if (p_job->io[FD].kind == IO_NONE) {                                                        \
+            p_job->io[FD] = IO;                                                                     \
         } else {                                                                                    \
             Err_msg("Taking/sending IO to/from more than one source not supported. "                \
-                    "Skipping \"%s\"", PATH);                                                       \
-            Free(PATH);                                                                             \
+                    "Skipping \"%s\"", WHAT);                                                       \
         }                                                                                           \
     } while (0)
 
+// Number at the start of the token tok, or dflt if it has none
+static int token_fd(char const *tok, int dflt)
+{
+    return isdigit((unsigned char) *tok) ? (int) strtol(tok, NULL, 10) : dflt;
+}
+
+// Descriptor that a dup or close token without a number applies to: stdin
+// for <&, stdout for >&
+static int dup_default_fd(char const *tok)
+{
+    char const *dir = strpbrk(tok, "<>");
+    return dir && *dir == '<' ? STDIN_FILENO : STDOUT_FILENO;
+}
+
+// Redirect descriptor fd to path (src REDIR_OPEN), to a copy of src, or close
+// it (src REDIR_CLOSE). Descriptors above 2 are kept with the last proc for
+// exec
+static void add_fd_io(job *p_job, int fd, char *path, int oflag, int src)
+{
+    if (fd > 2) {
+        fd_redir r = {.fd = fd, .src = src, .path = path, .oflag = oflag};
+        if (!P_LAST->redirs) {
+            P_LAST->redirs = vec_alloc_arena(sizeof r, p_job->arena);
+        }
+        Vec_push(&P_LAST->redirs, r);
+    } else if (src == REDIR_OPEN) {
+        Add_io_mod(path, fd, oflag);
+    } else if (src == REDIR_CLOSE) {
+        Err_msg("Closing fd %d is not supported. Skipping it", fd);
+    } else {
+        Add_io(fd, ((proc_io) {.kind = IO_DUP, .fd = src}), "dup");
+    }
+}
+
+// Make name the command of the last proc, which is complete now
+static void set_command(job *p_job, char *name)
+{
+    P_LAST->argv[0] = name;
+    // execve needs argv to be NULL terminated
+    Vec_push(&P_LAST->argv, NULL);
+}
+
+// Record that argument i of the last proc is to be expanded by expand_job
+// when the job is started
+static void add_expansion(job *p_job, size_t i, int kind)
+{
+    expansion e = {.arg = i, .kind = kind};
+    if (!P_LAST->expand) {
+        P_LAST->expand = vec_alloc_arena(sizeof e, p_job->arena);
+    }
+    Vec_push(&P_LAST->expand, e);
+}
+
+// True unless a proc other than exec has redirections of fds above 2
+static bool check_redirs(job *p_job)
+{
+    for (size_t i = 0; i < vec_len(p_job->procs); i++) {
+        proc *p = p_job->procs[i];
+        Stopif(p->redirs && strcmp(*p->argv, "exec") != 0, return false,
+               "%s: fds above 2 can only be redirected by exec", *p->argv);
+    }
+    return true;
+}
+
 int yyerror (job *w, char const *s);
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wincompatible-pointer-types"
@@ -54,6 +122,20 @@ int yyerror (job *w, char const *s);
 // Include marcel.h in .c file as well as header
 %code requires {
     #include "ds/proc.h"
+    // The lexer keeps the line being parsed in the arena of its job
+    #define YY_DECL int yylex(job *p_job)
+}
+
+%code provides {
+    // Copy len bytes of line into a and start scanning the copy. Tokens are
+    // NUL terminated and unescaped in place, so every string handed to the
+    // parser points into it (defined in lexer.l)
+    struct yy_buffer_state *scan_line(arena *a, char const *line, size_t len);
+}
+
+%code {
+    #include "lexer.h" // yy_* (YY_DECL has to be defined first)
+    YY_DECL;
 }
 
 %union {
@@ -61,13 +143,15 @@ int yyerror (job *w, char const *s);
 }
 
 %token <str> WORD ASSIGN 
-%token OUT_T OUT_ERR_T OUT_A OUT_ERR_A ERR_T ERR_A IN 
-%token NL PIPE BKG
+%token OUT_T OUT_ERR_T OUT_A OUT_ERR_A ERR_T ERR_A IN HERE_STR HERE_DOC
+%token <str> FD_OUT_T FD_OUT_A FD_IN FD_DUP FD_CLOSE CMD_SUB GLOB
+%token NL PIPE BKG TIME
 
-%type <str> real_arg
+%type <str> real_arg io_arg
 
 %define parse.error verbose
 %parse-param {job *p_job}
+%lex-param {job *p_job}
 
 %%
 
@@ -89,10 +173,17 @@ int yyerror (job *w, char const *s);
     /*;*/
 
 pipes_line:
-    pipes io_mods bkg {p_job->valid = true;}
+    timed pipes io_mods bkg {p_job->valid = check_redirs(p_job);}
     | 
     ;
 
+timed:
+    TIME {
+        p_job->timed = true;
+    }
+    |
+    ;
+
 bkg:
     BKG {
         p_job->bkg = true;
@@ -106,29 +197,60 @@ io_mods:
     ;
 
 io_mod:
-    IN real_arg {
+    IN io_arg {
         Add_io_mod($2, STDIN_FILENO, O_RDONLY);
     }
-    | OUT_T real_arg {
+    | OUT_T io_arg {
         Add_io_mod($2, STDOUT_FILENO, P_TRUNCATE); 
     }
-    | OUT_ERR_T real_arg {
+    | OUT_ERR_T io_arg {
         Add_io_mod($2, STDOUT_FILENO, P_TRUNCATE);
         Add_io_mod($2, STDERR_FILENO, P_TRUNCATE);
     }
-    | OUT_A real_arg {
+    | OUT_A io_arg {
         Add_io_mod($2, STDOUT_FILENO, P_APPEND);
     }
-    | OUT_ERR_A real_arg {
+    | OUT_ERR_A io_arg {
         Add_io_mod($2, STDOUT_FILENO, P_APPEND);
         Add_io_mod($2, STDERR_FILENO, P_APPEND);
     }
-    | ERR_A real_arg {
+    | ERR_A io_arg {
         Add_io_mod($2, STDERR_FILENO, P_APPEND);
     }
-    | ERR_T real_arg {
+    | ERR_T io_arg {
         Add_io_mod($2, STDERR_FILENO, P_TRUNCATE);
     }
+    | FD_OUT_T io_arg {
+        add_fd_io(p_job, token_fd($1, 1), $2, P_TRUNCATE, REDIR_OPEN);
+    }
+    | FD_OUT_A io_arg {
+        add_fd_io(p_job, token_fd($1, 1), $2, P_APPEND, REDIR_OPEN);
+    }
+    | FD_IN io_arg {
+        add_fd_io(p_job, token_fd($1, 0), $2, O_RDONLY, REDIR_OPEN);
+    }
+    | FD_DUP {
+        add_fd_io(p_job, token_fd($1, dup_default_fd($1)), NULL, 0,
+                  token_fd(strchr($1, '&') + 1, 0));
+    }
+    | FD_CLOSE {
+        add_fd_io(p_job, token_fd($1, dup_default_fd($1)), NULL, 0,
+                  REDIR_CLOSE);
+    }
+    | HERE_STR io_arg {
+        // Fed to stdin with a newline, like other shells do
+        size_t len = strlen($2);
+        char *text = arena_alloc(p_job->arena, len + 2);
+        memcpy(text, $2, len);
+        text[len] = '\n';
+        text[len + 1] = '\0';
+        Add_io(STDIN_FILENO, ((proc_io) {.kind = IO_HERE, .text = text,
+                                         .text_len = len + 1}), $2);
+    }
+    | HERE_DOC io_arg {
+        // The body is read from the lines that follow by the caller
+        Add_io(STDIN_FILENO, ((proc_io) {.kind = IO_HERE, .path = $2}), $2);
+    }
     ;
 
 pipes:
@@ -137,7 +259,15 @@ pipes:
     ;
 
 cmd:
-   envs WORD args {P_LAST->argv[0] = $2;}
+   envs WORD args {set_command(p_job, $2);}
+   | envs CMD_SUB args {
+        set_command(p_job, $2);
+        add_expansion(p_job, 0, EXPAND_SUB);
+    }
+   | envs GLOB args {
+        set_command(p_job, $2);
+        add_expansion(p_job, 0, EXPAND_GLOB);
+    }
    ;
 
 envs:
@@ -145,7 +275,7 @@ envs:
     | { // this is reached only before the first arg of each pipe 
         // e.g. the command:  var=val a b | c d | var2=val2 e f
         //                   ^             ^     ^    <-- reached in those places
-        proc *p = new_proc();
+        proc *p = new_proc(p_job->arena);
         vec_append(&p, sizeof (proc *), &(p_job->procs));
         char *null = NULL;
         vec_append(&null, sizeof (char *), &(P_LAST->argv));
@@ -154,12 +284,23 @@ envs:
 
 args:
     args real_arg {vec_append(&($2), sizeof (char*), &(P_LAST->argv));}
+    | args CMD_SUB {
+        add_expansion(p_job, vec_len(P_LAST->argv), EXPAND_SUB);
+        vec_append(&($2), sizeof (char*), &(P_LAST->argv));
+    }
+    | args GLOB {
+        add_expansion(p_job, vec_len(P_LAST->argv), EXPAND_GLOB);
+        vec_append(&($2), sizeof (char*), &(P_LAST->argv));
+    }
     | {}
     ;
 
 // Make things like `echo VAR=VAL` work as expected
 real_arg: WORD {$$ = $1;} | ASSIGN {$$ = $1;}
 
+// Redirection targets are never globbed
+io_arg: real_arg {$$ = $1;} | GLOB {$$ = glob_literal($1);}
+
 %%
 
 int yyerror (job *w, char const *s)
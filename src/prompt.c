@@ -0,0 +1,235 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE // pipe2
+
+#include <errno.h> // errno
+#include <stdio.h> // snprintf
+#include <stdlib.h> // getenv, atexit
+#include <string.h> // strdup, strcpy, memchr, memcmp
+
+#include <fcntl.h> // open, pipe2, O_*
+#include <pwd.h> // getpwuid
+#include <sys/wait.h> // waitpid
+#include <unistd.h> // getcwd, geteuid, fork, dup2, execl
+#include <linux/limits.h> // PATH_MAX
+
+#include "event.h" // event_add_fd, event_remove_fd
+#include "fdio.h" // shell_fd
+#include "jobs.h" // interactive
+#include "options.h" // Str_opt, OPT_PROMPTCMD
+#include "prompt.h" // prototypes
+#include "signals.h" // reset_ignored_signals, sig_setmask
+#include "stats.h" // stat_begin, stat_end, stat_end_detail
+#include "macros.h" // Stopif, Assert_alloc, Free, Arr_len
+
+#define MAX_PROMPT_LEN 1024
+// Longest output of an asynchronous segment that is shown
+#define MAX_SEGMENT_LEN 128
+
+// A part of the prompt computed by running a command in the background, for
+// things like VCS status that may take too long to wait for. The prompt is
+// shown without it (or with its last value) until the command's first line
+// of output arrives
+typedef struct segment {
+    int cmd_opt; // Option holding the command to run, none if empty
+    char text[MAX_SEGMENT_LEN + 1];
+    size_t len;
+    int fd; // Read end of the running command's output, -1 if none
+    bool stale; // Inputs changed while the command was running
+} segment;
+
+static segment segments[] = {
+    {.cmd_opt = OPT_PROMPTCMD, .fd = -1},
+};
+
+// The prompt is only rebuilt when one of its parts changes
+static char prompt_buf[MAX_PROMPT_LEN];
+static bool dirty = true;
+static int shown_code;
+static char *user;
+static char cwd[PATH_MAX];
+static char sym;
+static prompt_callback notify;
+
+static void cleanup_prompt(void);
+static void start_segment(segment *s);
+
+// Look up the parts of the prompt that don't change, and start the
+// asynchronous segments. on_change is called whenever one of them finishes
+void initialize_prompt(prompt_callback on_change)
+{
+    notify = on_change;
+    char const *name = getenv("USER");
+    if (!name) {
+        struct passwd const *pw = getpwuid(geteuid());
+        name = pw ? pw->pw_name : "?";
+    }
+    user = strdup(name);
+    Assert_alloc(user);
+    sym = geteuid() ? '$' : '#';
+    prompt_dir_changed();
+    atexit(cleanup_prompt);
+}
+
+static void cleanup_prompt(void)
+{
+    for (size_t i = 0; i < Arr_len(segments); i++) {
+        if (segments[i].fd >= 0) {
+            event_remove_fd(segments[i].fd);
+            close(segments[i].fd);
+        }
+    }
+    Free(user);
+}
+
+// Returns the prompt to show after a command exited with exit_code. The
+// string is owned by the prompt and valid until the next call
+char const *get_prompt(int exit_code)
+{
+    stat_span span = stat_begin();
+    if (!dirty && shown_code == (unsigned char) exit_code) {
+        stat_end_detail(STAT_PROMPT, span, "cached", 6);
+        return prompt_buf;
+    }
+    shown_code = (unsigned char) exit_code;
+    int len = snprintf(prompt_buf, sizeof prompt_buf, "%-3d [%s:%s]",
+                       shown_code, user, cwd);
+    for (size_t i = 0; i < Arr_len(segments); i++) {
+        segment const *s = &segments[i];
+        if (s->len && len >= 0 && (size_t) len < sizeof prompt_buf) {
+            len += snprintf(prompt_buf + len, sizeof prompt_buf - len, " (%s)",
+                            s->text);
+        }
+    }
+    if (len >= 0 && (size_t) len < sizeof prompt_buf) {
+        snprintf(prompt_buf + len, sizeof prompt_buf - len, " %c ", sym);
+    }
+    dirty = false;
+    stat_end(STAT_PROMPT, span);
+    return prompt_buf;
+}
+
+// To be called whenever the shell's working directory changes
+void prompt_dir_changed(void)
+{
+    if (!getcwd(cwd, sizeof cwd)) {
+        strcpy(cwd, "?");
+    }
+    dirty = true;
+    refresh_prompt();
+}
+
+// Recompute the asynchronous segments, e.g. because a command that may have
+// affected them has run. A segment whose command is still running is
+// recomputed once it finishes
+void refresh_prompt(void)
+{
+    // Subshells have no prompt to update
+    if (!interactive) {
+        return;
+    }
+    for (size_t i = 0; i < Arr_len(segments); i++) {
+        segment *s = &segments[i];
+        char const *cmd = Str_opt(s->cmd_opt);
+        if (!cmd || !*cmd) {
+            if (s->len) {
+                s->len = 0;
+                dirty = true;
+            }
+        } else if (s->fd >= 0) {
+            s->stale = true;
+        } else {
+            start_segment(s);
+        }
+    }
+}
+
+// Called once the command computing s has output something or exited. Only
+// what the first read returns is used, which is all of it for any command
+// printing a short line
+static void read_segment(int fd, void *data)
+{
+    segment *s = data;
+    char buf[MAX_SEGMENT_LEN + 1];
+    ssize_t n = read(fd, buf, sizeof buf);
+    if (n < 0 && errno == EINTR) {
+        return;
+    }
+    event_remove_fd(fd);
+    close(fd);
+    s->fd = -1;
+
+    size_t len = n > 0 ? n : 0;
+    char const *nl = memchr(buf, '\n', len);
+    if (nl) {
+        len = nl - buf;
+    }
+    len = len > MAX_SEGMENT_LEN ? MAX_SEGMENT_LEN : len;
+    if (len != s->len || memcmp(buf, s->text, len) != 0) {
+        memcpy(s->text, buf, len);
+        s->text[len] = '\0';
+        s->len = len;
+        dirty = true;
+        if (notify) {
+            notify();
+        }
+    }
+
+    if (s->stale) {
+        s->stale = false;
+        start_segment(s);
+    }
+}
+
+// Run s's command in the current directory with its output going to a pipe
+// read through the event loop. The command runs in a detached grandchild, so
+// the shell never has to reap it
+static void start_segment(segment *s)
+{
+    int fd[2];
+    // Commands started while it runs must not hold the pipe open
+    Stopif(pipe2(fd, O_CLOEXEC) < 0, return, "%s", strerror(errno));
+    pid_t pid = fork();
+    Stopif(pid < 0, close(fd[0]); close(fd[1]); return,
+           "Could not fork process: %s", strerror(errno));
+    if (pid == 0) {
+        if (fork() == 0) {
+            // Keep the terminal and its signals away from it
+            setsid();
+            reset_ignored_signals();
+            sigset_t none;
+            sigemptyset(&none);
+            sig_setmask(none);
+            int null = open("/dev/null", O_RDWR);
+            dup2(null, STDIN_FILENO);
+            dup2(fd[1], STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+            close(null);
+            close(fd[0]);
+            close(fd[1]);
+            execl("/bin/sh", "sh", "-c", Str_opt(s->cmd_opt), (char *) NULL);
+            _Exit(M_FAILED_EXEC);
+        }
+        _Exit(0);
+    }
+    close(fd[1]);
+    waitpid(pid, NULL, 0);
+    s->fd = shell_fd(fd[0]);
+    event_add_fd(s->fd, read_segment, s);
+}
@@ -0,0 +1,30 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef M_PROMPT_H
+#define M_PROMPT_H
+
+// Called when an asynchronous segment changes the prompt
+typedef void (*prompt_callback)(void);
+
+void initialize_prompt(prompt_callback on_change);
+char const *get_prompt(int exit_code);
+void prompt_dir_changed(void);
+void refresh_prompt(void);
+
+#endif
@@ -0,0 +1,383 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Per-job resource control. With the cgroup option set to a cgroup v2
+// directory the shell may write to (e.g. one delegated to the user by
+// systemd), every job gets a leaf of its own there, named after its process
+// group, with the cpumax and memmax limits applied to it. The cpus option pins
+// the procs of every job to a set of CPUs. Both are applied by each proc to
+// itself between fork and exec, so nothing it starts can get away from them.
+
+#define _GNU_SOURCE // cpu_set_t, CPU_*, sched_setaffinity, dprintf
+
+#include <errno.h> // errno
+#include <stdio.h> // snprintf, dprintf
+#include <stdlib.h> // strtol, strtoull, strtoll
+#include <string.h> // strerror, strcmp, strncmp
+
+#include <fcntl.h> // open, O_*
+#include <sched.h> // sched_setaffinity, cpu_set_t, CPU_*
+#include <sys/resource.h> // getrlimit, setrlimit, RLIMIT_*
+#include <sys/stat.h> // mkdir
+#include <unistd.h> // read, write, close, rmdir, getpid
+#include <linux/limits.h> // PATH_MAX
+
+#include "ds/vec.h" // vec_len
+#include "options.h" // Str_opt, OPT_CGROUP, OPT_CPUMAX, OPT_MEMMAX, OPT_CPUS
+#include "resources.h" // prototypes
+#include "macros.h" // Stopif, Err_msg, Arr_len
+
+// CPUs jobs are pinned to, if use_affinity is set
+static cpu_set_t affinity;
+static bool use_affinity;
+
+static bool parse_cpus(char const *list, cpu_set_t *set);
+
+// Add the CPUs of NUMA node `node` to set. Returns false if there is no such
+// node
+static bool add_node_cpus(long node, cpu_set_t *set)
+{
+    char path[64];
+    snprintf(path, sizeof path, "/sys/devices/system/node/node%ld/cpulist",
+             node);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    char buf[4096];
+    ssize_t n = read(fd, buf, sizeof buf - 1);
+    close(fd);
+    if (n <= 0) {
+        return false;
+    }
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return parse_cpus(buf, set);
+}
+
+// Add the CPUs in list to set. list is comma separated, each entry being a CPU
+// number, a range like 4-7, or nodeN for all CPUs of NUMA node N
+static bool parse_cpus(char const *list, cpu_set_t *set)
+{
+    char const *s = list;
+    while (*s) {
+        char *end;
+        if (strncmp(s, "node", 4) == 0) {
+            long node = strtol(s + 4, &end, 10);
+            if (end == s + 4 || node < 0 || !add_node_cpus(node, set)) {
+                return false;
+            }
+        } else {
+            long lo = strtol(s, &end, 10), hi = lo;
+            if (end == s || lo < 0) {
+                return false;
+            }
+            if (*end == '-') {
+                char const *h = end + 1;
+                hi = strtol(h, &end, 10);
+                if (end == h || hi < lo) {
+                    return false;
+                }
+            }
+            if (hi >= CPU_SETSIZE) {
+                return false;
+            }
+            for (long cpu = lo; cpu <= hi; cpu++) {
+                CPU_SET(cpu, set);
+            }
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end) {
+            return false;
+        }
+        s = end;
+    }
+    return true;
+}
+
+// Parse the cpus option. Jobs aren't pinned while it is empty or invalid
+void update_affinity(void)
+{
+    char const *cpus = Str_opt(OPT_CPUS);
+    use_affinity = false;
+    if (!cpus || !*cpus) {
+        return;
+    }
+    CPU_ZERO(&affinity);
+    Stopif(!parse_cpus(cpus, &affinity) || !CPU_COUNT(&affinity), return,
+           "cpus: not a list of CPUs or NUMA nodes: %s", cpus);
+    use_affinity = true;
+}
+
+// Write value to the file name in cgroup directory dir. Returns false with
+// errno set on failure
+static bool write_cgroup_file(char const *dir, char const *name,
+                              char const *value)
+{
+    char path[PATH_MAX];
+    if ((size_t) snprintf(path, sizeof path, "%s/%s", dir, name)
+        >= sizeof path) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    size_t len = strlen(value);
+    bool ok = write(fd, value, len) == (ssize_t) len;
+    int err = errno;
+    close(fd);
+    errno = err;
+    return ok;
+}
+
+// Read the file name in cgroup directory dir into buf as a string. Returns
+// false on failure
+static bool read_cgroup_file(char const *dir, char const *name, char *buf,
+                             size_t size)
+{
+    char path[PATH_MAX];
+    if ((size_t) snprintf(path, sizeof path, "%s/%s", dir, name)
+        >= sizeof path) {
+        return false;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) {
+        return false;
+    }
+    buf[n] = '\0';
+    return true;
+}
+
+// Path of the leaf cgroup of j, whose first proc is first_pid, in buf. Without
+// job control there is no process group to name the cgroup after. Returns
+// false if it doesn't fit
+static bool job_cgroup_path(job const *j, pid_t first_pid, char *buf)
+{
+    pid_t id = j->pgid ? j->pgid : first_pid;
+    if ((size_t) snprintf(buf, PATH_MAX, "%s/job-%d", Str_opt(OPT_CGROUP), id)
+        >= PATH_MAX) {
+        Err_msg("cgroup: path too long: %s", Str_opt(OPT_CGROUP));
+        return false;
+    }
+    return true;
+}
+
+// True if jobs are under any resource control, in which case their procs
+// have to be forked so that they can be placed before they exec
+bool job_resources_active(void)
+{
+    return use_affinity || (Str_opt(OPT_CGROUP) && *Str_opt(OPT_CGROUP));
+}
+
+// Move the calling process, a child of the shell about to become a proc of j,
+// under the job-level controls. The first proc of j creates the job's cgroup
+// and applies the limits to it. A limit that can't be set (most often because
+// its controller isn't enabled in the parent's cgroup.subtree_control) is
+// reported but leaves the cgroup in use
+void enter_job_resources(job const *j)
+{
+    if (use_affinity) {
+        Stopif(sched_setaffinity(0, sizeof affinity, &affinity) < 0,
+               /* No action */, "cpus: %s", strerror(errno));
+    }
+    char const *root = Str_opt(OPT_CGROUP);
+    if (!root || !*root) {
+        return;
+    }
+    pid_t first = vec_len(j->procs) && j->procs[0]->pid ? j->procs[0]->pid
+                                                         : getpid();
+    char path[PATH_MAX];
+    if (!job_cgroup_path(j, first, path)) {
+        return;
+    }
+    if (mkdir(path, 0755) == 0) {
+        struct {
+            char const *file;
+            int opt;
+        } const files[] = {
+            {"cpu.max", OPT_CPUMAX},
+            {"memory.max", OPT_MEMMAX},
+        };
+        for (size_t i = 0; i < Arr_len(files); i++) {
+            char const *value = Str_opt(files[i].opt);
+            if (value && *value) {
+                Stopif(!write_cgroup_file(path, files[i].file, value),
+                       /* No action */, "cgroup: %s: %s", files[i].file,
+                       strerror(errno));
+            }
+        }
+    } else if (errno != EEXIST) {
+        Err_msg("cgroup: %s: %s", path, strerror(errno));
+        return;
+    }
+    // 0 is the writer itself
+    Stopif(!write_cgroup_file(path, "cgroup.procs", "0"), /* No action */,
+           "cgroup: %s: %s", path, strerror(errno));
+}
+
+// Record the cgroup of j once its first proc, pid, has been created. Run in
+// the shell after the proc's process group has been set
+void place_proc(job *j, pid_t pid)
+{
+    char const *root = Str_opt(OPT_CGROUP);
+    if (j->cgroup || !root || !*root) {
+        return;
+    }
+    char path[PATH_MAX];
+    if (job_cgroup_path(j, pid, path)) {
+        j->cgroup = arena_strdup(j->arena, path);
+    }
+}
+
+// Remove the cgroup of j, all of whose procs have been reaped. If something
+// it started is still around the cgroup stays, and is left for it
+void release_job_resources(job const *j)
+{
+    if (j->cgroup) {
+        rmdir(j->cgroup);
+    }
+}
+
+// Find the CPU time and memory used by j's cgroup so far. mem_bytes is -1 if
+// the memory controller isn't enabled for it. Returns false if j has no cgroup
+bool cgroup_usage(job const *j, double *cpu_secs, long long *mem_bytes)
+{
+    if (!j->cgroup) {
+        return false;
+    }
+    // cpu.stat is always there, starting with the usage_usec line
+    char buf[256];
+    if (!read_cgroup_file(j->cgroup, "cpu.stat", buf, sizeof buf)
+        || strncmp(buf, "usage_usec ", 11) != 0) {
+        return false;
+    }
+    *cpu_secs = strtoull(buf + 11, NULL, 10) / 1e6;
+    *mem_bytes = read_cgroup_file(j->cgroup, "memory.current", buf, sizeof buf)
+                 ? strtoll(buf, NULL, 10) : -1;
+    return true;
+}
+
+typedef struct limit_info {
+    char opt; // Option letter of ulimit
+    int resource; // RLIMIT_*
+    rlim_t unit; // Bytes (or count) of one unit shown and set by ulimit
+    char const *desc;
+} limit_info;
+
+static limit_info const limits[] = {
+    {'c', RLIMIT_CORE, 1024, "core file size (kB)"},
+    {'d', RLIMIT_DATA, 1024, "data segment size (kB)"},
+    {'f', RLIMIT_FSIZE, 1024, "file size (kB)"},
+    {'l', RLIMIT_MEMLOCK, 1024, "locked memory (kB)"},
+    {'n', RLIMIT_NOFILE, 1, "open files"},
+    {'s', RLIMIT_STACK, 1024, "stack size (kB)"},
+    {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+    {'u', RLIMIT_NPROC, 1, "processes"},
+    {'v', RLIMIT_AS, 1024, "virtual memory (kB)"},
+};
+
+static void print_limit(int out, limit_info const *l, bool hard, bool desc)
+{
+    struct rlimit rl;
+    Stopif(getrlimit(l->resource, &rl) < 0, return,
+           "ulimit: %s", strerror(errno));
+    rlim_t value = hard ? rl.rlim_max : rl.rlim_cur;
+    if (desc) {
+        dprintf(out, "%-24s(-%c) ", l->desc, l->opt);
+    }
+    if (value == RLIM_INFINITY) {
+        dprintf(out, "unlimited\n");
+    } else {
+        dprintf(out, "%llu\n", (unsigned long long) (value / l->unit));
+    }
+}
+
+// ulimit [-HS] [-a | -c | -d | -f | -l | -n | -s | -t | -u | -v] [limit]
+// Show or set a resource limit of the shell, which every command started from
+// then on inherits. -H is the hard limit, -S the soft one; the one shown is the
+// soft limit unless -H is given, while setting without either sets both. The
+// limit is a number in the units -a shows, or unlimited. -f is the default
+int m_ulimit(proc const *p)
+{
+    bool hard = false, soft = false, all = false;
+    limit_info const *l = NULL;
+    char **args = p->argv + 1;
+    for (; *args && **args == '-' && (*args)[1]; args++) {
+        for (char const *c = *args + 1; *c; c++) {
+            if (*c == 'H') {
+                hard = true;
+            } else if (*c == 'S') {
+                soft = true;
+            } else if (*c == 'a') {
+                all = true;
+            } else {
+                l = NULL;
+                for (size_t i = 0; i < Arr_len(limits) && !l; i++) {
+                    l = limits[i].opt == *c ? &limits[i] : NULL;
+                }
+                Stopif(!l, return 1, "ulimit: unknown option -%c", *c);
+            }
+        }
+    }
+    Stopif((all && (l || *args)) || (*args && args[1]), return 1,
+           "usage: ulimit [-HS] [-a | -cdflnstuv] [limit]");
+    if (all) {
+        for (size_t i = 0; i < Arr_len(limits); i++) {
+            print_limit(p->fds[1], &limits[i], hard, true);
+        }
+        return 0;
+    }
+    if (!l) {
+        l = &limits[2]; // -f
+    }
+    if (!*args) {
+        print_limit(p->fds[1], l, hard, false);
+        return 0;
+    }
+
+    rlim_t value = RLIM_INFINITY;
+    if (strcmp(*args, "unlimited") != 0) {
+        char *end;
+        errno = 0;
+        unsigned long long num = strtoull(*args, &end, 10);
+        Stopif(errno || !**args || *end || **args == '-'
+               || num > (RLIM_INFINITY - 1) / l->unit, return 1,
+               "ulimit: invalid limit: %s", *args);
+        value = num * l->unit;
+    }
+    struct rlimit rl;
+    Stopif(getrlimit(l->resource, &rl) < 0, return 1,
+           "ulimit: %s", strerror(errno));
+    if (hard || !soft) {
+        rl.rlim_max = value;
+    }
+    if (soft || !hard) {
+        rl.rlim_cur = value;
+    }
+    Stopif(setrlimit(l->resource, &rl) < 0, return 1,
+           "ulimit: %s", strerror(errno));
+    return 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef M_RESOURCES_H
+#define M_RESOURCES_H
+
+#include <stdbool.h> // bool
+#include <sys/types.h> // pid_t
+
+#include "ds/proc.h" // job, proc
+
+void update_affinity(void);
+bool job_resources_active(void);
+void enter_job_resources(job const *j);
+void place_proc(job *j, pid_t pid);
+void release_job_resources(job const *j);
+bool cgroup_usage(job const *j, double *cpu_secs, long long *mem_bytes);
+int m_ulimit(proc const *p);
+
+#endif
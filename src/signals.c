@@ -19,45 +19,75 @@
 // NOTE: Much of the below was inspired by the signal handling found in Z Shell
 // (particularly the helper functions and signal queue)
 
+#include <errno.h> // errno
+#include <stdbool.h>
 #include <stdio.h>
-#include <stdint.h>
+#include <stdint.h> // uint64_t
 
+#include <fcntl.h> // fcntl, O_NONBLOCK, FD_CLOEXEC
 #include <signal.h>
+#include <unistd.h> // pipe, read, write
+#ifdef __linux__
+#include <sys/signalfd.h> // signalfd, signalfd_siginfo
+#endif
 
+#include "fdio.h"
 #include "jobs.h"
 #include "macros.h"
 #include "signals.h"
 
-// SIG_ATOMIC_MAX is only guaranteed to be at least 127
-#if ((SIG_ATOMIC_MAX - 1) < 1024)
-#define MAX_QUEUE_SIZE ((size_t) SIG_ATOMIC_MAX)
-#else
-#define MAX_QUEUE_SIZE ((size_t) 1024)
-#endif
+// signalfd_siginfo records read at once
+#define SIGNALFD_BATCH 16
+
+// Where watch_signals can't get a signalfd, caught signals are recorded in a
+// ring written by handler_async and read by run_queued_signals. The handler is
+// the only producer (it runs with every signal blocked, so it never interrupts
+// itself) and the main flow the only consumer, so the ring needs ordered loads
+// and stores but no locking. Its size must be a power of two
+#define RING_SIZE 256
+#define RING_MASK (RING_SIZE - 1)
+
+// Record flags
+enum {
+    AFTER_DROP = (1 << 0), // Signals were dropped because the ring was full
+};
 
-typedef struct sigstate {
-    int sig;
-    sigset_t mask;
-    sig_atomic_t flags;
-} sigstate;
+typedef struct sig_record {
+    unsigned char signo;
+    unsigned char flags;
+} sig_record;
 
-static void handler_sync(sigstate state);
 static void handler_async(int signo);
 
-// Buffer to allow jumps out of signal handler
-sigjmp_buf sigbuf;
+static sig_record ring[RING_SIZE];
+// Free running, masked on access. Only the handler writes ring_tail and only
+// the main flow writes ring_head
+static unsigned ring_head, ring_tail;
+// Written by the handler only
+static bool dropped;
 
-sig_atomic_t volatile queue_front, queue_back;
-sigstate volatile signal_queue[MAX_QUEUE_SIZE];
+// Signals whose handling doesn't depend on how many times they arrived are
+// kept as a pending bit instead. One reap pass takes care of every SIGCHLD
+static uint64_t pending;
+static int const coalesced_signals[] = {SIGCHLD, SIGWINCH};
 
-// Bitmask passed to signal handler
-sig_atomic_t volatile sig_flags;
+static sig_stats stats;
+
+#ifdef __linux__
+// signalfd for the watched signals, -1 if the self-pipe is used instead
+static int sig_fd = -1;
+#endif
+// Written to by handler_async to wake up the event loop
+static int self_pipe[2] = {-1, -1};
 
 void sig_handle(int sig)
 {
     struct sigaction act = {{0}};
-    sigemptyset(&act.sa_mask);
+    // Blocked by the kernel for the duration of the handler, see ring
+    sigfillset(&act.sa_mask);
     act.sa_handler = handler_async;
+    // Don't make waitpid, read etc. fail with EINTR
+    act.sa_flags = SA_RESTART;
     sigaction(sig, &act, NULL);
 }
 
@@ -103,58 +133,199 @@ void sig_default(int sig)
     signal(sig, SIG_DFL);
 }
 
-// Signal queueing
-void run_queued_signals(void)
+static bool coalesces(int signo)
 {
-    while (queue_front != queue_back) {
-        queue_front = (queue_front + 1) % MAX_QUEUE_SIZE;
-        handler_sync(signal_queue[queue_front]);
+    for (size_t i = 0; i < Arr_len(coalesced_signals); i++) {
+        if (coalesced_signals[i] == signo) {
+            return true;
+        }
     }
+    return false;
+}
+
+static inline uint64_t sig_bit(int signo)
+{
+    return (uint64_t) 1 << signo;
+}
+
+// Call handler for every signal caught by handler_async since the last call.
+// Coalesced signals are handled first, once each
+void run_queued_signals(void (*handler)(int))
+{
+    uint64_t set = __atomic_exchange_n(&pending, 0, __ATOMIC_ACQUIRE);
+    for (int signo = 1; set; signo++) {
+        if (set & sig_bit(signo)) {
+            set &= ~sig_bit(signo);
+            handler(signo);
+        }
+    }
+
+    unsigned tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+    for (unsigned head = ring_head; head != tail; head++) {
+        sig_record r = ring[head & RING_MASK];
+        // The slot may be reused as soon as head moves past it
+        __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+        Stopif(r.flags & AFTER_DROP, /* No action */,
+               "At least one signal was not handled because signal queue was full");
+        // Already taken by sig_wait
+        if (r.signo) {
+            handler(r.signo);
+        }
+    }
+}
+
+// Take a signal in set that handler_async has recorded, so that
+// run_queued_signals won't see it. Returns 0 if there is none
+static int take_queued(sigset_t const *set)
+{
+    for (size_t i = 0; i < Arr_len(coalesced_signals); i++) {
+        int signo = coalesced_signals[i];
+        if (sigismember(set, signo)
+            && __atomic_fetch_and(&pending, ~sig_bit(signo), __ATOMIC_ACQUIRE)
+               & sig_bit(signo)) {
+            return signo;
+        }
+    }
+    unsigned tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+    for (unsigned head = ring_head; head != tail; head++) {
+        // The handler only writes past tail, so this slot is the main flow's
+        sig_record *r = &ring[head & RING_MASK];
+        if (r->signo && sigismember(set, r->signo)) {
+            int signo = r->signo;
+            r->signo = 0;
+            return signo;
+        }
+    }
+    return 0;
 }
 
 static void handler_async(int signo)
 {
-    // Block all signals while we see about queueing
-    sigset_t new;
-    sigfillset(&new);
-    sigset_t old = sig_block(new);
-
-    sig_atomic_t temp = ++queue_back % MAX_QUEUE_SIZE;
-    if (temp != queue_front) {
-        queue_back = temp;
-        signal_queue[queue_back] = (sigstate) {
-            .sig = signo, .mask = old, .flags = sig_flags,
-        };
+    if (coalesces(signo)) {
+        uint64_t was = __atomic_fetch_or(&pending, sig_bit(signo),
+                                         __ATOMIC_RELEASE);
+        if (was & sig_bit(signo)) {
+            __atomic_add_fetch(&stats.coalesced, 1, __ATOMIC_RELAXED);
+        }
     } else {
-        // This really shouldn't ever happen
-        sig_flags |= QUEUE_FULL;
+        unsigned tail = ring_tail;
+        if (tail - __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) == RING_SIZE) {
+            dropped = true;
+            __atomic_add_fetch(&stats.dropped, 1, __ATOMIC_RELAXED);
+        } else {
+            ring[tail & RING_MASK] = (sig_record) {
+                .signo = signo, .flags = dropped ? AFTER_DROP : 0,
+            };
+            dropped = false;
+            __atomic_store_n(&ring_tail, tail + 1, __ATOMIC_RELEASE);
+        }
     }
+    __atomic_add_fetch(&stats.caught, 1, __ATOMIC_RELAXED);
 
-    if (sig_flags & WAITING_FOR_INPUT) {
-        if (signo == SIGINT) {
-            sig_flags |= NO_RESTORE;
-        }
-        siglongjmp(sigbuf, 1);
+    // Wake up the event loop. If the pipe is full it's awake already
+    if (self_pipe[1] != -1) {
+        int saved_errno = errno;
+        (void) !write(self_pipe[1], "", 1);
+        errno = saved_errno;
+    }
+}
+
+// Counts of signals caught, and of those coalesced into one already pending
+// or dropped because the queue was full
+sig_stats signal_stats(void)
+{
+    return (sig_stats) {
+        .caught = __atomic_load_n(&stats.caught, __ATOMIC_RELAXED),
+        .coalesced = __atomic_load_n(&stats.coalesced, __ATOMIC_RELAXED),
+        .dropped = __atomic_load_n(&stats.dropped, __ATOMIC_RELAXED),
+    };
+}
+
+static bool set_fd_flags(int fd)
+{
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != -1
+        && fcntl(fd, F_SETFD, FD_CLOEXEC) != -1;
+}
+
+// Arrange for the n signals in sigs to be delivered through a file descriptor
+// instead of interrupting the shell. On Linux this is a signalfd (the signals
+// are blocked), elsewhere or if that fails a self-pipe written to by the
+// queueing handler.
+// Returns the fd to watch for reading, or -1 on failure
+int watch_signals(int const *sigs, size_t n)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    for (size_t i = 0; i < n; i++) {
+        sigaddset(&set, sigs[i]);
     }
-    // Process automatically restores mask when handler returns
-    // sig_setmask(old);
 
+#ifdef __linux__
+    sigset_t old = sig_block(set);
+    sig_fd = shell_fd(signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC));
+    if (sig_fd != -1) {
+        return sig_fd;
+    }
+    sig_setmask(old);
+#endif
+
+    Stopif(pipe(self_pipe) == -1, return -1, "%s", strerror(errno));
+    self_pipe[0] = shell_fd(self_pipe[0]);
+    self_pipe[1] = shell_fd(self_pipe[1]);
+    Stopif(!set_fd_flags(self_pipe[0]) || !set_fd_flags(self_pipe[1]),
+           return -1, "%s", strerror(errno));
+    for (size_t i = 0; i < n; i++) {
+        sig_handle(sigs[i]);
+    }
+    return self_pipe[0];
 }
 
-static void handler_sync(sigstate state)
+// Wait for one of the signals in set and return it, or -1 on failure. It is
+// taken, so that read_signals won't pass it on as well
+int sig_wait(sigset_t set)
 {
-    sigset_t old = sig_setmask(state.mask);
-    Stopif(sig_flags & QUEUE_FULL, sig_flags &= ~QUEUE_FULL,
-           "At least one signal was not handled because signal queue was full");
-    switch (state.sig) {
-    case SIGINT:
-        exit_code = M_SIGINT;
-        break;
-    case SIGCHLD:
-        exit_code = report_job_status();
-        break;
+    // While blocked a signal stays pending for sigwait, instead of going to
+    // the signalfd or handler_async. One the handler recorded before that is
+    // taken from the queue
+    sigset_t old = sig_block(set);
+    int sig = take_queued(&set);
+    if (!sig && sigwait(&set, &sig) != 0) {
+        sig = -1;
     }
     sig_setmask(old);
+    return sig;
+}
+
+// Call handler for every signal that has arrived on fd (as returned by
+// watch_signals) since the last call
+void read_signals(int fd, void (*handler)(int))
+{
+#ifdef __linux__
+    if (fd == sig_fd) {
+        struct signalfd_siginfo info[SIGNALFD_BATCH];
+        ssize_t n;
+        while ((n = read(fd, info, sizeof info)) > 0) {
+            // Everything in a batch was pending before any of it is handled
+            uint64_t seen = 0;
+            for (size_t i = 0; i < n / sizeof *info; i++) {
+                int signo = info[i].ssi_signo;
+                stats.caught++;
+                if (coalesces(signo)) {
+                    if (seen & sig_bit(signo)) {
+                        stats.coalesced++;
+                        continue;
+                    }
+                    seen |= sig_bit(signo);
+                }
+                handler(signo);
+            }
+        }
+        return;
+    }
+#endif
+    char buf[64];
+    while (read(fd, buf, sizeof buf) > 0);
+    run_queued_signals(handler);
 }
 
 static int ignored_signals[] = {SIGTTOU, SIGTTIN, SIGTSTP};
@@ -165,16 +336,30 @@ void initialize_signal_handling(void)
         for (size_t i = 0; i < Arr_len(ignored_signals); i++) {
             sig_ignore(ignored_signals[i]);
         }
-
-        sig_handle(SIGINT);
     }
 }
 
+// Restore default actions for the signals the shell ignores. Meant to be run
+// in a child before it execs
 void reset_ignored_signals(void)
 {
     if (interactive) {
         for (size_t i = 0; i < Arr_len(ignored_signals); i++) {
-            sig_ignore(ignored_signals[i]);
+            sig_default(ignored_signals[i]);
+        }
+    }
+}
+
+// Set of the signals reset_ignored_signals restores, for use with
+// posix_spawnattr_setsigdefault
+sigset_t ignored_signal_set(void)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    if (interactive) {
+        for (size_t i = 0; i < Arr_len(ignored_signals); i++) {
+            sigaddset(&set, ignored_signals[i]);
         }
     }
+    return set;
 }
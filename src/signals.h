@@ -20,24 +20,24 @@
 #define MARCEL_SIG_H
 
 #include <signal.h>
-#include <setjmp.h>
+#include <stddef.h>
 
-// This variable is only accessed via the two macros below
-extern sigjmp_buf sigbuf;
-
-extern sig_atomic_t volatile sig_flags;
-enum {
-    WAITING_FOR_INPUT = (1 << 0), // Process was waiting for input when it recieved signal
-    QUEUE_FULL = (1 << 1),
-    NO_RESTORE = (1 << 2), // Don't restore readline prompt when jumping
-    // To be continued...
-};
+typedef struct sig_stats {
+    unsigned long caught;
+    unsigned long coalesced; // Merged into one of the same kind still pending
+    unsigned long dropped; // Lost because the queue was full
+} sig_stats;
 
 void initialize_signal_handling(void);
 void reset_ignored_signals(void);
+sigset_t ignored_signal_set(void);
 void sig_default(int sig);
 void sig_handle(int sig);
 sigset_t sig_block(sigset_t old);
 sigset_t sig_setmask(sigset_t old);
-void run_queued_signals(void);
+void run_queued_signals(void (*handler)(int));
+int watch_signals(int const *sigs, size_t n);
+void read_signals(int fd, void (*handler)(int));
+int sig_wait(sigset_t set);
+sig_stats signal_stats(void);
 #endif
@@ -0,0 +1,249 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Counters and timers for the shell's own hot paths, which profiling with
+// -pg can't tell apart from time spent waiting on children. Sections are
+// bracketed by stat_begin and stat_end; the stats builtin shows the totals.
+//
+// With the tracefile option set every section is also written to that file as
+// a Chrome trace event, which chrome://tracing and Perfetto both load. The
+// file is a JSON array left unterminated, as the format allows, so shells can
+// keep appending to it. Events are buffered and written out after each
+// command line.
+
+#define _GNU_SOURCE // dprintf
+
+#include <errno.h> // errno
+#include <fcntl.h> // open, O_*
+#include <stdio.h> // snprintf, dprintf
+#include <string.h> // strcmp, strerror, memset
+#include <time.h> // clock_gettime
+#include <unistd.h> // write, close, getpid
+
+#include "ds/arena.h" // arena_totals
+#include "fdio.h" // shell_fd
+#include "options.h" // Str_opt, OPT_TRACEFILE
+#include "signals.h" // signal_stats
+#include "stats.h" // prototypes
+#include "macros.h" // Stopif, Err_msg, Arr_len
+
+// Trace events buffered before they are written
+#define TRACE_BUF_SIZE (64 * 1024)
+// Room needed for one event besides its detail
+#define TRACE_EVENT_MAX 160
+
+typedef struct stat_counter {
+    size_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    size_t allocs;
+} stat_counter;
+
+static char const *const stat_names[N_STATS] = {
+    [STAT_COMMAND] = "command",
+    [STAT_PARSE] = "parse",
+    [STAT_LAUNCH] = "launch",
+    [STAT_REDIRECT] = "redirect",
+    [STAT_PIPE] = "pipe",
+    [STAT_SPAWN] = "spawn",
+    [STAT_REAP] = "reap",
+    [STAT_PROMPT] = "prompt",
+    [STAT_HISTORY] = "history",
+    [STAT_SUBST] = "subst",
+    [STAT_GLOB] = "glob",
+};
+
+static stat_counter counters[N_STATS];
+
+static int trace_fd = -1;
+static char trace_buf[TRACE_BUF_SIZE];
+static size_t trace_len;
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+stat_span stat_begin(void)
+{
+    return (stat_span) {.start_ns = now_ns(), .allocs = arena_totals().allocs};
+}
+
+static void flush_trace(void)
+{
+    if (trace_fd < 0 || !trace_len) {
+        return;
+    }
+    Stopif(write(trace_fd, trace_buf, trace_len) < 0, /* No action */,
+           "%s: %s", Str_opt(OPT_TRACEFILE), strerror(errno));
+    trace_len = 0;
+}
+
+// Append the string literal STR to the trace buffer, which has room for it
+#define Trace_append(STR)                                       \
+    do {                                                        \
+        memcpy(trace_buf + trace_len, STR, sizeof STR - 1);     \
+        trace_len += sizeof STR - 1;                            \
+    } while (0)
+
+// What trace_event appends after the detail string
+#define TRACE_DETAIL_END "\"}},\n"
+
+// Append len bytes of str to the trace buffer as the contents of a JSON
+// string, cut short once there would be no room left for the longest escape
+// (and the NUL snprintf writes after it) followed by the end of the event
+static void trace_escaped(char const *str, size_t len)
+{
+    size_t const reserve = sizeof "\\u0000" + sizeof TRACE_DETAIL_END - 1;
+    for (size_t i = 0; i < len && trace_len + reserve <= sizeof trace_buf;
+         i++) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            trace_buf[trace_len++] = '\\';
+            trace_buf[trace_len++] = c;
+        } else if (c < 0x20) {
+            trace_len += snprintf(trace_buf + trace_len, 7, "\\u%04x", c);
+        } else {
+            trace_buf[trace_len++] = c;
+        }
+    }
+}
+
+// Add a complete ("X") event for section id, which took from start to end,
+// with the detail_len bytes of detail (may be NULL) as its argument
+static void trace_event(stat_id id, uint64_t start, uint64_t end,
+                        char const *detail, size_t detail_len)
+{
+    // Commands longer than the whole buffer are cut short
+    if (trace_len + TRACE_EVENT_MAX + 6 * detail_len > sizeof trace_buf) {
+        flush_trace();
+    }
+    trace_len += snprintf(trace_buf + trace_len, sizeof trace_buf - trace_len,
+                          "{\"name\":\"%s\",\"cat\":\"marcel\",\"ph\":\"X\","
+                          "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+                          stat_names[id], start / 1e3, (end - start) / 1e3,
+                          (int) getpid(), (int) getpid());
+    if (detail) {
+        Trace_append(",\"args\":{\"detail\":\"");
+        trace_escaped(detail, detail_len);
+        Trace_append(TRACE_DETAIL_END);
+    } else {
+        Trace_append("},\n");
+    }
+}
+
+// Add the section started at s to the counters of id, with the len bytes of
+// detail describing it in the trace
+void stat_end_detail(stat_id id, stat_span s, char const *detail, size_t len)
+{
+    uint64_t end = now_ns();
+    uint64_t ns = end - s.start_ns;
+    stat_counter *c = &counters[id];
+    c->count++;
+    c->total_ns += ns;
+    c->allocs += arena_totals().allocs - s.allocs;
+    if (ns > c->max_ns) {
+        c->max_ns = ns;
+    }
+    if (trace_fd >= 0) {
+        trace_event(id, s.start_ns, end, detail, len);
+        if (id == STAT_COMMAND) {
+            flush_trace();
+        }
+    }
+}
+
+void stat_end(stat_id id, stat_span s)
+{
+    stat_end_detail(id, s, NULL, 0);
+}
+
+// Open the file named by the tracefile option, closing the previous one
+void update_trace(void)
+{
+    flush_trace();
+    if (trace_fd >= 0) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    char const *path = Str_opt(OPT_TRACEFILE);
+    if (!path || !*path) {
+        return;
+    }
+    trace_fd = shell_fd(open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                             0644));
+    Stopif(trace_fd < 0, return, "%s: %s", path, strerror(errno));
+    // A new file starts the array the events are elements of
+    if (lseek(trace_fd, 0, SEEK_END) == 0) {
+        Stopif(write(trace_fd, "[\n", 2) < 0, /* No action */,
+               "%s: %s", path, strerror(errno));
+    }
+}
+
+// Print time in the most readable unit, in a column of width 10
+static void print_ns(int out, double ns)
+{
+    if (ns < 1e3) {
+        dprintf(out, " %7.0fns", ns);
+    } else if (ns < 1e6) {
+        dprintf(out, " %7.2fus", ns / 1e3);
+    } else if (ns < 1e9) {
+        dprintf(out, " %7.2fms", ns / 1e6);
+    } else {
+        dprintf(out, " %8.2fs", ns / 1e9);
+    }
+}
+
+static int print_stats(int out)
+{
+    dprintf(out, "%-10s %8s %10s %10s %10s %10s\n", "section", "count",
+            "total", "mean", "max", "allocs");
+    for (size_t i = 0; i < N_STATS; i++) {
+        stat_counter const *c = &counters[i];
+        dprintf(out, "%-10s %8zu", stat_names[i], c->count);
+        print_ns(out, c->total_ns);
+        print_ns(out, c->count ? (double) c->total_ns / c->count : 0);
+        print_ns(out, c->max_ns);
+        dprintf(out, " %10zu\n", c->allocs);
+    }
+    sig_stats sig = signal_stats();
+    dprintf(out, "signals: %lu caught, %lu coalesced, %lu dropped\n",
+            sig.caught, sig.coalesced, sig.dropped);
+    arena_stats a = arena_totals();
+    dprintf(out, "arenas: %zu allocations, %zu bytes, %zu chunks\n", a.allocs,
+            a.bytes, a.chunks);
+    return 0;
+}
+
+// stats: show how often each section of the shell's own work ran, how long it
+// took and how many arena allocations it made, then signal and allocator
+// totals
+// stats -r: reset the section counters
+int m_stats(proc const *p)
+{
+    char **args = p->argv + 1;
+    if (!*args) {
+        return print_stats(p->fds[1]);
+    }
+    Stopif(strcmp(*args, "-r") != 0 || args[1], return 1,
+           "usage: stats [-r]");
+    memset(counters, 0, sizeof counters);
+    return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef M_STATS_H
+#define M_STATS_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
+
+#include "ds/proc.h" // proc
+
+// Sections of the shell's own work that are counted and timed
+typedef enum stat_id {
+    STAT_COMMAND, // A whole line, from parsing to its status being reported
+    STAT_PARSE, // yyparse, or a parse cache hit
+    STAT_LAUNCH, // start_job: everything it takes to get a job running
+    STAT_REDIRECT, // Opening the files a job redirects to
+    STAT_PIPE, // Creating pipes between stages
+    STAT_SPAWN, // Creating a single proc: fork, posix_spawn or the launcher
+    STAT_REAP, // report_job_status, with the reaping it does
+    STAT_PROMPT, // Building the prompt
+    STAT_HISTORY, // Reading and appending to the history file
+    STAT_SUBST, // Running a command substitution and splitting its output
+    STAT_GLOB, // Expanding a pattern into the paths it matches
+    N_STATS,
+} stat_id;
+
+typedef struct stat_span {
+    uint64_t start_ns;
+    size_t allocs; // arena_totals().allocs at the start
+} stat_span;
+
+stat_span stat_begin(void);
+void stat_end(stat_id id, stat_span s);
+void stat_end_detail(stat_id id, stat_span s, char const *detail, size_t len);
+void update_trace(void);
+int m_stats(proc const *p);
+
+#endif
@@ -0,0 +1,433 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Pathname expansion: an argument with an unescaped *, ? or [...] in it is
+// replaced by the paths it matches, in byte order. expand_job leaves it as it
+// is (less its escapes) if there are none. Patterns are matched one path
+// component at a time. Components without wildcards are opened or looked up
+// directly; the others are matched with fnmatch against a listing of the
+// directory, read with getdents64 where there is one. Leading dots have to be
+// matched explicitly, and . and .. never match.
+//
+// With the globcache option set, listings are kept for that many seconds and
+// reused for as long as the directory's mtime hasn't changed, so a script
+// globbing the same large directory over and over only reads it once. A
+// listing is only kept if the directory hadn't changed for a while when it
+// was read; otherwise a change within the same timestamp tick could go
+// unnoticed.
+
+#define _GNU_SOURCE // O_DIRECTORY, openat, fstatat, syscall, DT_*
+
+#include <errno.h> // errno, EINTR
+#include <fnmatch.h> // fnmatch
+#include <stdint.h> // uint64_t
+#include <stdlib.h> // qsort
+#include <string.h> // strcmp, strlen, strtok, memcpy, memchr
+
+#include <dirent.h> // DT_DIR, DT_LNK, DT_UNKNOWN, fdopendir, readdir
+#include <fcntl.h> // openat, O_RDONLY, O_DIRECTORY, O_CLOEXEC
+#include <linux/limits.h> // PATH_MAX
+#include <sys/stat.h> // fstat, fstatat, S_ISDIR
+#include <sys/syscall.h> // SYS_getdents64
+#include <time.h> // clock_gettime
+#include <unistd.h> // close, dup, syscall
+
+#include "ds/arena.h" // arena_new, arena_free, arena_strndup
+#include "ds/vec.h" // Vec_push, vec_len, vec_alloc_arena
+#include "options.h" // Num_opt, OPT_GLOBCACHE
+#include "stats.h" // stat_begin, stat_end_detail
+#include "wildcard.h" // prototypes
+#include "macros.h" // Arr_len
+
+// Listings kept by the cache
+#define GLOB_CACHE_SIZE 16
+// How long a directory must have been left alone for its listing to be kept
+#define MTIME_SLACK_NS (50 * 1000 * 1000)
+// Bytes of directory entries read by one getdents64 call
+#define DENTS_BUF_SIZE (32 * 1024)
+
+typedef struct dir_entry {
+    char *name;
+    unsigned char type; // DT_*, DT_UNKNOWN if the file system doesn't say
+} dir_entry;
+
+// The entries of a directory, other than . and ..
+typedef struct listing {
+    arena *a; // Holds the entries, NULL for an unused cache slot
+    dir_entry *entries; // Vec
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime; // Of the directory, when it was read
+    struct timespec read_at; // CLOCK_REALTIME
+    int users; // Matches going on over the listing; it can't be evicted
+    uint64_t last_used;
+} listing;
+
+typedef struct glob_state {
+    arena *a; // Matches are allocated here
+    char ***argv; // And appended here
+    char path[PATH_MAX]; // Path of the match being built
+    size_t len;
+} glob_state;
+
+static listing cache[GLOB_CACHE_SIZE];
+static uint64_t use_count;
+
+// True if str (of length len) has a wildcard in it that isn't escaped. A [
+// only counts if a ] follows, so [ on its own (the test command) is a word
+bool has_glob_magic(char const *str, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        switch (str[i]) {
+        case '\\':
+            i++;
+            break;
+        case '*':
+        case '?':
+            return true;
+        case '[':
+            if (memchr(str + i + 1, ']', len - i - 1)) {
+                return true;
+            }
+            break;
+        }
+    }
+    return false;
+}
+
+// Remove the backslash escapes from pattern in place, turning it into the
+// word it stands for when nothing matches. Returns pattern
+char *glob_literal(char *pattern)
+{
+    char *out = pattern;
+    for (char const *in = pattern; *in; in++) {
+        if (*in == '\\' && in[1]) {
+            in++;
+        }
+        *out++ = *in;
+    }
+    *out = '\0';
+    return pattern;
+}
+
+static void add_entry(listing *l, char const *name, size_t len,
+                      unsigned char type)
+{
+    // Neither . nor .. is ever matched
+    if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'))) {
+        return;
+    }
+    dir_entry e = {arena_strndup(l->a, name, len), type};
+    Vec_push(&l->entries, e);
+}
+
+#ifdef SYS_getdents64
+// What getdents64 fills its buffer with
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Read every entry of the directory open at fd into l. Returns false on
+// failure
+static bool read_entries(int fd, listing *l)
+{
+    static uint64_t buf[DENTS_BUF_SIZE / sizeof (uint64_t)];
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, buf, sizeof buf);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return n == 0;
+        }
+        for (long off = 0; off < n;) {
+            struct linux_dirent64 *d = (void *) ((char *) buf + off);
+            add_entry(l, d->d_name, strlen(d->d_name), d->d_type);
+            off += d->d_reclen;
+        }
+    }
+}
+#else
+static bool read_entries(int fd, listing *l)
+{
+    // closedir closes the fd it was given, which still belongs to the caller
+    int dir_fd = dup(fd);
+    DIR *dir = dir_fd >= 0 ? fdopendir(dir_fd) : NULL;
+    if (!dir) {
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        return false;
+    }
+    struct dirent *d;
+    while ((d = readdir(dir))) {
+        add_entry(l, d->d_name, strlen(d->d_name), d->d_type);
+    }
+    closedir(dir);
+    return true;
+}
+#endif
+
+static void drop_listing(listing *l)
+{
+    if (l->a) {
+        arena_free(l->a);
+        l->a = NULL;
+    }
+}
+
+static inline bool same_time(struct timespec a, struct timespec b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static inline int64_t ns_between(struct timespec from, struct timespec to)
+{
+    return (int64_t) (to.tv_sec - from.tv_sec) * 1000000000
+           + (to.tv_nsec - from.tv_nsec);
+}
+
+// The cache slot a new listing of a directory last changed at mtime should
+// go in, or NULL if it shouldn't be kept. An unused slot is preferred, then
+// the one used longest ago that nothing is matching over
+static listing *cache_slot(struct timespec mtime, struct timespec now)
+{
+    if (ns_between(mtime, now) < MTIME_SLACK_NS) {
+        return NULL;
+    }
+    listing *victim = NULL;
+    for (size_t i = 0; i < Arr_len(cache); i++) {
+        listing *c = &cache[i];
+        if (!c->a) {
+            return c;
+        } else if (!c->users
+                   && (!victim || c->last_used < victim->last_used)) {
+            victim = c;
+        }
+    }
+    if (victim) {
+        drop_listing(victim);
+    }
+    return victim;
+}
+
+// Listing of the directory open at fd, from the cache if it is still good
+// there, otherwise read into a cache slot or into scratch. Returns NULL if the
+// directory can't be read. Pass the result to release_listing when done
+static listing *get_listing(int fd, listing *scratch)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return NULL;
+    }
+    long ttl = Num_opt(OPT_GLOBCACHE);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    listing *l = scratch;
+    if (ttl) {
+        for (size_t i = 0; i < Arr_len(cache); i++) {
+            listing *c = &cache[i];
+            if (!c->a || c->dev != st.st_dev || c->ino != st.st_ino) {
+                continue;
+            }
+            if (same_time(c->mtime, st.st_mtim)
+                && ns_between(c->read_at, now) < ttl * 1000000000LL) {
+                c->users++;
+                c->last_used = ++use_count;
+                return c;
+            } else if (!c->users) {
+                drop_listing(c);
+            }
+            break;
+        }
+        listing *slot = cache_slot(st.st_mtim, now);
+        if (slot) {
+            l = slot;
+        }
+    }
+
+    *l = (listing) {.a = arena_new(), .dev = st.st_dev, .ino = st.st_ino,
+                    .mtime = st.st_mtim, .read_at = now, .users = 1,
+                    .last_used = ++use_count};
+    l->entries = vec_alloc_arena(64 * sizeof *l->entries, l->a);
+    if (!read_entries(fd, l)) {
+        drop_listing(l);
+        return NULL;
+    }
+    return l;
+}
+
+static void release_listing(listing *l)
+{
+    l->users--;
+    if (l < cache || l >= cache + Arr_len(cache)) {
+        drop_listing(l);
+    }
+}
+
+// Append name (of length len) to the path being built. Returns false if it
+// doesn't fit
+static bool append(glob_state *s, char const *name, size_t len)
+{
+    if (s->len + len + 2 > sizeof s->path) {
+        return false;
+    }
+    memcpy(s->path + s->len, name, len);
+    s->len += len;
+    s->path[s->len] = '\0';
+    return true;
+}
+
+// The path built is a match
+static void add_match(glob_state *s, bool dir_only)
+{
+    if (dir_only) {
+        append(s, "/", 1);
+    }
+    Vec_push(s->argv, arena_strndup(s->a, s->path, s->len));
+}
+
+static void match_from(glob_state *s, int dir_fd, char **comp, bool *magic,
+                       size_t n, bool dir_only);
+
+// Match what is left of the pattern inside the directory name in dir_fd,
+// which has been appended to the path
+static void descend(glob_state *s, int dir_fd, char const *name, char **comp,
+                    bool *magic, size_t n, bool dir_only)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    if (append(s, "/", 1)) {
+        match_from(s, fd, comp, magic, n, dir_only);
+    }
+    close(fd);
+}
+
+// True if name in dir_fd is a directory, or a link to one
+static bool is_dir(int dir_fd, dir_entry const *e)
+{
+    if (e->type != DT_UNKNOWN && e->type != DT_LNK) {
+        return e->type == DT_DIR;
+    }
+    struct stat st;
+    return fstatat(dir_fd, e->name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Match the n components left in comp (magic[i] says whether comp[i] has
+// wildcards) against what is in the directory open at dir_fd, whose path
+// makes up the path built so far. If dir_only is set, the pattern ended in a
+// / and only directories can match
+static void match_from(glob_state *s, int dir_fd, char **comp, bool *magic,
+                       size_t n, bool dir_only)
+{
+    size_t len = s->len;
+    if (!*magic) {
+        // Looked up, not listed
+        if (append(s, *comp, strlen(*comp))) {
+            struct stat st;
+            if (n > 1) {
+                descend(s, dir_fd, *comp, comp + 1, magic + 1, n - 1,
+                        dir_only);
+            } else if (fstatat(dir_fd, *comp, &st,
+                               dir_only ? 0 : AT_SYMLINK_NOFOLLOW) == 0
+                       && (!dir_only || S_ISDIR(st.st_mode))) {
+                add_match(s, dir_only);
+            }
+        }
+        s->len = len;
+        return;
+    }
+
+    listing scratch;
+    listing *l = get_listing(dir_fd, &scratch);
+    if (!l) {
+        return;
+    }
+    bool dots = **comp == '.';
+    size_t n_entries = vec_len(l->entries);
+    for (size_t i = 0; i < n_entries; i++) {
+        dir_entry const *e = &l->entries[i];
+        if ((e->name[0] == '.' && !dots) || fnmatch(*comp, e->name, 0)
+            || !append(s, e->name, strlen(e->name))) {
+            continue;
+        }
+        if (n > 1) {
+            if (e->type == DT_DIR || e->type == DT_LNK
+                || e->type == DT_UNKNOWN) {
+                descend(s, dir_fd, e->name, comp + 1, magic + 1, n - 1,
+                        dir_only);
+            }
+        } else if (!dir_only || is_dir(dir_fd, e)) {
+            add_match(s, dir_only);
+        }
+        s->len = len;
+    }
+    release_listing(l);
+}
+
+static int compare_paths(void const *a, void const *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Append the paths pattern matches to *argv, sorted, allocating them out of
+// a. Returns how many there were
+size_t glob_word(char const *pattern, arena *a, char ***argv)
+{
+    stat_span span = stat_begin();
+    size_t pattern_len = strlen(pattern);
+    size_t start = vec_len(*argv);
+
+    // Split a copy of the pattern into its components
+    static char buf[PATH_MAX];
+    char *comp[PATH_MAX / 2];
+    bool magic[PATH_MAX / 2];
+    size_t n = 0;
+    if (pattern_len < sizeof buf) {
+        memcpy(buf, pattern, pattern_len + 1);
+        for (char *c = strtok(buf, "/"); c; c = strtok(NULL, "/")) {
+            magic[n] = has_glob_magic(c, strlen(c));
+            comp[n] = magic[n] ? c : glob_literal(c);
+            n++;
+        }
+    }
+
+    bool absolute = *pattern == '/';
+    int dir_fd = n ? open(absolute ? "/" : ".",
+                          O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                   : -1;
+    if (dir_fd >= 0) {
+        glob_state s = {.a = a, .argv = argv};
+        if (absolute) {
+            append(&s, "/", 1);
+        }
+        match_from(&s, dir_fd, comp, magic, n,
+                   pattern[pattern_len - 1] == '/');
+        close(dir_fd);
+    }
+
+    size_t found = vec_len(*argv) - start;
+    qsort(*argv + start, found, sizeof **argv, compare_paths);
+    stat_end_detail(STAT_GLOB, span, pattern, pattern_len);
+    return found;
+}
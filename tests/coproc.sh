@@ -0,0 +1,30 @@
+#!/bin/sh
+# Regression tests for coprocesses, run by `make test`. MARCEL is the shell
+# under test
+MARCEL=${MARCEL:-./marcel}
+failed=0
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# expect NAME WANT GOT
+expect() {
+    if [ "$2" != "$3" ]; then
+        printf 'FAIL %s: wanted "%s", got "%s"\n' "$1" "$2" "$3"
+        failed=1
+    fi
+}
+
+# A builtin forked as a pipeline stage must not hold on to a coprocess's
+# input, or closing it never reaches the coprocess
+printf '#!/bin/sh\ncat > /dev/null\necho eof > "$1"\n' > "$tmp/co"
+chmod +x "$tmp/co"
+cat > "$tmp/script" << EOF2
+coproc s $tmp/co $tmp/done
+seq 1 | parallel sleep 3 | cat > /dev/null &
+coproc -c s
+sleep 1
+cat $tmp/done
+EOF2
+expect "forked builtin" "eof" "$(timeout 10 "$MARCEL" "$tmp/script" 2>&1)"
+
+exit $failed
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Regression tests for the command hash, run by `make test`. MARCEL is the
+# shell under test
+MARCEL=${MARCEL:-./marcel}
+failed=0
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# expect NAME WANT GOT
+expect() {
+    if [ "$2" != "$3" ]; then
+        printf 'FAIL %s: wanted "%s", got "%s"\n' "$1" "$2" "$3"
+        failed=1
+    fi
+}
+
+# A command found through a relative PATH entry is looked up again from
+# wherever the shell is when it is run next
+mkdir "$tmp/a" "$tmp/b" "$tmp/bin"
+printf '#!/bin/sh\necho a\n' > "$tmp/a/tool"
+printf '#!/bin/sh\necho bin\n' > "$tmp/bin/tool"
+chmod +x "$tmp/a/tool" "$tmp/bin/tool"
+# Not executable, so it is passed over
+: > "$tmp/b/tool"
+printf 'cd %s/a\ntool\ncd %s/b\ntool\n' "$tmp" "$tmp" > "$tmp/script"
+for dir in . ''; do
+    expect "PATH=$dir:" "a bin" \
+           "$(PATH="$dir:$tmp/bin:$PATH" "$MARCEL" "$tmp/script" 2>&1 \
+              | tr '\n' ' ' | sed 's/ $//')"
+done
+
+exit $failed
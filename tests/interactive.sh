@@ -0,0 +1,69 @@
+#!/bin/sh
+# Regression tests for the interactive shell, run by `make test` on a pseudo
+# terminal driven by python3 (skipped without it). MARCEL is the shell under
+# test
+MARCEL=${MARCEL:-./marcel}
+command -v python3 > /dev/null || exit 0
+failed=0
+# Keeps history and the like out of the real home directory
+HOME=$(mktemp -d)
+export HOME
+trap 'rm -rf "$HOME"' EXIT
+
+# expect NAME WANT GOT
+expect() {
+    case $3 in
+    *"$2"*) ;;
+    *)
+        printf 'FAIL %s: wanted "%s" in "%s"\n' "$1" "$2" "$3"
+        failed=1
+        ;;
+    esac
+}
+
+# run LINE... types each line into an interactive shell and prints everything
+# it wrote to the terminal
+run() {
+    python3 - "$MARCEL" "$@" << 'PY'
+import os, pty, select, sys, time
+pid, fd = pty.fork()
+if pid == 0:
+    # A session leader can't be put in a process group of its own, which the
+    # shell does, so it runs in a child that is given the terminal
+    os.environ['TERM'] = 'dumb'
+    shell = os.fork()
+    if shell == 0:
+        os.setpgid(0, 0)
+        os.execv(sys.argv[1], [sys.argv[1]])
+    os.setpgid(shell, shell)
+    os.tcsetpgrp(0, shell)
+    os.waitpid(shell, 0)
+    os._exit(0)
+out = b''
+def pump(t):
+    global out
+    end = time.time() + t
+    while time.time() < end:
+        if select.select([fd], [], [], 0.05)[0]:
+            try:
+                out += os.read(fd, 65536)
+            except OSError:
+                return
+for line in sys.argv[2:]:
+    pump(0.5)
+    os.write(fd, line.encode() + b'\n')
+os.write(fd, b'exit\n')
+pump(2)
+# The shell is hung up on if it's still around
+os.kill(pid, 9)
+os.close(fd)
+sys.stdout.write(out.decode(errors='replace'))
+PY
+}
+
+# A foreground pipeline that fails partway through starting hands the
+# terminal back, so the shell can go on reading
+expect "partial pipeline" "Still here" \
+       "$(run 'ulimit -n 5' 'sleep 1 | cat | cat' 'echo still here | tr s S')"
+
+exit $failed
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Regression tests for redirections, run by `make test`. MARCEL is the shell
+# under test
+MARCEL=${MARCEL:-./marcel}
+failed=0
+
+# expect NAME WANT GOT
+expect() {
+    if [ "$2" != "$3" ]; then
+        printf 'FAIL %s: wanted "%s", got "%s"\n' "$1" "$2" "$3"
+        failed=1
+    fi
+}
+
+# A dup or close right after a word (no space) must keep its direction
+expect "word>&2" "hi" "$("$MARCEL" -c 'echo hi>&2' 2>&1 >/dev/null)"
+expect "word<&0" "in" "$(echo in | "$MARCEL" -c 'cat -<&0')"
+expect "word>&-" "0" "$("$MARCEL" -c 'echo hi>&-' >/dev/null 2>&1; echo $?)"
+expect "glob>&2" "tests/redirect.sh" \
+       "$("$MARCEL" -c 'echo tests/redirect.s*>&2' 2>&1 >/dev/null)"
+expect "A=x>&2" "A=x" "$("$MARCEL" -c 'echo A=x>&2' 2>&1 >/dev/null)"
+
+exit $failed
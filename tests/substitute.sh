@@ -0,0 +1,38 @@
+#!/bin/sh
+# Regression tests for command substitution, run by `make test`. MARCEL is the
+# shell under test
+MARCEL=${MARCEL:-./marcel}
+failed=0
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# expect NAME WANT GOT
+expect() {
+    if [ "$2" != "$3" ]; then
+        printf 'FAIL %s: wanted "%s", got "%s"\n' "$1" "$2" "$3"
+        failed=1
+    fi
+}
+
+# Output redirected away from the substitution leaves it with nothing to read
+expect "redirected" "a b" \
+       "$(cd "$tmp" && timeout 10 "$MARCEL" -c 'echo a $(echo hi > f) b')"
+
+# A lone builtin runs in the shell itself, and must not block on output that
+# doesn't fit in a pipe
+mkdir "$tmp/bin"
+i=0
+names=
+while [ $i -lt 300 ]; do
+    i=$((i + 1))
+    : > "$tmp/bin/cmd$i"
+    chmod +x "$tmp/bin/cmd$i"
+    names="$names cmd$i"
+done
+printf 'setopt pipesize 4096\nhash%s\nprintf "%%s\\n" $(hash)\n' "$names" \
+       > "$tmp/builtin"
+expect "builtin" "300" \
+       "$(PATH="$tmp/bin:$PATH" timeout 10 "$MARCEL" "$tmp/builtin" \
+          | grep -c '^cmd')"
+
+exit $failed